@@ -0,0 +1,41 @@
+#include "Allocations.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// Kept in their own translation unit so the compiler never sees the
+// malloc/free pairing behind operator new and delete.
+static std::atomic<size_t> count{0};
+static std::atomic<size_t> bytes{0};
+
+size_t allocationCount()
+{
+    return count.load(std::memory_order_relaxed);
+}
+
+size_t allocationBytes()
+{
+    return bytes.load(std::memory_order_relaxed);
+}
+
+void *operator new(size_t size)
+{
+    count.fetch_add(1, std::memory_order_relaxed);
+    bytes.fetch_add(size, std::memory_order_relaxed);
+    if (void *memory = std::malloc(size ? size : 1))
+    {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *memory) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void *memory, size_t) noexcept
+{
+    std::free(memory);
+}
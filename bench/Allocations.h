@@ -0,0 +1,11 @@
+#ifndef ALLOCATIONS_H
+#define ALLOCATIONS_H
+
+#include <cstddef>
+
+// Totals of every operator new call in the benchmark binary, counted by the
+// replacement operators in Allocations.cpp.
+size_t allocationCount();
+size_t allocationBytes();
+
+#endif // ALLOCATIONS_H
@@ -0,0 +1,512 @@
+#include "../frontend/Parser.h"
+#include "../frontend/AstCache.h"
+#include "../frontend/Source.h"
+#include "../runtime/Interpreter.h"
+#include "../runtime/Environment.h"
+#include "../runtime/Heap.h"
+#include "../runtime/Optimizer.h"
+#include "../runtime/Resolver.h"
+#include "../runtime/Stats.h"
+#include "../runtime/Compiler.h"
+#include "../runtime/Jit.h"
+#include "../runtime/VM.h"
+#include "Allocations.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Benchmark harness: runs each workload through the lexer, parser, AST
+// cache loader, bytecode VM with and without the JIT and tree-walker, and
+// reports per-phase throughput, allocations and peak RSS as JSON. With
+// --compare it also checks the results against a saved baseline and exits
+// non-zero when a metric regressed.
+
+using Clock = std::chrono::steady_clock;
+
+// Flattened results: "workload.phase.metric" -> value.
+using Metrics = std::map<std::string, double>;
+
+struct Options
+{
+    double minTime = 0.3;
+    size_t generatedSize = 20000;
+    double threshold = 10;
+    std::string output;
+    std::string baseline;
+    std::vector<std::string> workloads;
+};
+
+struct Workload
+{
+    std::string name;
+    std::string source;
+};
+
+// Runs body in several batches that together take at least minTime seconds
+// and returns the best rate in iterations per second, which is far less
+// noisy than the mean on a shared machine.
+template <typename F>
+static double repeat(double minTime, F body)
+{
+    const int Batches = 5;
+    double best = 0;
+
+    for (int batch = 0; batch < Batches; batch++)
+    {
+        size_t iterations = 0;
+        Clock::time_point start = Clock::now();
+        double elapsed = 0;
+
+        do
+        {
+            body();
+            iterations++;
+            elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+        } while (elapsed < minTime / Batches);
+
+        best = std::max(best, iterations / elapsed);
+    }
+
+    return best;
+}
+
+// Identifiers are letters only, so numbers are spelled in base 26.
+static std::string letters(size_t n)
+{
+    std::string name;
+    do
+    {
+        name += static_cast<char>('a' + n % 26);
+        n /= 26;
+    } while (n > 0);
+    return name;
+}
+
+static std::string generateSource(size_t count)
+{
+    std::ostringstream out;
+    for (size_t i = 0; i < count; i++)
+    {
+        std::string name = letters(i);
+        out << "fn fx" << name << "(a, b) { let c = a * " << i % 97 << " + b; {value: c, index: " << i << "} }\n";
+        out << "let vx" << name << " = fx" << name << "(" << i << ", " << i % 13 << ");\n";
+        out << "let wx" << name << " = vx" << name << ".value + vx" << name << ".index;\n";
+    }
+    return out.str();
+}
+
+static std::string workloadName(const std::string &path)
+{
+    size_t slash = path.find_last_of('/');
+    std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+    size_t dot = name.find_last_of('.');
+    return dot == std::string::npos ? name : name.substr(0, dot);
+}
+
+// getrusage only knows the peak of the whole process, which stops moving
+// once the largest workload has run. Linux can reset the peak (VmHWM) to
+// the current RSS instead; elsewhere the process-wide peak is reported.
+static bool resetPeakRss()
+{
+    std::ofstream clearRefs("/proc/self/clear_refs");
+    return static_cast<bool>(clearRefs << "5" << std::flush);
+}
+
+static size_t peakRssKbSinceReset()
+{
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line))
+    {
+        if (line.compare(0, 6, "VmHWM:") == 0)
+        {
+            return std::strtoull(line.c_str() + 6, nullptr, 10);
+        }
+    }
+    return peakRssKb();
+}
+
+static void runWorkload(const Workload &workload, const Options &options, Metrics &metrics)
+{
+    const std::string prefix = workload.name + ".";
+    bool peakReset = resetPeakRss();
+
+    // Lexing
+    size_t tokens = 0;
+    double lex = repeat(options.minTime, [&]()
+                      {
+                          Lexer lexer(workload.source);
+                          tokens = 0;
+                          while (lexer.next().type != TokenType::EndOfFile)
+                          {
+                              tokens++;
+                          } });
+    metrics[prefix + "lex.tokens"] = tokens;
+    metrics[prefix + "lex.tokens_per_s"] = tokens * lex;
+
+    // Parsing
+    Parser parser;
+    size_t nodes = 0;
+    double parse = repeat(options.minTime, [&]()
+                        {
+                            std::unique_ptr<Program> program(parser.produceAST(workload.source));
+                            nodes = program->arena.objectCount(); });
+    metrics[prefix + "parse.nodes"] = nodes;
+    metrics[prefix + "parse.nodes_per_s"] = nodes * parse;
+    metrics[prefix + "parse.mb_per_s"] = workload.source.size() * parse / 1e6;
+
+    // Rebuilding the same Program from a cached image
+    std::string image;
+    {
+        std::unique_ptr<Program> program(parser.produceAST(workload.source));
+        image = AstCache::serialize(workload.source, program.get());
+    }
+    double load = repeat(options.minTime, [&]()
+                       { std::unique_ptr<Program> program(AstCache::deserialize(image, workload.source)); });
+    metrics[prefix + "cache_load.nodes_per_s"] = nodes * load;
+    metrics[prefix + "cache_load.image_kb"] = image.size() / 1024.0;
+
+    // Evaluation. Declarations only store into slots the Resolver reserved,
+    // so one resolved program can run any number of times in its global
+    // environment.
+    std::unique_ptr<Program> program(parser.produceAST(workload.source));
+    Optimizer optimizer;
+    optimizer.optimize(program.get());
+
+    Environment *env = createGlobalEnv();
+    Resolver resolver(env);
+    resolver.resolve(program.get());
+
+    Compiler compiler;
+    std::unique_ptr<FunctionProto> script = compiler.compile(program.get());
+    VM vm;
+    Heap &heap = Heap::current();
+
+    size_t evals = 0;
+    size_t allocationsBefore = allocationCount();
+    size_t bytesBefore = allocationBytes();
+    size_t gcBytesBefore = heap.getStats().bytesAllocated;
+
+    metrics[prefix + "eval.evals_per_s"] = repeat(options.minTime, [&]()
+                                                  {
+                                                      vm.run(script.get(), env);
+                                                      evals++; });
+    metrics[prefix + "eval.allocations_per_eval"] = static_cast<double>(allocationCount() - allocationsBefore) / evals;
+    metrics[prefix + "eval.bytes_per_eval"] = static_cast<double>(allocationBytes() - bytesBefore) / evals;
+    metrics[prefix + "eval.gc_bytes_per_eval"] = static_cast<double>(heap.getStats().bytesAllocated - gcBytesBefore) / evals;
+
+    // The VM again without compiling anything, to show what the JIT adds.
+    jitEnabled = false;
+    metrics[prefix + "interpreter.evals_per_s"] = repeat(options.minTime, [&]()
+                                                         { vm.run(script.get(), env); });
+    jitEnabled = true;
+
+    metrics[prefix + "tree_walk.evals_per_s"] = repeat(options.minTime, [&]()
+                                                       { evaluate(program.get(), env); });
+
+    metrics[prefix + "peak_rss_kb"] = peakReset ? peakRssKbSinceReset() : peakRssKb();
+}
+
+static std::string toJson(const Metrics &metrics)
+{
+    // workload -> phase -> metric; metrics without a phase use "".
+    std::map<std::string, std::map<std::string, std::map<std::string, double>>> nested;
+    for (const auto &entry : metrics)
+    {
+        const std::string &key = entry.first;
+        size_t first = key.find('.');
+        size_t last = key.rfind('.');
+        std::string phase = first == last ? "" : key.substr(first + 1, last - first - 1);
+        nested[key.substr(0, first)][phase][key.substr(last + 1)] = entry.second;
+    }
+
+    std::ostringstream out;
+    out << std::setprecision(10);
+    out << "{\n  \"version\": 1,\n  \"workloads\": {";
+
+    const char *workloadSeparator = "";
+    for (const auto &workload : nested)
+    {
+        out << workloadSeparator << "\n    \"" << workload.first << "\": {";
+        workloadSeparator = ",";
+
+        const char *entrySeparator = "";
+        for (const auto &phase : workload.second)
+        {
+            const char *indent = phase.first.empty() ? "      " : "        ";
+            if (!phase.first.empty())
+            {
+                out << entrySeparator << "\n      \"" << phase.first << "\": {";
+                entrySeparator = "";
+            }
+            for (const auto &metric : phase.second)
+            {
+                out << entrySeparator << "\n" << indent << "\"" << metric.first << "\": " << metric.second;
+                entrySeparator = ",";
+            }
+            if (!phase.first.empty())
+            {
+                out << "\n      }";
+            }
+        }
+        out << "\n    }";
+    }
+
+    out << "\n  }\n}\n";
+    return out.str();
+}
+
+// Reads back the subset of JSON that toJson writes: nested objects with
+// string keys and numeric leaves.
+class BaselineReader
+{
+private:
+    const std::string &text;
+    size_t pos = 0;
+
+    void skipSpace()
+    {
+        while (pos < text.size() && isSkippable(text[pos]))
+        {
+            pos++;
+        }
+    }
+
+    void expect(char c)
+    {
+        skipSpace();
+        if (pos >= text.size() || text[pos] != c)
+        {
+            throw std::runtime_error(std::string("Malformed baseline: expected '") + c + "'");
+        }
+        pos++;
+    }
+
+    std::string readString()
+    {
+        expect('"');
+        size_t end = text.find('"', pos);
+        if (end == std::string::npos)
+        {
+            throw std::runtime_error("Malformed baseline: unterminated string");
+        }
+        std::string value = text.substr(pos, end - pos);
+        pos = end + 1;
+        return value;
+    }
+
+    void readValue(const std::string &path, Metrics &metrics)
+    {
+        skipSpace();
+        if (pos < text.size() && text[pos] == '{')
+        {
+            pos++;
+            skipSpace();
+            while (pos < text.size() && text[pos] != '}')
+            {
+                std::string key = readString();
+                expect(':');
+                readValue(path.empty() ? key : path + "." + key, metrics);
+                skipSpace();
+                if (pos < text.size() && text[pos] == ',')
+                {
+                    pos++;
+                }
+                skipSpace();
+            }
+            expect('}');
+            return;
+        }
+
+        size_t used = 0;
+        double value = std::stod(text.substr(pos), &used);
+        pos += used;
+        metrics[path] = value;
+    }
+
+public:
+    BaselineReader(const std::string &text) : text(text) {}
+
+    Metrics read()
+    {
+        Metrics all;
+        readValue("", all);
+
+        // Strip the "workloads." prefix so keys match the live results.
+        Metrics metrics;
+        const std::string prefix = "workloads.";
+        for (const auto &entry : all)
+        {
+            if (entry.first.compare(0, prefix.size(), prefix) == 0)
+            {
+                metrics[entry.first.substr(prefix.size())] = entry.second;
+            }
+        }
+        return metrics;
+    }
+};
+
+static bool endsWith(const std::string &text, const std::string &suffix)
+{
+    return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Throughput regresses when it drops, allocations and memory when they
+// grow. Counts such as tokens and nodes only describe the workload.
+static int compare(const Metrics &baseline, const Metrics &current, double threshold)
+{
+    int regressions = 0;
+
+    for (const auto &entry : current)
+    {
+        auto it = baseline.find(entry.first);
+        if (it == baseline.end() || it->second == 0)
+        {
+            continue;
+        }
+
+        bool higherIsBetter = endsWith(entry.first, "_per_s");
+        bool lowerIsBetter = endsWith(entry.first, "_per_eval") || endsWith(entry.first, "_kb");
+        if (!higherIsBetter && !lowerIsBetter)
+        {
+            continue;
+        }
+
+        double change = (entry.second - it->second) / it->second * 100;
+        bool regressed = higherIsBetter ? change < -threshold : change > threshold;
+        if (regressed)
+        {
+            regressions++;
+        }
+
+        std::cerr << (regressed ? "REGRESSION " : "           ") << std::left << std::setw(40) << entry.first
+                  << std::right << std::setw(14) << std::fixed << std::setprecision(1) << it->second
+                  << " -> " << std::setw(14) << entry.second
+                  << " (" << std::showpos << change << std::noshowpos << "%)\n";
+    }
+
+    std::cerr << regressions << " regression(s) beyond " << threshold << "%\n";
+    return regressions;
+}
+
+static std::string readFile(const std::string &path)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        throw std::runtime_error("Cannot open " + path);
+    }
+    std::ostringstream contents;
+    contents << file.rdbuf();
+    return contents.str();
+}
+
+static void usage(const char *program)
+{
+    std::cerr << "Usage: " << program
+              << " [--min-time SECONDS] [--generated N] [--output FILE] [--compare BASELINE] [--threshold PERCENT] workload...\n";
+}
+
+int main(int argc, char **argv)
+{
+    Options options;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (arg == "--min-time" && hasValue)
+        {
+            options.minTime = std::atof(argv[++i]);
+        }
+        else if (arg == "--generated" && hasValue)
+        {
+            options.generatedSize = std::strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--output" && hasValue)
+        {
+            options.output = argv[++i];
+        }
+        else if (arg == "--compare" && hasValue)
+        {
+            options.baseline = argv[++i];
+        }
+        else if (arg == "--threshold" && hasValue)
+        {
+            options.threshold = std::atof(argv[++i]);
+        }
+        else if (arg.size() > 1 && arg[0] == '-')
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        else
+        {
+            options.workloads.push_back(arg);
+        }
+    }
+
+    Metrics metrics;
+
+    try
+    {
+        std::vector<Workload> workloads;
+        for (const std::string &path : options.workloads)
+        {
+            SourceFile source(path);
+            workloads.push_back({workloadName(path), std::string(source.text())});
+        }
+        if (options.generatedSize > 0)
+        {
+            workloads.push_back({"generated" + std::to_string(options.generatedSize), generateSource(options.generatedSize)});
+        }
+
+        for (const Workload &workload : workloads)
+        {
+            std::cerr << "bench: " << workload.name << "\n";
+            runWorkload(workload, options, metrics);
+        }
+    }
+    catch (const std::runtime_error &error)
+    {
+        std::cerr << "Error: " << error.what() << "\n";
+        return 1;
+    }
+
+    std::string json = toJson(metrics);
+    std::cout << json;
+
+    if (!options.output.empty())
+    {
+        std::ofstream(options.output) << json;
+    }
+
+    if (!options.baseline.empty())
+    {
+        try
+        {
+            std::string text = readFile(options.baseline);
+            if (compare(BaselineReader(text).read(), metrics, options.threshold) > 0)
+            {
+                return 1;
+            }
+        }
+        catch (const std::exception &error)
+        {
+            std::cerr << "Error: " << error.what() << "\n";
+            return 1;
+        }
+    }
+
+    return 0;
+}
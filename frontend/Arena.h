@@ -0,0 +1,114 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Bump allocator that owns every node of one parsed Program. Nodes are laid
+// out back to back in large blocks and released together when the arena is
+// destroyed; nodes that own heap memory (strings, vectors) are finalized in
+// reverse order of construction first.
+class Arena
+{
+private:
+    static constexpr size_t BlockSize = 64 * 1024;
+
+    struct Finalizer
+    {
+        void (*destroy)(void *);
+        void *object;
+        Finalizer *next;
+    };
+
+    std::vector<char *> blocks;
+    char *cursor = nullptr;
+    char *limit = nullptr;
+    Finalizer *finalizers = nullptr;
+    size_t used = 0;
+    size_t objects = 0;
+
+    void *allocateBlock(size_t size)
+    {
+        char *block = static_cast<char *>(std::malloc(size));
+        if (!block)
+        {
+            throw std::bad_alloc();
+        }
+        blocks.push_back(block);
+        return block;
+    }
+
+public:
+    Arena() = default;
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    ~Arena()
+    {
+        for (Finalizer *f = finalizers; f; f = f->next)
+        {
+            f->destroy(f->object);
+        }
+        for (char *block : blocks)
+        {
+            std::free(block);
+        }
+    }
+
+    void *allocate(size_t size, size_t align)
+    {
+        uintptr_t current = reinterpret_cast<uintptr_t>(cursor);
+        uintptr_t aligned = (current + align - 1) & ~(uintptr_t)(align - 1);
+
+        if (!cursor || aligned + size > reinterpret_cast<uintptr_t>(limit))
+        {
+            // Oversized requests get a dedicated block so they do not waste
+            // the remainder of the current one.
+            if (size + align > BlockSize / 4)
+            {
+                used += size;
+                uintptr_t big = reinterpret_cast<uintptr_t>(allocateBlock(size + align));
+                return reinterpret_cast<void *>((big + align - 1) & ~(uintptr_t)(align - 1));
+            }
+
+            cursor = static_cast<char *>(allocateBlock(BlockSize));
+            limit = cursor + BlockSize;
+            current = reinterpret_cast<uintptr_t>(cursor);
+            aligned = (current + align - 1) & ~(uintptr_t)(align - 1);
+        }
+
+        cursor = reinterpret_cast<char *>(aligned + size);
+        used += size;
+        return reinterpret_cast<void *>(aligned);
+    }
+
+    template <typename T, typename... Args>
+    T *make(Args &&...args)
+    {
+        void *memory = allocate(sizeof(T), alignof(T));
+        T *object = new (memory) T(std::forward<Args>(args)...);
+        objects++;
+
+        if (!std::is_trivially_destructible<T>::value)
+        {
+            Finalizer *f = static_cast<Finalizer *>(allocate(sizeof(Finalizer), alignof(Finalizer)));
+            f->destroy = [](void *p)
+            { static_cast<T *>(p)->~T(); };
+            f->object = object;
+            f->next = finalizers;
+            finalizers = f;
+        }
+
+        return object;
+    }
+
+    size_t bytesUsed() const { return used; }
+    size_t objectCount() const { return objects; }
+};
+
+#endif // ARENA_H
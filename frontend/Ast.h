@@ -1,6 +1,10 @@
 #ifndef AST_H
 #define AST_H
 
+#include "Arena.h"
+#include "Symbol.h"
+
+#include <cstdint>
 #include <vector>
 #include <string>
 
@@ -13,6 +17,7 @@ enum class NodeType
     IfStmt,
     ForStmt,
     WhileStmt,
+    BlockStmt,
 
     // Expressions
     AssignmentExpr,
@@ -22,15 +27,40 @@ enum class NodeType
     // Literals
     Property,
     ObjectLiteral,
+    ArrayLiteral,
     NumericLiteral,
+    StringLiteral,
     Identifier,
     BinaryExpr,
 
 };
 
+enum class Operator
+{
+    Add,
+    Subtract,
+    Multiply,
+    Divide,
+    Modulo,
+
+    // Comparisons, which give booleans
+    Less,
+    LessEqual,
+    Greater,
+    GreaterEqual,
+    Equal,
+    NotEqual,
+};
+
+inline bool isComparison(Operator op)
+{
+    return op >= Operator::Less;
+}
+
 struct Stmt
 {
     NodeType kind;
+    uint32_t line = 0; // source line, 0 when unknown
     virtual ~Stmt() = default;
 };
 
@@ -54,9 +84,9 @@ struct BinaryExpr : Expr
 {
     Expr *left;
     Expr *right;
-    std::string op;
+    Operator op;
 
-    BinaryExpr(Expr *left, Expr *right, const std::string &op)
+    BinaryExpr(Expr *left, Expr *right, Operator op)
         : left(left), right(right), op(op)
     {
         this->kind = NodeType::BinaryExpr;
@@ -90,9 +120,11 @@ struct MemberExpr : Expr
 
 struct Identifier : Expr
 {
-    std::string symbol;
+    Symbol symbol;
+    int depth = -1; // environments to walk up, set by the Resolver
+    int slot = -1;
 
-    Identifier(const std::string &symbol)
+    Identifier(Symbol symbol)
         : symbol(symbol)
     {
         this->kind = NodeType::Identifier;
@@ -110,12 +142,27 @@ struct NumericLiteral : Expr
     }
 };
 
+// The text is interned, so every evaluation can share it instead of
+// copying it into each new string.
+struct StringLiteral : Expr
+{
+    Symbol value;
+
+    StringLiteral(Symbol value)
+        : value(value)
+    {
+        this->kind = NodeType::StringLiteral;
+    }
+};
+
 struct Property : Expr
 {
-    std::string key;
+    Symbol key;
     Expr *value;
+    int depth = -1; // binding of the shorthand form `{ key }`
+    int slot = -1;
 
-    Property(std::string key, Expr *value)
+    Property(Symbol key, Expr *value)
         : key(key), value(value)
     {
         this->kind = NodeType::Property;
@@ -133,9 +180,24 @@ struct ObjectLiteral : Expr
     }
 };
 
+struct ArrayLiteral : Expr
+{
+    std::vector<Expr *> elements;
+
+    ArrayLiteral(std::vector<Expr *> elements)
+        : elements(elements)
+    {
+        this->kind = NodeType::ArrayLiteral;
+    }
+};
+
 struct Program : Stmt
 {
     std::vector<Stmt *> body;
+    Arena arena; // owns every node reachable from body
+    // Problems the parse recovered from, for the caller to report with
+    // the script's name; they are not saved in the AST cache.
+    std::vector<std::string> diagnostics;
 
     Program()
     {
@@ -146,9 +208,10 @@ struct Program : Stmt
 struct VarDeclaration : Stmt
 {
     bool constant;
-    std::string identifier;
+    Symbol identifier;
     Expr *value;
-    VarDeclaration(bool constant, const std::string identifier, Expr *value)
+    int slot = -1;
+    VarDeclaration(bool constant, Symbol identifier, Expr *value)
         : constant(constant), identifier(identifier), value(value)
     {
         kind = NodeType::VarDeclaration;
@@ -158,10 +221,13 @@ struct VarDeclaration : Stmt
 struct FunctionDeclaration : Stmt
 {
     std::vector<Stmt *> body;
-    std::string name;
-    std::vector<std::string> parameters;
+    Symbol name;
+    std::vector<Symbol> parameters;
+    int slot = -1;
+    int localCount = 0; // parameters followed by locals
+    bool captured = false; // locals used by a nested function, set by the Resolver
 
-    FunctionDeclaration(std::vector<Stmt *> body, const std::string &name, std::vector<std::string> parameters)
+    FunctionDeclaration(std::vector<Stmt *> body, Symbol name, std::vector<Symbol> parameters)
         : body(body), name(name), parameters(parameters)
     {
         kind = NodeType::FunctionDeclaration;
@@ -194,6 +260,19 @@ struct WhileStmt : Stmt
     }
 };
 
+// Braces around the statements of a loop or if body. Declarations inside
+// still belong to the enclosing function, like everywhere else.
+struct BlockStmt : Stmt
+{
+    std::vector<Stmt *> body;
+
+    BlockStmt(std::vector<Stmt *> body)
+        : body(body)
+    {
+        kind = NodeType::BlockStmt;
+    }
+};
+
 struct IfStmt : Stmt
 {
     Expr *condition;
@@ -0,0 +1,608 @@
+#include "AstCache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+    // Bump whenever the node layout or the meaning of a field changes.
+    constexpr uint32_t FormatVersion = 5;
+    constexpr char Magic[4] = {'A', 'S', 'T', 'C'};
+    constexpr uint32_t None = UINT32_MAX;
+
+    struct Header
+    {
+        char magic[4];
+        uint32_t version;
+        uint64_t sourceHash;
+        uint64_t sourceLength;
+        uint64_t checksum; // of everything after the header
+        uint32_t nodeCount;
+        uint32_t listCount;
+        uint32_t symbolCount;
+        uint32_t symbolBytes;
+        uint32_t bodyStart; // program body, in lists
+        uint32_t bodyCount;
+    };
+
+    // Field use by kind (children are node indices, names symbol indices;
+    // every record also keeps the node's line):
+    //   VarDeclaration       flags=constant, a=name, b=value
+    //   FunctionDeclaration  a=name, b/c=body list, d/e=parameter list
+    //   IfStmt               a=condition, b=then, c=else
+    //   ForStmt              a=init, b=condition, c=increment, d=body
+    //   WhileStmt            a=condition, b=body
+    //   BlockStmt            b/c=body list
+    //   AssignmentExpr       a=assignee, b=value
+    //   MemberExpr           flags=computed, a=object, b=property
+    //   CallExpr             a=caller, b/c=argument list
+    //   Property             a=key, b=value
+    //   ObjectLiteral        b/c=property list
+    //   ArrayLiteral         b/c=element list
+    //   NumericLiteral       number
+    //   StringLiteral        a=text
+    //   Identifier           a=name
+    //   BinaryExpr           flags=operator, a=left, b=right
+    struct NodeRecord
+    {
+        uint8_t kind;
+        uint8_t flags;
+        uint16_t reserved;
+        uint32_t a, b, c, d, e;
+        uint32_t line;
+        uint32_t padding;
+        double number;
+    };
+
+    static_assert(sizeof(NodeRecord) == 40, "NodeRecord layout changed");
+    static_assert(sizeof(Header) % alignof(NodeRecord) == 0, "records must follow the header aligned");
+
+    uint64_t hashBytes(const char *data, size_t length)
+    {
+        uint64_t hash = 0x9e3779b97f4a7c15ull ^ length;
+        size_t i = 0;
+
+        for (; i + 8 <= length; i += 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, data + i, 8);
+            hash = (hash ^ word) * 0x100000001b3ull;
+            hash ^= hash >> 29;
+        }
+        for (; i < length; i++)
+        {
+            hash = (hash ^ static_cast<unsigned char>(data[i])) * 0x100000001b3ull;
+        }
+
+        return hash ^ (hash >> 32);
+    }
+
+    uint64_t hashBytes(std::string_view text)
+    {
+        return hashBytes(text.data(), text.size());
+    }
+
+    class Writer
+    {
+    private:
+        std::vector<NodeRecord> nodes;
+        std::vector<uint32_t> lists;
+        std::vector<std::string_view> names;
+        std::unordered_map<Symbol, uint32_t> symbols;
+
+        uint32_t symbol(Symbol name)
+        {
+            auto it = symbols.find(name);
+            if (it != symbols.end())
+            {
+                return it->second;
+            }
+
+            uint32_t index = static_cast<uint32_t>(names.size());
+            names.push_back(name.str());
+            symbols.emplace(name, index);
+            return index;
+        }
+
+        // Children are written before the lists that refer to them, so a
+        // list is contiguous even when the children have lists of their own.
+        template <typename T>
+        void list(const std::vector<T *> &items, uint32_t &start, uint32_t &count)
+        {
+            std::vector<uint32_t> indices;
+            indices.reserve(items.size());
+            for (const T *item : items)
+            {
+                indices.push_back(node(item));
+            }
+
+            start = static_cast<uint32_t>(lists.size());
+            count = static_cast<uint32_t>(indices.size());
+            lists.insert(lists.end(), indices.begin(), indices.end());
+        }
+
+        // Post-order: every child gets a smaller index than its parent.
+        uint32_t node(const Stmt *stmt)
+        {
+            if (!stmt)
+            {
+                return None;
+            }
+
+            NodeRecord record{};
+            record.kind = static_cast<uint8_t>(stmt->kind);
+            record.line = stmt->line;
+            record.a = record.b = record.c = record.d = record.e = None;
+
+            switch (stmt->kind)
+            {
+            case NodeType::VarDeclaration:
+            {
+                auto *declaration = static_cast<const VarDeclaration *>(stmt);
+                record.flags = declaration->constant;
+                record.a = symbol(declaration->identifier);
+                record.b = node(declaration->value);
+                break;
+            }
+            case NodeType::FunctionDeclaration:
+            {
+                auto *declaration = static_cast<const FunctionDeclaration *>(stmt);
+                record.a = symbol(declaration->name);
+                list(declaration->body, record.b, record.c);
+                record.d = static_cast<uint32_t>(lists.size());
+                record.e = static_cast<uint32_t>(declaration->parameters.size());
+                for (Symbol param : declaration->parameters)
+                {
+                    lists.push_back(symbol(param));
+                }
+                break;
+            }
+            case NodeType::IfStmt:
+            {
+                auto *branch = static_cast<const IfStmt *>(stmt);
+                record.a = node(branch->condition);
+                record.b = node(branch->thenBranch);
+                record.c = node(branch->elseBranch);
+                break;
+            }
+            case NodeType::ForStmt:
+            {
+                auto *loop = static_cast<const ForStmt *>(stmt);
+                record.a = node(loop->init);
+                record.b = node(loop->condition);
+                record.c = node(loop->increment);
+                record.d = node(loop->body);
+                break;
+            }
+            case NodeType::WhileStmt:
+            {
+                auto *loop = static_cast<const WhileStmt *>(stmt);
+                record.a = node(loop->condition);
+                record.b = node(loop->body);
+                break;
+            }
+            case NodeType::BlockStmt:
+                list(static_cast<const BlockStmt *>(stmt)->body, record.b, record.c);
+                break;
+            case NodeType::AssignmentExpr:
+            {
+                auto *assignment = static_cast<const AssignmentExpr *>(stmt);
+                record.a = node(assignment->assignee);
+                record.b = node(assignment->value);
+                break;
+            }
+            case NodeType::MemberExpr:
+            {
+                auto *member = static_cast<const MemberExpr *>(stmt);
+                record.flags = member->computed;
+                record.a = node(member->object);
+                record.b = node(member->property);
+                break;
+            }
+            case NodeType::CallExpr:
+            {
+                auto *call = static_cast<const CallExpr *>(stmt);
+                record.a = node(call->caller);
+                list(call->args, record.b, record.c);
+                break;
+            }
+            case NodeType::Property:
+            {
+                auto *prop = static_cast<const Property *>(stmt);
+                record.a = symbol(prop->key);
+                record.b = node(prop->value);
+                break;
+            }
+            case NodeType::ObjectLiteral:
+                list(static_cast<const ObjectLiteral *>(stmt)->properties, record.b, record.c);
+                break;
+            case NodeType::ArrayLiteral:
+                list(static_cast<const ArrayLiteral *>(stmt)->elements, record.b, record.c);
+                break;
+            case NodeType::NumericLiteral:
+                record.number = static_cast<const NumericLiteral *>(stmt)->value;
+                break;
+            case NodeType::StringLiteral:
+                record.a = symbol(static_cast<const StringLiteral *>(stmt)->value);
+                break;
+            case NodeType::Identifier:
+                record.a = symbol(static_cast<const Identifier *>(stmt)->symbol);
+                break;
+            case NodeType::BinaryExpr:
+            {
+                auto *binop = static_cast<const BinaryExpr *>(stmt);
+                record.flags = static_cast<uint8_t>(binop->op);
+                record.a = node(binop->left);
+                record.b = node(binop->right);
+                break;
+            }
+            default:
+                throw std::runtime_error("Cannot cache node");
+            }
+
+            nodes.push_back(record);
+            return static_cast<uint32_t>(nodes.size() - 1);
+        }
+
+        template <typename T>
+        static void append(std::string &out, const T *data, size_t count)
+        {
+            out.append(reinterpret_cast<const char *>(data), sizeof(T) * count);
+        }
+
+    public:
+        std::string write(std::string_view source, const Program *program)
+        {
+            Header header{};
+            std::memcpy(header.magic, Magic, sizeof(Magic));
+            header.version = FormatVersion;
+            header.sourceHash = hashBytes(source);
+            header.sourceLength = source.size();
+
+            list(program->body, header.bodyStart, header.bodyCount);
+
+            // Symbol i spans offsets[i]..offsets[i + 1] of the name bytes.
+            std::vector<uint32_t> offsets{0};
+            std::string bytes;
+            for (std::string_view name : names)
+            {
+                bytes += name;
+                offsets.push_back(static_cast<uint32_t>(bytes.size()));
+            }
+
+            header.nodeCount = static_cast<uint32_t>(nodes.size());
+            header.listCount = static_cast<uint32_t>(lists.size());
+            header.symbolCount = static_cast<uint32_t>(names.size());
+            header.symbolBytes = static_cast<uint32_t>(bytes.size());
+
+            std::string out(sizeof(Header), '\0');
+            append(out, nodes.data(), nodes.size());
+            append(out, lists.data(), lists.size());
+            append(out, offsets.data(), offsets.size());
+            out += bytes;
+
+            header.checksum = hashBytes(out.data() + sizeof(Header), out.size() - sizeof(Header));
+            std::memcpy(&out[0], &header, sizeof(Header));
+            return out;
+        }
+    };
+
+    // Rebuilds nodes in index order. Any reference that does not point
+    // backwards to a node of the right category, and any list or symbol out
+    // of range, marks the image as corrupt.
+    class Reader
+    {
+    private:
+        const NodeRecord *records = nullptr;
+        const uint32_t *lists = nullptr;
+        const Header &header;
+        std::vector<Stmt *> nodes;
+        std::vector<Symbol> symbols;
+        Arena *arena = nullptr;
+
+        struct Corrupt
+        {
+        };
+
+        static bool isExpr(NodeType kind)
+        {
+            return kind >= NodeType::AssignmentExpr && kind <= NodeType::BinaryExpr;
+        }
+
+        Stmt *stmt(uint32_t index, size_t current, bool optional = false)
+        {
+            if (index == None && optional)
+            {
+                return nullptr;
+            }
+            if (index >= current)
+            {
+                throw Corrupt();
+            }
+            return nodes[index];
+        }
+
+        Expr *expr(uint32_t index, size_t current, bool optional = false)
+        {
+            Stmt *node = stmt(index, current, optional);
+            if (node && !isExpr(node->kind))
+            {
+                throw Corrupt();
+            }
+            return static_cast<Expr *>(node);
+        }
+
+        Symbol symbol(uint32_t index)
+        {
+            if (index >= symbols.size())
+            {
+                throw Corrupt();
+            }
+            return symbols[index];
+        }
+
+        template <typename T, typename Get>
+        std::vector<T> list(uint32_t start, uint32_t count, Get get)
+        {
+            if (start > header.listCount || count > header.listCount - start)
+            {
+                throw Corrupt();
+            }
+
+            std::vector<T> items;
+            items.reserve(count);
+            for (uint32_t i = 0; i < count; i++)
+            {
+                items.push_back(get(lists[start + i]));
+            }
+            return items;
+        }
+
+        std::vector<Stmt *> stmts(uint32_t start, uint32_t count, size_t current)
+        {
+            return list<Stmt *>(start, count, [&](uint32_t index)
+                                { return stmt(index, current); });
+        }
+
+        Stmt *build(const NodeRecord &record, size_t current)
+        {
+            switch (static_cast<NodeType>(record.kind))
+            {
+            case NodeType::VarDeclaration:
+                return arena->make<VarDeclaration>(record.flags != 0, symbol(record.a), expr(record.b, current, true));
+            case NodeType::FunctionDeclaration:
+            {
+                std::vector<Symbol> parameters = list<Symbol>(record.d, record.e, [&](uint32_t index)
+                                                              { return symbol(index); });
+                return arena->make<FunctionDeclaration>(stmts(record.b, record.c, current), symbol(record.a), std::move(parameters));
+            }
+            case NodeType::IfStmt:
+                return arena->make<IfStmt>(expr(record.a, current), stmt(record.b, current, true), stmt(record.c, current, true));
+            case NodeType::ForStmt:
+                return arena->make<ForStmt>(stmt(record.a, current, true), expr(record.b, current, true),
+                                            expr(record.c, current, true), stmt(record.d, current, true));
+            case NodeType::WhileStmt:
+                return arena->make<WhileStmt>(expr(record.a, current), stmt(record.b, current, true));
+            case NodeType::BlockStmt:
+                return arena->make<BlockStmt>(stmts(record.b, record.c, current));
+            case NodeType::AssignmentExpr:
+                return arena->make<AssignmentExpr>(expr(record.a, current), expr(record.b, current));
+            case NodeType::MemberExpr:
+                return arena->make<MemberExpr>(expr(record.a, current), expr(record.b, current), record.flags != 0);
+            case NodeType::CallExpr:
+            {
+                std::vector<Expr *> args = list<Expr *>(record.b, record.c, [&](uint32_t index)
+                                                        { return expr(index, current); });
+                return arena->make<CallExpr>(expr(record.a, current), std::move(args));
+            }
+            case NodeType::Property:
+                return arena->make<Property>(symbol(record.a), expr(record.b, current, true));
+            case NodeType::ObjectLiteral:
+            {
+                std::vector<Property *> properties = list<Property *>(record.b, record.c, [&](uint32_t index)
+                                                                      {
+                                                                          Stmt *node = stmt(index, current);
+                                                                          if (node->kind != NodeType::Property)
+                                                                          {
+                                                                              throw Corrupt();
+                                                                          }
+                                                                          return static_cast<Property *>(node); });
+                return arena->make<ObjectLiteral>(std::move(properties));
+            }
+            case NodeType::ArrayLiteral:
+            {
+                std::vector<Expr *> elements = list<Expr *>(record.b, record.c, [&](uint32_t index)
+                                                            { return expr(index, current); });
+                return arena->make<ArrayLiteral>(std::move(elements));
+            }
+            case NodeType::NumericLiteral:
+                return arena->make<NumericLiteral>(record.number);
+            case NodeType::StringLiteral:
+                return arena->make<StringLiteral>(symbol(record.a));
+            case NodeType::Identifier:
+                return arena->make<Identifier>(symbol(record.a));
+            case NodeType::BinaryExpr:
+                if (record.flags > static_cast<uint8_t>(Operator::NotEqual))
+                {
+                    throw Corrupt();
+                }
+                return arena->make<BinaryExpr>(expr(record.a, current), expr(record.b, current), static_cast<Operator>(record.flags));
+            default:
+                throw Corrupt();
+            }
+        }
+
+    public:
+        explicit Reader(const Header &header)
+            : header(header)
+        {
+        }
+
+        Program *read(std::string_view image)
+        {
+            size_t nodeBytes = sizeof(NodeRecord) * static_cast<size_t>(header.nodeCount);
+            size_t listBytes = sizeof(uint32_t) * static_cast<size_t>(header.listCount);
+            size_t offsetBytes = sizeof(uint32_t) * (static_cast<size_t>(header.symbolCount) + 1);
+            if (image.size() != sizeof(Header) + nodeBytes + listBytes + offsetBytes + header.symbolBytes)
+            {
+                return nullptr;
+            }
+
+            // The header is a multiple of 8 bytes and the mapping is page
+            // aligned, so the records can be read in place.
+            const char *cursor = image.data() + sizeof(Header);
+            records = reinterpret_cast<const NodeRecord *>(cursor);
+            lists = reinterpret_cast<const uint32_t *>(cursor + nodeBytes);
+            const uint32_t *offsets = reinterpret_cast<const uint32_t *>(cursor + nodeBytes + listBytes);
+            const char *names = cursor + nodeBytes + listBytes + offsetBytes;
+
+            std::unique_ptr<Program> program(new Program());
+            arena = &program->arena;
+
+            try
+            {
+                symbols.reserve(header.symbolCount);
+                for (uint32_t i = 0; i < header.symbolCount; i++)
+                {
+                    if (offsets[i] > offsets[i + 1] || offsets[i + 1] > header.symbolBytes)
+                    {
+                        throw Corrupt();
+                    }
+                    symbols.push_back(intern(std::string_view(names + offsets[i], offsets[i + 1] - offsets[i])));
+                }
+
+                nodes.reserve(header.nodeCount);
+                for (size_t i = 0; i < header.nodeCount; i++)
+                {
+                    nodes.push_back(build(records[i], i));
+                    nodes.back()->line = records[i].line;
+                }
+
+                program->body = stmts(header.bodyStart, header.bodyCount, nodes.size());
+            }
+            catch (const Corrupt &)
+            {
+                return nullptr;
+            }
+
+            return program.release();
+        }
+    };
+}
+
+AstCache::AstCache(std::string directory)
+    : directory(std::move(directory))
+{
+}
+
+std::string AstCache::pathFor(std::string_view source) const
+{
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.astc", static_cast<unsigned long long>(hashBytes(source)));
+    return directory + "/" + name;
+}
+
+std::string AstCache::serialize(std::string_view source, const Program *program)
+{
+    return Writer().write(source, program);
+}
+
+Program *AstCache::deserialize(std::string_view image, std::string_view source)
+{
+    Header header;
+    if (image.size() < sizeof(Header))
+    {
+        return nullptr;
+    }
+    std::memcpy(&header, image.data(), sizeof(Header));
+
+    if (std::memcmp(header.magic, Magic, sizeof(Magic)) != 0 || header.version != FormatVersion ||
+        header.sourceLength != source.size() || header.sourceHash != hashBytes(source))
+    {
+        return nullptr;
+    }
+    if (header.checksum != hashBytes(image.data() + sizeof(Header), image.size() - sizeof(Header)))
+    {
+        return nullptr;
+    }
+
+    return Reader(header).read(image);
+}
+
+Program *AstCache::load(std::string_view source) const
+{
+    int fd = ::open(pathFor(source).c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return nullptr;
+    }
+
+    struct stat info;
+    void *memory = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0)
+    {
+        memory = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    ::close(fd);
+
+    if (memory == MAP_FAILED)
+    {
+        return nullptr;
+    }
+
+    Program *program = nullptr;
+    try
+    {
+        program = deserialize(std::string_view(static_cast<const char *>(memory), info.st_size), source);
+    }
+    catch (...)
+    {
+        munmap(memory, info.st_size);
+        throw;
+    }
+
+    munmap(memory, info.st_size);
+    return program;
+}
+
+void AstCache::store(std::string_view source, const Program *program) const
+{
+    std::string image = serialize(source, program);
+    std::string path = pathFor(source);
+    // Written under a private name and renamed into place, so concurrent
+    // runs never map a partially written entry.
+    std::string temporary = path + "." + std::to_string(getpid()) + ".tmp";
+
+    mkdir(directory.c_str(), 0755);
+
+    int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return;
+    }
+
+    size_t written = 0;
+    while (written < image.size())
+    {
+        ssize_t count = ::write(fd, image.data() + written, image.size() - written);
+        if (count <= 0)
+        {
+            break;
+        }
+        written += count;
+    }
+
+    if (::close(fd) == 0 && written == image.size() && std::rename(temporary.c_str(), path.c_str()) == 0)
+    {
+        return;
+    }
+    ::unlink(temporary.c_str());
+}
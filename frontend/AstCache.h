@@ -0,0 +1,37 @@
+#ifndef AST_CACHE_H
+#define AST_CACHE_H
+
+#include "Ast.h"
+
+#include <string>
+#include <string_view>
+
+// On-disk cache of parsed Programs, one file per script named after a hash
+// of its source. An entry is a flat image: fixed-size node records that
+// refer to each other by index, index lists for bodies and arguments, and
+// the symbol names they use. Nothing in it is a pointer, so a mapped entry
+// is rebuilt into an arena with one linear pass and no lexing.
+//
+// Entries from another format version, for a different source or that fail
+// their checksum or structural checks are ignored; callers then parse the
+// source and store a fresh entry over the old one.
+class AstCache
+{
+private:
+    std::string directory;
+
+    std::string pathFor(std::string_view source) const;
+
+public:
+    explicit AstCache(std::string directory);
+
+    // Returns nullptr when there is no usable entry for source.
+    Program *load(std::string_view source) const;
+    // Best effort: failures to write leave the cache unchanged.
+    void store(std::string_view source, const Program *program) const;
+
+    static std::string serialize(std::string_view source, const Program *program);
+    static Program *deserialize(std::string_view image, std::string_view source);
+};
+
+#endif // AST_CACHE_H
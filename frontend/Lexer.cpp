@@ -1,23 +1,22 @@
 #include "Lexer.h"
 
-#include <iostream>
-#include <deque>
-#include <map>
-#include <string>
-
-const std::map<std::string, TokenType> keywords = {
-    {"let", TokenType::Let},
-    {"const", TokenType::Const},
-    {"fn", TokenType::Fn},
-    {"if", TokenType::If},
-    {"else", TokenType::Else},
-    {"for", TokenType::For},
-    {"while", TokenType::While}};
-
-Token token(TokenType type, std::string value = "")
+
+struct Keyword
 {
-    return {value, type};
-}
+    Symbol symbol;
+    TokenType type;
+};
+
+// Keywords are interned like any identifier, so recognising one is an
+// integer comparison on the symbol the lexer computes anyway.
+static const Keyword keywords[] = {
+    {intern("let"), TokenType::Let},
+    {intern("const"), TokenType::Const},
+    {intern("fn"), TokenType::Fn},
+    {intern("if"), TokenType::If},
+    {intern("else"), TokenType::Else},
+    {intern("for"), TokenType::For},
+    {intern("while"), TokenType::While}};
 
 bool isAlpha(const char c)
 {
@@ -34,111 +33,139 @@ bool isSkippable(const char c)
     return c == ' ' || c == '\n' || c == '\t' || c == '\r';
 }
 
-std::deque<Token> tokenize(const std::string sourceCode)
+static TokenType singleCharToken(const char c)
 {
-    std::deque<Token> tokens;
-    size_t i = 0;
-    const size_t numTokens = sourceCode.length();
+    switch (c)
+    {
+    case '(':
+        return TokenType::OpenParen;
+    case ')':
+        return TokenType::CloseParen;
+    case '{':
+        return TokenType::OpenBrace;
+    case '}':
+        return TokenType::CloseBrace;
+    case '[':
+        return TokenType::OpenBracket;
+    case ']':
+        return TokenType::CloseBracket;
+    case '+':
+        return TokenType::Plus;
+    case '-':
+        return TokenType::Minus;
+    case '*':
+        return TokenType::Star;
+    case '/':
+        return TokenType::Slash;
+    case '%':
+        return TokenType::Percent;
+    case '<':
+        return TokenType::Less;
+    case '>':
+        return TokenType::Greater;
+    case '=':
+        return TokenType::Equals;
+    case ':':
+        return TokenType::Colon;
+    case ',':
+        return TokenType::Comma;
+    case ';':
+        return TokenType::Semicolon;
+    case '.':
+        return TokenType::Dot;
+    default:
+        return TokenType::EndOfFile;
+    }
+}
 
-    while (i < numTokens)
+Token Lexer::next()
+{
+    const size_t length = source.length();
+
+    while (pos < length)
     {
-        const char currToken = sourceCode[i];
+        const size_t start = pos;
+        const char currToken = source[pos];
 
-        if (currToken == '(')
-        {
-            tokens.push_back(token(TokenType::OpenParen, "("));
-        }
-        else if (currToken == ')')
-        {
-            tokens.push_back(token(TokenType::CloseParen, ")"));
-        }
-        else if (currToken == '{')
-        {
-            tokens.push_back(token(TokenType::OpenBrace, "{"));
-        }
-        else if (currToken == '}')
-        {
-            tokens.push_back(token(TokenType::CloseBrace, "}"));
-        }
-        else if (currToken == '[')
-        {
-            tokens.push_back(token(TokenType::OpenBracket, "["));
-        }
-        else if (currToken == ']')
-        {
-            tokens.push_back(token(TokenType::CloseBracket, "]"));
-        }
-        else if (
-            currToken == '+' ||
-            currToken == '-' ||
-            currToken == '*' ||
-            currToken == '/' ||
-            currToken == '%')
-        {
-            tokens.push_back(token(TokenType::BinaryOperator, std::string(1, currToken)));
-        }
-        else if (currToken == '=')
+        if (isSkippable(currToken))
         {
-            tokens.push_back(token(TokenType::Equals, "="));
+            line += currToken == '\n';
+            pos++;
+            continue;
         }
-        else if (currToken == ':')
-        {
-            tokens.push_back(token(TokenType::Colon, ":"));
-        }
-        else if (currToken == ',')
-        {
-            tokens.push_back(token(TokenType::Comma, ","));
-        }
-        else if (currToken == ';')
-        {
-            tokens.push_back(token(TokenType::Semicolon, ";"));
-        }
-        else if (currToken == '.')
+
+        if (isInt(currToken))
         {
-            tokens.push_back(token(TokenType::Dot, "."));
+            while (pos < length && isInt(source[pos]))
+            {
+                pos++;
+            }
+            return token(source.substr(start, pos - start), TokenType::Number, start);
         }
-        else if (isInt(currToken))
+
+        if (isAlpha(currToken))
         {
-            std::string num;
-            while (i < numTokens && isInt(sourceCode[i]))
+            while (pos < length && isAlpha(source[pos]))
+            {
+                pos++;
+            }
+
+            std::string_view ident = source.substr(start, pos - start);
+            Symbol symbol = intern(ident);
+            for (const Keyword &keyword : keywords)
             {
-                num += sourceCode[i];
-                i++;
+                if (keyword.symbol == symbol)
+                {
+                    return token(ident, keyword.type, start, symbol);
+                }
             }
-            i--;
-            tokens.push_back(token(TokenType::Number, num));
+            return token(ident, TokenType::Identifier, start, symbol);
         }
-        else if (isAlpha(currToken))
+
+        // Runs to the closing quote, skipping escaped characters; the parser
+        // decodes the escapes and reports a string left unterminated.
+        if (currToken == '"')
         {
-            std::string ident;
-            while (i < numTokens && isAlpha(sourceCode[i]))
+            pos++;
+            while (pos < length && source[pos] != '"')
             {
-                ident += sourceCode[i];
-                i++;
+                pos += source[pos] == '\\' && pos + 1 < length ? 2 : 1;
             }
-            i--;
-            auto it = keywords.find(ident);
-            if (it != keywords.end())
+            pos += pos < length;
+
+            Token string = token(source.substr(start, pos - start), TokenType::String, start);
+            for (char c : string.value)
             {
-                tokens.push_back(token(it->second, ident));
+                line += c == '\n';
             }
-            else
+            return string;
+        }
+
+        pos++;
+
+        // Two-character comparisons: <= >= == !=
+        if (pos < length && source[pos] == '=')
+        {
+            TokenType type = currToken == '<'   ? TokenType::LessEqual
+                             : currToken == '>' ? TokenType::GreaterEqual
+                             : currToken == '=' ? TokenType::EqualEqual
+                             : currToken == '!' ? TokenType::BangEqual
+                                                : TokenType::EndOfFile;
+            if (type != TokenType::EndOfFile)
             {
-                tokens.push_back(token(TokenType::Identifier, ident));
+                pos++;
+                return token(source.substr(start, 2), type, start);
             }
         }
-        else if (isSkippable(currToken))
-        {
-        }
-        else
+
+        TokenType type = singleCharToken(currToken);
+        if (type != TokenType::EndOfFile)
         {
-            std::cout << "Unrecognized character found in source: " << currToken << "\n";
+            return token(source.substr(start, 1), type, start);
         }
 
-        i++;
+        diagnostics.push_back("line " + std::to_string(line) + ": Unrecognized character found in source: " + currToken);
     }
 
-    tokens.push_back(token(TokenType::EndOfFile, "EndOfFile"));
-
-    return tokens;
+    return token("EndOfFile", TokenType::EndOfFile, length);
 }
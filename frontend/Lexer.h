@@ -1,20 +1,35 @@
 #ifndef TOKEN_H
 #define TOKEN_H
 
+#include "Symbol.h"
+
 #include <string>
-#include <map>
+#include <string_view>
 #include <vector>
-#include <deque>
+#include <cstddef>
+#include <cstdint>
 
 enum class TokenType
 {
     // Literal Types
     Number,
     Identifier,
+    String, // value keeps the quotes and escapes as written
 
-    // Operators
+    // Operators. Each binary operator is its own kind, so the parser can
+    // look up its precedence without reading the text.
     Equals,
-    BinaryOperator,
+    Plus,
+    Minus,
+    Star,
+    Slash,
+    Percent,
+    Less,
+    LessEqual,
+    Greater,
+    GreaterEqual,
+    EqualEqual,
+    BangEqual,
 
     // Delimiters
     OpenParen,
@@ -41,18 +56,45 @@ enum class TokenType
     EndOfFile
 };
 
-// Define the Token struct
+// A token is a view into the source buffer plus its byte offset and line;
+// it owns nothing and is only valid while the source is alive. Identifiers
+// and keywords also carry their interned symbol.
 struct Token
 {
-    std::string value;
+    std::string_view value;
     TokenType type;
+    size_t offset;
+    Symbol symbol = {};
+    uint32_t line = 0;
 };
 
 // Token utility functions
-Token token(TokenType type, std::string value);
 bool isAlpha(const char c);
 bool isInt(const char str);
 bool isSkippable(const char c);
-std::deque<Token> tokenize(const std::string sourceCode);
+
+// Pull-based lexer: produces one token per call to next(), so lexing needs
+// no memory beyond the source itself.
+class Lexer
+{
+private:
+    std::string_view source;
+    size_t pos = 0;
+    uint32_t line = 1;
+    std::vector<std::string> diagnostics;
+
+    Token token(std::string_view value, TokenType type, size_t offset, Symbol symbol = {}) const
+    {
+        return {value, type, offset, symbol, line};
+    }
+
+public:
+    Lexer(std::string_view source = std::string_view()) : source(source) {}
+
+    Token next();
+
+    // Problems that did not stop lexing, each with its line.
+    const std::vector<std::string> &warnings() const { return diagnostics; }
+};
 
 #endif // TOKEN_H
@@ -1,77 +1,121 @@
 #include "Parser.h"
 #include "Lexer.h"
 
-bool Parser::not_eof()
-{
-    return tokens[0].type != TokenType::EndOfFile;
-}
-
-Token Parser::at()
-{
-    return tokens[0];
-}
+#include <charconv>
+#include <stdexcept>
 
-Token Parser::eat()
+// The EndOfFile token is never stepped past, so at() stays valid however
+// far a malformed program runs on.
+const Token &Parser::eat()
 {
-    const Token prev = tokens[0];
-    tokens.pop_front();
+    const Token &prev = tokens[cursor];
+    line = prev.line;
+    cursor += cursor + 1 < tokens.size();
     return prev;
 }
 
-Token Parser::expect(TokenType type, const std::string &err)
+const Token &Parser::expect(TokenType type, const char *err)
 {
-    const Token prev = tokens[0];
-    tokens.pop_front();
+    const Token &prev = eat();
     if (prev.type != type)
     {
-        std::cerr << "Parser error: " << err << " - Expecting: " << static_cast<int>(type) << "\n";
+        diagnostics.push_back("line " + std::to_string(prev.line) + ": Parser error: " + err + " - Expecting: " + std::to_string(static_cast<int>(type)));
     }
     return prev;
 }
 
-Program *Parser::produceAST(std::string sourceCode)
+Program *Parser::produceAST(std::string_view sourceCode)
 {
-    tokens = tokenize(sourceCode);
+    Lexer lexer(sourceCode);
+    tokens.clear();
+    do
+    {
+        tokens.push_back(lexer.next());
+    } while (tokens.back().type != TokenType::EndOfFile);
+    cursor = 0;
+    line = 1;
+    diagnostics = lexer.warnings();
 
     Program *program = new Program();
+    arena = &program->arena;
 
-    while (not_eof())
+    try
+    {
+        while (not_eof())
+        {
+            program->body.push_back(parse_stmt());
+        }
+    }
+    catch (const std::runtime_error &error)
+    {
+        arena = nullptr;
+        delete program;
+        // What the parse recovered from first usually explains the error.
+        std::string message;
+        for (const std::string &diagnostic : diagnostics)
+        {
+            message += diagnostic + "\n";
+        }
+        throw std::runtime_error(message + error.what());
+    }
+    catch (...)
     {
-        program->body.push_back(parse_stmt());
+        arena = nullptr;
+        delete program;
+        throw;
     }
 
+    arena = nullptr;
+    program->diagnostics = std::move(diagnostics);
     return program;
 }
 
 Stmt *Parser::parse_stmt()
 {
+    const uint32_t start = at().line;
+    Stmt *stmt;
+
     switch (at().type)
     {
     case TokenType::Let:
 
     case TokenType::Const:
-        return parse_var_declaration();
+        stmt = parse_var_declaration();
+        break;
     case TokenType::Fn:
-        return parse_fn_declaration();
+        stmt = parse_fn_declaration();
+        break;
     case TokenType::For:
-        return parse_for_stmt();
+        stmt = parse_for_stmt();
+        break;
     case TokenType::While:
-        return parse_while_stmt();
+        stmt = parse_while_stmt();
+        break;
     case TokenType::If:
-        return parse_if_stmt();
+        stmt = parse_if_stmt();
+        break;
     default:
-        return parse_expr();
+        stmt = parse_expr();
+        // Optional, so statements in a block can be written like declarations.
+        if (at().type == TokenType::Semicolon)
+        {
+            eat();
+        }
+        break;
     }
+
+    stmt->line = start;
+    return stmt;
 }
 
 Stmt *Parser::parse_fn_declaration()
 {
     eat(); // fn
 
-    std::string name = expect(TokenType::Identifier, "Expected identifier name following fn keyword. ").value;
+    Symbol name = expect(TokenType::Identifier, "Expected identifier name following fn keyword. ").symbol;
 
     std::vector<Expr *> args = parse_args();
-    std::vector<std::string> params;
+    std::vector<Symbol> params;
 
     for (Expr *arg : args)
     {
@@ -94,13 +138,13 @@ Stmt *Parser::parse_fn_declaration()
 
     expect(TokenType::CloseBrace, "Expected closing brace following function declaration.");
 
-    return new FunctionDeclaration{body, name, params};
+    return make<FunctionDeclaration>(body, name, params);
 }
 
 Stmt *Parser::parse_var_declaration()
 {
     const bool isConstant = eat().type == TokenType::Const;
-    const std::string identifier = expect(TokenType::Identifier, "Expected identifier name following let | const keywords. ").value;
+    const Symbol identifier = expect(TokenType::Identifier, "Expected identifier name following let | const keywords. ").symbol;
 
     if (at().type == TokenType::Semicolon)
     {
@@ -110,12 +154,12 @@ Stmt *Parser::parse_var_declaration()
             throw std::runtime_error("Must assign value to constant expression.");
         }
 
-        return new VarDeclaration{false, identifier, nullptr};
+        return make<VarDeclaration>(false, identifier, nullptr);
     }
 
     expect(TokenType::Equals, "Expected equals sign following identifier name in variable declaration.");
 
-    VarDeclaration *declaration = new VarDeclaration{isConstant, identifier, parse_expr()};
+    VarDeclaration *declaration = make<VarDeclaration>(isConstant, identifier, parse_expr());
 
     expect(TokenType::Semicolon, "Expected semicolon following variable declaration.");
 
@@ -128,22 +172,30 @@ Stmt *Parser::parse_for_stmt()
 
     expect(TokenType::OpenParen, "Expected '(' after 'for'.");
 
+    // A declaration eats its own semicolon.
     Stmt *init = nullptr;
-    if (at().type != TokenType::Semicolon)
+    if (at().type == TokenType::Let || at().type == TokenType::Const)
     {
         init = parse_var_declaration();
     }
-    expect(TokenType::Semicolon, "Expected ';' after initialization.");
+    else
+    {
+        if (at().type != TokenType::Semicolon)
+        {
+            init = parse_expr();
+        }
+        expect(TokenType::Semicolon, "Expected ';' after initialization.");
+    }
 
-    Expr *condition = parse_expr();
+    Expr *condition = at().type == TokenType::Semicolon ? nullptr : parse_expr();
     expect(TokenType::Semicolon, "Expected ';' after condition.");
 
-    Expr *increment = parse_expr();
+    Expr *increment = at().type == TokenType::CloseParen ? nullptr : parse_expr();
     expect(TokenType::CloseParen, "Expected ')' after increment.");
 
-    Stmt *body = parse_stmt();
+    Stmt *body = parse_body();
 
-    return new ForStmt(init, condition, increment, body);
+    return make<ForStmt>(init, condition, increment, body);
 }
 
 Stmt *Parser::parse_while_stmt()
@@ -154,9 +206,9 @@ Stmt *Parser::parse_while_stmt()
     Expr *condition = parse_expr();
     expect(TokenType::CloseParen, "Expected ')' after condition.");
 
-    Stmt *body = parse_stmt();
+    Stmt *body = parse_body();
 
-    return new WhileStmt(condition, body);
+    return make<WhileStmt>(condition, body);
 }
 
 Stmt *Parser::parse_if_stmt()
@@ -167,16 +219,40 @@ Stmt *Parser::parse_if_stmt()
     Expr *condition = parse_expr();
     expect(TokenType::CloseParen, "Expected ')' after condition.");
 
-    Stmt *thenBranch = parse_stmt();
+    Stmt *thenBranch = parse_body();
     Stmt *elseBranch = nullptr;
 
     if (at().type == TokenType::Else)
     {
         eat(); // else
-        elseBranch = parse_stmt();
+        elseBranch = parse_body();
     }
 
-    return new IfStmt(condition, thenBranch, elseBranch);
+    return make<IfStmt>(condition, thenBranch, elseBranch);
+}
+
+// The body of a loop or if: one statement, or several in braces. Elsewhere
+// an opening brace starts an object literal.
+Stmt *Parser::parse_body()
+{
+    if (at().type != TokenType::OpenBrace)
+    {
+        return parse_stmt();
+    }
+
+    const uint32_t start = eat().line;
+    std::vector<Stmt *> body;
+
+    while (at().type != TokenType::CloseBrace && at().type != TokenType::EndOfFile)
+    {
+        body.push_back(parse_stmt());
+    }
+
+    expect(TokenType::CloseBrace, "Expected closing brace following block.");
+
+    BlockStmt *block = make<BlockStmt>(body);
+    block->line = start;
+    return block;
 }
 
 Expr *Parser::parse_expr()
@@ -192,7 +268,7 @@ Expr *Parser::parse_assignment_expr()
     {
         eat();
         Expr *value = parse_assignment_expr();
-        return new AssignmentExpr(left, value);
+        return make<AssignmentExpr>(left, value);
     }
 
     return left;
@@ -202,7 +278,7 @@ Expr *Parser::parse_object_expr()
 {
     if (at().type != TokenType::OpenBrace)
     {
-        return parse_additive_expr();
+        return parse_binary_expr(0);
     }
 
     eat();
@@ -211,24 +287,24 @@ Expr *Parser::parse_object_expr()
 
     while (not_eof() && at().type != TokenType::CloseBrace)
     {
-        std::string key = expect(TokenType::Identifier, "Expected identifier key in object literal.").value;
+        Symbol key = expect(TokenType::Identifier, "Expected identifier key in object literal.").symbol;
 
         if (at().type == TokenType::Comma)
         {
             eat();
-            properties.push_back(new Property{key, nullptr});
+            properties.push_back(make<Property>(key, nullptr));
             continue;
         }
         else if (at().type == TokenType::CloseBrace)
         {
-            properties.push_back(new Property{key, nullptr});
+            properties.push_back(make<Property>(key, nullptr));
             continue;
         }
 
         expect(TokenType::Colon, "Expected colon following key in object literal.");
         Expr *value = parse_expr();
 
-        properties.push_back(new Property{key, value});
+        properties.push_back(make<Property>(key, value));
 
         if (at().type != TokenType::CloseBrace)
         {
@@ -238,34 +314,83 @@ Expr *Parser::parse_object_expr()
 
     expect(TokenType::CloseBrace, "Expected closing brace following object literal.");
 
-    return new ObjectLiteral(properties);
+    return make<ObjectLiteral>(properties);
 }
 
-Expr *Parser::parse_additive_expr()
+Expr *Parser::parse_array_expr()
 {
-    Expr *left = parse_multiplicative_expr();
+    expect(TokenType::OpenBracket, "Expected opening bracket of array literal.");
+
+    std::vector<Expr *> elements;
 
-    while (at().value == "+" || at().value == "-")
+    while (not_eof() && at().type != TokenType::CloseBracket)
     {
-        std::string op = eat().value;
-        Expr *right = parse_multiplicative_expr();
-        left = new BinaryExpr(left, right, op);
+        elements.push_back(parse_expr());
+
+        if (at().type != TokenType::CloseBracket)
+        {
+            expect(TokenType::Comma, "Expected comma following element in array literal.");
+        }
     }
 
-    return left;
+    expect(TokenType::CloseBracket, "Expected closing bracket following array literal.");
+
+    return make<ArrayLiteral>(elements);
+}
+
+struct Binding
+{
+    int precedence; // 0 for tokens that are not binary operators
+    Operator op;
+};
+
+// Indexed by TokenType. Every level is left-associative.
+static constexpr Binding bindings[] = {
+    {0, Operator::Add},               // Number
+    {0, Operator::Add},               // Identifier
+    {0, Operator::Add},               // String
+    {0, Operator::Add},               // Equals
+    {3, Operator::Add},               // Plus
+    {3, Operator::Subtract},          // Minus
+    {4, Operator::Multiply},          // Star
+    {4, Operator::Divide},            // Slash
+    {4, Operator::Modulo},            // Percent
+    {2, Operator::Less},              // Less
+    {2, Operator::LessEqual},         // LessEqual
+    {2, Operator::Greater},           // Greater
+    {2, Operator::GreaterEqual},      // GreaterEqual
+    {1, Operator::Equal},             // EqualEqual
+    {1, Operator::NotEqual},          // BangEqual
+};
+static_assert(sizeof(bindings) / sizeof(bindings[0]) == static_cast<size_t>(TokenType::BangEqual) + 1,
+              "bindings must cover every operator token");
+
+static const Binding &binding(TokenType type)
+{
+    static constexpr Binding none = {0, Operator::Add};
+    size_t index = static_cast<size_t>(type);
+    return index < sizeof(bindings) / sizeof(bindings[0]) ? bindings[index] : none;
 }
 
-Expr *Parser::parse_multiplicative_expr()
+// Parses operands joined by operators that bind tighter than minPrecedence:
+// each operator takes as its right operand everything that binds tighter
+// than itself.
+Expr *Parser::parse_binary_expr(int minPrecedence)
 {
     Expr *left = parse_call_member_expr();
-    while (at().value == "/" || at().value == "*" || at().value == "%")
+
+    for (;;)
     {
-        std::string op = eat().value;
-        Expr *right = parse_call_member_expr();
-        left = new BinaryExpr(left, right, op);
-    }
+        const Binding &next = binding(at().type);
+        if (next.precedence <= minPrecedence)
+        {
+            return left;
+        }
 
-    return left;
+        eat();
+        Expr *right = parse_binary_expr(next.precedence);
+        left = make<BinaryExpr>(left, right, next.op);
+    }
 }
 
 Expr *Parser::parse_call_member_expr()
@@ -282,7 +407,7 @@ Expr *Parser::parse_call_member_expr()
 
 Expr *Parser::parse_call_expr(Expr *caller)
 {
-    Expr *call_expr = new CallExpr(caller, parse_args());
+    Expr *call_expr = make<CallExpr>(caller, parse_args());
 
     if (at().type == TokenType::OpenParen)
     {
@@ -322,11 +447,11 @@ Expr *Parser::parse_member_expr()
 
     while (at().type == TokenType::Dot || at().type == TokenType::OpenBracket)
     {
-        Token op = eat();
+        const TokenType op = eat().type;
         Expr *property;
         bool computed;
 
-        if (op.type == TokenType::Dot)
+        if (op == TokenType::Dot)
         {
             computed = false;
             property = parse_primary_expr();
@@ -343,24 +468,75 @@ Expr *Parser::parse_member_expr()
             expect(TokenType::CloseBracket, "Expected closing bracket following computed property.");
         }
 
-        object = new MemberExpr{object, property, computed};
+        object = make<MemberExpr>(object, property, computed);
     }
 
     return object;
 }
 
-Expr *Parser::parse_primary_expr()
+// The text of a string token, quotes dropped and escapes decoded.
+static std::string unescape(std::string_view quoted)
 {
+    std::string text;
+    size_t last = quoted.size() - 1; // of the closing quote
+    size_t i = 1;
 
-    TokenType tokenType = at().type;
+    for (; i < last; i++)
+    {
+        if (quoted[i] != '\\')
+        {
+            text += quoted[i];
+            continue;
+        }
+
+        switch (quoted[++i])
+        {
+        case 'n':
+            text += '\n';
+            break;
+        case 't':
+            text += '\t';
+            break;
+        case 'r':
+            text += '\r';
+            break;
+        case '0':
+            text += '\0';
+            break;
+        case '"':
+        case '\\':
+            text += quoted[i];
+            break;
+        default:
+            throw std::runtime_error("Unknown escape sequence \\" + std::string(1, quoted[i]) + " in string literal");
+        }
+    }
 
-    switch (tokenType)
+    // Also catches a last quote that was escaped rather than closing.
+    if (quoted.size() < 2 || i != last || quoted[last] != '"')
+    {
+        throw std::runtime_error("Unterminated string literal");
+    }
+    return text;
+}
+
+Expr *Parser::parse_primary_expr()
+{
+    switch (at().type)
     {
     case TokenType::Identifier:
-        return new Identifier(eat().value);
+        return make<Identifier>(eat().symbol);
 
     case TokenType::Number:
-        return new NumericLiteral(std::stod(eat().value));
+    {
+        std::string_view digits = eat().value;
+        double value = 0;
+        std::from_chars(digits.data(), digits.data() + digits.size(), value);
+        return make<NumericLiteral>(value);
+    }
+
+    case TokenType::String:
+        return make<StringLiteral>(intern(unescape(eat().value)));
 
     case TokenType::OpenParen:
     {
@@ -369,18 +545,11 @@ Expr *Parser::parse_primary_expr()
         expect(TokenType::CloseParen, "Unexpected token found inside parenthesised expression.");
         return value;
     }
-    case TokenType::Equals:
-        break;
-    case TokenType::CloseParen:
-        break;
-    case TokenType::BinaryOperator:
-        break;
-    case TokenType::Let:
-        break;
+    case TokenType::OpenBracket:
+        return parse_array_expr();
     case TokenType::EndOfFile:
-        break;
+        throw std::runtime_error("Unexpected end of input");
     default:
-        std::cout << "Unexpected token found during parsing: " << at().value << "\n";
-        return nullptr;
+        throw std::runtime_error("Unexpected token found during parsing: " + std::string(at().value));
     }
 }
@@ -5,19 +5,37 @@
 #include "Ast.h"
 
 #include <vector>
-#include <deque>
 #include <string>
+#include <string_view>
 #include <iostream>
 
+// Lexes the whole source into a token buffer first, then walks it with a
+// cursor, so looking at or consuming a token never copies one. Binary
+// operators are parsed by precedence climbing over a table keyed on token
+// kind.
 class Parser
 {
 private:
-    std::deque<Token> tokens;
+    std::vector<Token> tokens; // kept between calls, ends in EndOfFile
+    size_t cursor = 0;
+    Arena *arena = nullptr;
+    uint32_t line = 1; // of the last token eaten
+    std::vector<std::string> diagnostics;
 
-    bool not_eof();
-    Token at();
-    Token eat();
-    Token expect(TokenType type, const std::string &err);
+    // Nodes are made once their last token is eaten, so they get its line;
+    // statements are moved to the line they start on.
+    template <typename T, typename... Args>
+    T *make(Args &&...args)
+    {
+        T *node = arena->make<T>(std::forward<Args>(args)...);
+        node->line = line;
+        return node;
+    }
+
+    bool not_eof() const { return tokens[cursor].type != TokenType::EndOfFile; }
+    const Token &at() const { return tokens[cursor]; }
+    const Token &eat();
+    const Token &expect(TokenType type, const char *err);
 
     Stmt *parse_stmt();
     Stmt *parse_var_declaration();
@@ -25,11 +43,12 @@ private:
     Stmt *parse_for_stmt();
     Stmt *parse_while_stmt();
     Stmt *parse_if_stmt();
+    Stmt *parse_body();
     Expr *parse_assignment_expr();
     Expr *parse_object_expr();
+    Expr *parse_array_expr();
     Expr *parse_expr();
-    Expr *parse_additive_expr();
-    Expr *parse_multiplicative_expr();
+    Expr *parse_binary_expr(int minPrecedence);
     Expr *parse_call_member_expr();
     Expr *parse_call_expr(Expr *caller);
     std::vector<Expr *> parse_args();
@@ -38,7 +57,10 @@ private:
     Expr *parse_primary_expr();
 
 public:
-    Program *produceAST(std::string sourceCode);
+    Program *produceAST(std::string_view sourceCode);
+
+    // Tokens in the last source parsed, EndOfFile included.
+    size_t tokenCount() const { return tokens.size(); }
 };
 
 #endif // PARSER_H
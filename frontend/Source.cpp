@@ -0,0 +1,72 @@
+#include "Source.h"
+
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+SourceFile::SourceFile(const std::string &path)
+{
+    if (path.empty() || path == "-")
+    {
+        load(STDIN_FILENO, "<stdin>");
+        return;
+    }
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw std::runtime_error("Could not open source file: " + path);
+    }
+
+    try
+    {
+        load(fd, path);
+    }
+    catch (...)
+    {
+        ::close(fd);
+        throw;
+    }
+    ::close(fd);
+}
+
+void SourceFile::load(int fd, const std::string &name)
+{
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0)
+    {
+        void *memory = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (memory != MAP_FAILED)
+        {
+            madvise(memory, info.st_size, MADV_SEQUENTIAL);
+            data = static_cast<const char *>(memory);
+            length = info.st_size;
+            mapped = true;
+            return;
+        }
+    }
+
+    char chunk[64 * 1024];
+    ssize_t count;
+    while ((count = ::read(fd, chunk, sizeof(chunk))) != 0)
+    {
+        if (count < 0)
+        {
+            throw std::runtime_error("Could not read source file: " + name);
+        }
+        buffer.append(chunk, count);
+    }
+
+    data = buffer.data();
+    length = buffer.size();
+}
+
+SourceFile::~SourceFile()
+{
+    if (mapped)
+    {
+        munmap(const_cast<char *>(data), length);
+    }
+}
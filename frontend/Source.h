@@ -0,0 +1,30 @@
+#ifndef SOURCE_H
+#define SOURCE_H
+
+#include <string>
+#include <string_view>
+
+// Script text handed to the Parser. Regular files (including a redirected
+// stdin) are memory-mapped read-only; pipes and terminals are read into an
+// owned buffer instead.
+class SourceFile
+{
+private:
+    const char *data = nullptr;
+    size_t length = 0;
+    bool mapped = false;
+    std::string buffer;
+
+    void load(int fd, const std::string &name);
+
+public:
+    // An empty path or "-" reads from stdin.
+    explicit SourceFile(const std::string &path = "");
+    SourceFile(const SourceFile &) = delete;
+    SourceFile &operator=(const SourceFile &) = delete;
+    ~SourceFile();
+
+    std::string_view text() const { return std::string_view(data, length); }
+};
+
+#endif // SOURCE_H
@@ -0,0 +1,78 @@
+#include "Symbol.h"
+
+#include <mutex>
+
+SymbolTable &SymbolTable::global()
+{
+    static SymbolTable table;
+    return table;
+}
+
+// Keys view names stored in the table, which outlive every thread.
+struct SymbolTable::Cache
+{
+    const SymbolTable *table = nullptr;
+    std::unordered_map<std::string_view, uint32_t> index;
+};
+
+SymbolTable::Cache &SymbolTable::cache() const
+{
+    static thread_local Cache cache;
+    if (cache.table != this)
+    {
+        cache.table = this;
+        cache.index.clear();
+    }
+    return cache;
+}
+
+Symbol SymbolTable::intern(std::string_view name)
+{
+    Cache &cache = this->cache();
+    auto cached = cache.index.find(name);
+    if (cached != cache.index.end())
+    {
+        return {cached->second};
+    }
+
+    uint32_t id;
+    const std::string *stored;
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        auto it = index.find(name);
+        if (it != index.end())
+        {
+            id = it->second;
+            stored = &names[id];
+        }
+        else
+        {
+            id = static_cast<uint32_t>(names.size());
+            names.emplace_back(name);
+            index.emplace(names.back(), id);
+            stored = &names.back();
+        }
+    }
+
+    cache.index.emplace(*stored, id);
+    return {id};
+}
+
+Symbol SymbolTable::find(std::string_view name) const
+{
+    Cache &cache = this->cache();
+    auto cached = cache.index.find(name);
+    if (cached != cache.index.end())
+    {
+        return {cached->second};
+    }
+
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    auto it = index.find(name);
+    if (it == index.end())
+    {
+        return {};
+    }
+    cache.index.emplace(names[it->second], it->second);
+    return {it->second};
+}
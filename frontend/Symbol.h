@@ -0,0 +1,80 @@
+#ifndef SYMBOL_H
+#define SYMBOL_H
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// An interned name. Every distinct identifier or property key is stored
+// once in the SymbolTable, so names compare and hash as a small integer.
+struct Symbol
+{
+    uint32_t id = UINT32_MAX;
+
+    bool valid() const { return id != UINT32_MAX; }
+
+    bool operator==(const Symbol &other) const { return id == other.id; }
+    bool operator!=(const Symbol &other) const { return id != other.id; }
+
+    const std::string &str() const;
+};
+
+namespace std
+{
+    template <>
+    struct hash<Symbol>
+    {
+        size_t operator()(const Symbol &symbol) const noexcept { return symbol.id; }
+    };
+}
+
+// Shared by every thread. Names are only ever added, and a deque never
+// moves its elements, so a name stays valid once returned; the lock only
+// guards the containers themselves. Each thread also keeps a cache of the
+// names it has interned, so repeated lookups take no lock at all.
+class SymbolTable
+{
+private:
+    std::deque<std::string> names; // deque keeps the views in index stable
+    std::unordered_map<std::string_view, uint32_t> index;
+    mutable std::shared_mutex mutex;
+
+    struct Cache;
+    Cache &cache() const;
+
+public:
+    static SymbolTable &global();
+
+    Symbol intern(std::string_view name);
+    // The symbol for name if it has been interned, else an invalid one;
+    // adds nothing to the table.
+    Symbol find(std::string_view name) const;
+
+    const std::string &name(Symbol symbol) const
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return names[symbol.id];
+    }
+
+    size_t size() const
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return names.size();
+    }
+};
+
+inline Symbol intern(std::string_view name)
+{
+    return SymbolTable::global().intern(name);
+}
+
+inline const std::string &Symbol::str() const
+{
+    return SymbolTable::global().name(*this);
+}
+
+#endif // SYMBOL_H
@@ -1,24 +1,354 @@
 #include "./frontend/Parser.h"
+#include "./frontend/AstCache.h"
+#include "./frontend/Source.h"
 #include "./runtime/Interpreter.h"
 #include "./runtime/Environment.h"
+#include "./runtime/Optimizer.h"
+#include "./runtime/Resolver.h"
+#include "./runtime/Compiler.h"
+#include "./runtime/Jit.h"
+#include "./runtime/VM.h"
+#include "./runtime/Repl.h"
+#include "./runtime/Runner.h"
+#include "./runtime/Parallel.h"
+#include "./runtime/Profiler.h"
+#include "./runtime/Stats.h"
 
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
-#include <sstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unistd.h>
 
-int main()
+static void usage(const char *program)
 {
+    std::cerr << "Usage: " << program << " [--tree-walk] [--no-jit] [--repl] [--dump-bytecode] [--max-depth N] [--threads N] [--cache-dir DIR] [--profile] [--profile-hz N] [--profile-out FILE] [--stats] [--stats-interval MS] [--stats-out FILE | unix:PATH] [script | - ]\n";
+    std::cerr << "       " << program << " --jobs N [--tree-walk] [--no-jit] [--max-depth N] [--cache-dir DIR] script...\n";
+    std::cerr << "       " << program << " --parse-only [script | - ]\n";
+}
+
+// How diagnostics refer to the script, which may be standard input.
+static std::string scriptName(const std::string &path)
+{
+    return path.empty() || path == "-" ? "<stdin>" : path;
+}
+
+// Lexes and parses the script without running it, and reports how fast.
+// Reading the file is not timed.
+static int parseScript(Parser &parser, const std::string &path)
+{
+    try
+    {
+        SourceFile source(path);
+
+        auto start = std::chrono::steady_clock::now();
+        std::unique_ptr<Program> program(parser.produceAST(source.text()));
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        for (const std::string &diagnostic : program->diagnostics)
+        {
+            std::cerr << scriptName(path) << ": " << diagnostic << "\n";
+        }
+
+        size_t bytes = source.text().size();
+        size_t tokens = parser.tokenCount();
+        size_t nodes = program->arena.objectCount();
+
+        std::cout << "Parsed " << bytes << " bytes, " << tokens << " tokens, " << nodes << " nodes in "
+                  << seconds * 1e3 << " ms (" << bytes / seconds / 1e6 << " MB/s, "
+                  << tokens / seconds / 1e6 << "M tokens/s, " << nodes / seconds / 1e6 << "M nodes/s)\n";
+    }
+    catch (const std::runtime_error &error)
+    {
+        std::cerr << "Error: " << error.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    bool treeWalk = false;
+    bool dumpBytecode = false;
+    bool repl = false;
+    bool runner = false;
+    bool parseOnly = false;
+    size_t jobs = 0;
+    std::vector<std::string> paths;
+    std::string cacheDir;
+    bool profile = false;
+    unsigned profileHz = 1000;
+    std::string profileOut = "profile.folded";
+    bool stats = false;
+    unsigned statsInterval = 0;
+    std::string statsOut; // stderr when empty
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--tree-walk")
+        {
+            treeWalk = true;
+        }
+        else if (arg == "--no-jit")
+        {
+            jitEnabled = false;
+        }
+        else if (arg == "--repl")
+        {
+            repl = true;
+        }
+        else if (arg == "--parse-only")
+        {
+            parseOnly = true;
+        }
+        else if (arg == "--dump-bytecode")
+        {
+            dumpBytecode = true;
+        }
+        else if (arg == "--max-depth" && i + 1 < argc && std::atol(argv[i + 1]) > 0)
+        {
+            maxCallDepth = static_cast<size_t>(std::atol(argv[++i]));
+        }
+        else if (arg == "--threads" && i + 1 < argc && std::atol(argv[i + 1]) > 0)
+        {
+            parallelThreads = static_cast<size_t>(std::atol(argv[++i]));
+        }
+        else if (arg == "--cache-dir" && i + 1 < argc)
+        {
+            cacheDir = argv[++i];
+        }
+        else if (arg == "--profile")
+        {
+            profile = true;
+        }
+        else if (arg == "--profile-hz" && i + 1 < argc && std::atol(argv[i + 1]) > 0)
+        {
+            profile = true;
+            profileHz = static_cast<unsigned>(std::atol(argv[++i]));
+        }
+        else if (arg == "--profile-out" && i + 1 < argc)
+        {
+            profile = true;
+            profileOut = argv[++i];
+        }
+        else if (arg == "--stats")
+        {
+            stats = true;
+        }
+        else if (arg == "--stats-interval" && i + 1 < argc && std::atol(argv[i + 1]) > 0)
+        {
+            stats = true;
+            statsInterval = static_cast<unsigned>(std::atol(argv[++i]));
+        }
+        else if (arg == "--stats-out" && i + 1 < argc)
+        {
+            stats = true;
+            statsOut = argv[++i];
+        }
+        else if (arg == "--jobs" && i + 1 < argc)
+        {
+            runner = true;
+            jobs = std::strtoul(argv[++i], nullptr, 10); // 0 uses every core
+        }
+        else if (arg.size() > 1 && arg[0] == '-')
+        {
+            std::cerr << "Unknown option: " << arg << "\n";
+            usage(argv[0]);
+            return 1;
+        }
+        else
+        {
+            paths.push_back(arg);
+        }
+    }
+
+    if (parseOnly && (runner || repl || profile || stats))
+    {
+        std::cerr << "--parse-only parses a single script and cannot be combined with --jobs, --repl, --profile or --stats\n";
+        return 1;
+    }
+
+    if (runner && profile)
+    {
+        std::cerr << "--profile runs a single script and cannot be combined with --jobs\n";
+        return 1;
+    }
+
+    if (runner && stats)
+    {
+        std::cerr << "--stats reports on a single run and cannot be combined with --jobs\n";
+        return 1;
+    }
+
+    if (runner)
+    {
+        std::unique_ptr<AstCache> disk;
+        if (!cacheDir.empty())
+        {
+            disk = std::make_unique<AstCache>(cacheDir);
+        }
+        return runScripts(paths, jobs, treeWalk, disk.get()) > 0 ? 1 : 0;
+    }
+
+    if (paths.size() > 1)
+    {
+        std::cerr << "Only one script can run without --jobs\n";
+        usage(argv[0]);
+        return 1;
+    }
+    std::string path = paths.empty() ? "" : paths[0];
+
     Parser parser;
-    Environment env = createGlobalEnv();
+
+    if (parseOnly)
+    {
+        return parseScript(parser, path);
+    }
+
+    // Snapshots cover everything from here on, builtins included.
+    std::unique_ptr<StatsReporter> reporter;
+    if (stats)
+    {
+        try
+        {
+            reporter = std::make_unique<StatsReporter>(Heap::current(), statsOut, statsInterval, treeWalk);
+        }
+        catch (const std::runtime_error &error)
+        {
+            std::cerr << "Error: " << error.what() << "\n";
+            return 1;
+        }
+    }
+
+    Environment *env = createGlobalEnv();
 
     std::cout << "\nRepl v0.1\n";
 
-    std::stringstream input_stream;
-    input_stream << std::cin.rdbuf();
-    std::string input = input_stream.str();
+    // Without a script a terminal gets an interactive session; --repl gives
+    // piped input one too, with a result printed per statement.
+    if (repl || (path.empty() && isatty(STDIN_FILENO)))
+    {
+        if (!path.empty())
+        {
+            std::cerr << "--repl reads from stdin and takes no script\n";
+            return 1;
+        }
+
+        Repl session(env, treeWalk);
+        session.run(std::cin, std::cout, isatty(STDIN_FILENO));
+        std::cout << "\n";
+        if (reporter)
+        {
+            reporter->snapshot();
+        }
+        return 0;
+    }
+
+    Program *program = nullptr;
+    int status = 0;
+    std::unique_ptr<Profiler> profiler;
+
+    try
+    {
+        // The source only needs to outlive parsing: the AST copies every
+        // name it keeps.
+        {
+            SourceFile source(path);
+
+            if (!cacheDir.empty())
+            {
+                AstCache cache(cacheDir);
+                program = cache.load(source.text());
+                if (!program)
+                {
+                    program = parser.produceAST(source.text());
+                    if (program->diagnostics.empty())
+                    {
+                        cache.store(source.text(), program);
+                    }
+                }
+            }
+            else
+            {
+                program = parser.produceAST(source.text());
+            }
+        }
+
+        for (const std::string &diagnostic : program->diagnostics)
+        {
+            std::cerr << scriptName(path) << ": " << diagnostic << "\n";
+        }
 
-    Program *program = parser.produceAST(input);
+        Optimizer optimizer;
+        optimizer.optimize(program);
 
-    RuntimeVal *result = evaluate(program, &env);
+        Resolver resolver(env);
+        resolver.resolve(program);
+
+        if (profile)
+        {
+            profiler = std::make_unique<Profiler>(scriptName(path), profileHz);
+        }
+
+        if (treeWalk)
+        {
+            // Reference mode: walks the AST directly, for differential
+            // testing against the bytecode VM.
+            if (profiler)
+            {
+                profiler->start();
+            }
+            evaluate(program, env);
+        }
+        else
+        {
+            Compiler compiler;
+            std::unique_ptr<FunctionProto> script = compiler.compile(program);
+
+            if (dumpBytecode)
+            {
+                std::cerr << disassemble(*script);
+            }
+
+            VM vm;
+            if (profiler)
+            {
+                profiler->start();
+            }
+            vm.run(script.get(), env);
+        }
+    }
+    catch (const std::runtime_error &error)
+    {
+        std::cerr << "Error: " << error.what() << "\n";
+        status = 1;
+    }
 
     std::cout << "\n";
-}
\ No newline at end of file
+
+    // Reported even when the script failed: it shows where it got to.
+    if (profiler)
+    {
+        profiler->stop();
+
+        std::ofstream folded(profileOut);
+        if (!folded)
+        {
+            std::cerr << "Could not write profile to " << profileOut << "\n";
+            status = 1;
+        }
+        profiler->report(std::cerr, folded);
+    }
+
+    if (reporter)
+    {
+        reporter->snapshot();
+    }
+
+    delete program;
+    return status;
+}
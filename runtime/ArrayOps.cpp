@@ -0,0 +1,346 @@
+#include "ArrayOps.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define ARRAY_OPS_X86 1
+#include <immintrin.h>
+#endif
+
+namespace
+{
+    double sumScalar(const double *values, size_t count)
+    {
+        double total = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            total += values[i];
+        }
+        return total;
+    }
+
+    double dotScalar(const double *a, const double *b, size_t count)
+    {
+        double total = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            total += a[i] * b[i];
+        }
+        return total;
+    }
+
+    // Same comparison as minpd and maxpd, so every version agrees on NaNs.
+    double minScalar(const double *values, size_t count)
+    {
+        double result = values[0];
+        for (size_t i = 1; i < count; i++)
+        {
+            result = values[i] < result ? values[i] : result;
+        }
+        return result;
+    }
+
+    double maxScalar(const double *values, size_t count)
+    {
+        double result = values[0];
+        for (size_t i = 1; i < count; i++)
+        {
+            result = values[i] > result ? values[i] : result;
+        }
+        return result;
+    }
+
+    void scaleScalar(double *out, const double *values, double factor, size_t count)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            out[i] = values[i] * factor;
+        }
+    }
+
+    void addScalar(double *out, const double *a, const double *b, size_t count)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            out[i] = a[i] + b[i];
+        }
+    }
+
+    void mulScalar(double *out, const double *a, const double *b, size_t count)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            out[i] = a[i] * b[i];
+        }
+    }
+
+    void prefixSumScalar(double *out, const double *values, size_t count)
+    {
+        double running = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            running += values[i];
+            out[i] = running;
+        }
+    }
+
+#if ARRAY_OPS_X86
+    // SSE2 is part of x86-64, so these need no check.
+
+    double horizontalSum(__m128d x)
+    {
+        return _mm_cvtsd_f64(_mm_add_sd(x, _mm_unpackhi_pd(x, x)));
+    }
+
+    double sumSse2(const double *values, size_t count)
+    {
+        __m128d acc0 = _mm_setzero_pd();
+        __m128d acc1 = _mm_setzero_pd();
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4)
+        {
+            acc0 = _mm_add_pd(acc0, _mm_loadu_pd(values + i));
+            acc1 = _mm_add_pd(acc1, _mm_loadu_pd(values + i + 2));
+        }
+        return horizontalSum(_mm_add_pd(acc0, acc1)) + sumScalar(values + i, count - i);
+    }
+
+    double dotSse2(const double *a, const double *b, size_t count)
+    {
+        __m128d acc0 = _mm_setzero_pd();
+        __m128d acc1 = _mm_setzero_pd();
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4)
+        {
+            acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+            acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+        }
+        return horizontalSum(_mm_add_pd(acc0, acc1)) + dotScalar(a + i, b + i, count - i);
+    }
+
+    double minSse2(const double *values, size_t count)
+    {
+        __m128d acc = _mm_set1_pd(values[0]);
+        size_t i = 0;
+        for (; i + 2 <= count; i += 2)
+        {
+            acc = _mm_min_pd(_mm_loadu_pd(values + i), acc);
+        }
+        double result = _mm_cvtsd_f64(_mm_min_sd(_mm_unpackhi_pd(acc, acc), acc));
+        if (i < count)
+        {
+            result = values[i] < result ? values[i] : result;
+        }
+        return result;
+    }
+
+    double maxSse2(const double *values, size_t count)
+    {
+        __m128d acc = _mm_set1_pd(values[0]);
+        size_t i = 0;
+        for (; i + 2 <= count; i += 2)
+        {
+            acc = _mm_max_pd(_mm_loadu_pd(values + i), acc);
+        }
+        double result = _mm_cvtsd_f64(_mm_max_sd(_mm_unpackhi_pd(acc, acc), acc));
+        if (i < count)
+        {
+            result = values[i] > result ? values[i] : result;
+        }
+        return result;
+    }
+
+    void scaleSse2(double *out, const double *values, double factor, size_t count)
+    {
+        __m128d k = _mm_set1_pd(factor);
+        size_t i = 0;
+        for (; i + 2 <= count; i += 2)
+        {
+            _mm_storeu_pd(out + i, _mm_mul_pd(_mm_loadu_pd(values + i), k));
+        }
+        scaleScalar(out + i, values + i, factor, count - i);
+    }
+
+    void addSse2(double *out, const double *a, const double *b, size_t count)
+    {
+        size_t i = 0;
+        for (; i + 2 <= count; i += 2)
+        {
+            _mm_storeu_pd(out + i, _mm_add_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        }
+        addScalar(out + i, a + i, b + i, count - i);
+    }
+
+    void mulSse2(double *out, const double *a, const double *b, size_t count)
+    {
+        size_t i = 0;
+        for (; i + 2 <= count; i += 2)
+        {
+            _mm_storeu_pd(out + i, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        }
+        mulScalar(out + i, a + i, b + i, count - i);
+    }
+
+    // Each pair [x0, x1] becomes [x0, x0 + x1] plus the total so far.
+    void prefixSumSse2(double *out, const double *values, size_t count)
+    {
+        __m128d carry = _mm_setzero_pd();
+        size_t i = 0;
+        for (; i + 2 <= count; i += 2)
+        {
+            __m128d x = _mm_loadu_pd(values + i);
+            x = _mm_add_pd(x, _mm_unpacklo_pd(_mm_setzero_pd(), x));
+            x = _mm_add_pd(x, carry);
+            _mm_storeu_pd(out + i, x);
+            carry = _mm_unpackhi_pd(x, x);
+        }
+        if (i < count)
+        {
+            out[i] = _mm_cvtsd_f64(carry) + values[i];
+        }
+    }
+
+#define AVX2 __attribute__((target("avx2")))
+
+    AVX2 double horizontalSum(__m256d x)
+    {
+        return horizontalSum(_mm_add_pd(_mm256_castpd256_pd128(x), _mm256_extractf128_pd(x, 1)));
+    }
+
+    AVX2 double sumAvx2(const double *values, size_t count)
+    {
+        __m256d acc0 = _mm256_setzero_pd();
+        __m256d acc1 = _mm256_setzero_pd();
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8)
+        {
+            acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(values + i));
+            acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(values + i + 4));
+        }
+        return horizontalSum(_mm256_add_pd(acc0, acc1)) + sumScalar(values + i, count - i);
+    }
+
+    AVX2 double dotAvx2(const double *a, const double *b, size_t count)
+    {
+        __m256d acc0 = _mm256_setzero_pd();
+        __m256d acc1 = _mm256_setzero_pd();
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8)
+        {
+            acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+            acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+        }
+        return horizontalSum(_mm256_add_pd(acc0, acc1)) + dotScalar(a + i, b + i, count - i);
+    }
+
+    AVX2 double minAvx2(const double *values, size_t count)
+    {
+        __m256d acc = _mm256_set1_pd(values[0]);
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4)
+        {
+            acc = _mm256_min_pd(_mm256_loadu_pd(values + i), acc);
+        }
+        __m128d half = _mm_min_pd(_mm256_extractf128_pd(acc, 1), _mm256_castpd256_pd128(acc));
+        double result = _mm_cvtsd_f64(_mm_min_sd(_mm_unpackhi_pd(half, half), half));
+        for (; i < count; i++)
+        {
+            result = values[i] < result ? values[i] : result;
+        }
+        return result;
+    }
+
+    AVX2 double maxAvx2(const double *values, size_t count)
+    {
+        __m256d acc = _mm256_set1_pd(values[0]);
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4)
+        {
+            acc = _mm256_max_pd(_mm256_loadu_pd(values + i), acc);
+        }
+        __m128d half = _mm_max_pd(_mm256_extractf128_pd(acc, 1), _mm256_castpd256_pd128(acc));
+        double result = _mm_cvtsd_f64(_mm_max_sd(_mm_unpackhi_pd(half, half), half));
+        for (; i < count; i++)
+        {
+            result = values[i] > result ? values[i] : result;
+        }
+        return result;
+    }
+
+    AVX2 void scaleAvx2(double *out, const double *values, double factor, size_t count)
+    {
+        __m256d k = _mm256_set1_pd(factor);
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4)
+        {
+            _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(values + i), k));
+        }
+        scaleScalar(out + i, values + i, factor, count - i);
+    }
+
+    AVX2 void addAvx2(double *out, const double *a, const double *b, size_t count)
+    {
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4)
+        {
+            _mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+        }
+        addScalar(out + i, a + i, b + i, count - i);
+    }
+
+    AVX2 void mulAvx2(double *out, const double *a, const double *b, size_t count)
+    {
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4)
+        {
+            _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+        }
+        mulScalar(out + i, a + i, b + i, count - i);
+    }
+
+    // Two shift-and-add steps turn [x0, x1, x2, x3] into its running sums,
+    // then the total so far is added to every lane.
+    AVX2 void prefixSumAvx2(double *out, const double *values, size_t count)
+    {
+        __m256d zero = _mm256_setzero_pd();
+        __m256d carry = zero;
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4)
+        {
+            __m256d x = _mm256_loadu_pd(values + i);
+            x = _mm256_add_pd(x, _mm256_blend_pd(_mm256_permute4x64_pd(x, _MM_SHUFFLE(2, 1, 0, 0)), zero, 0b0001));
+            x = _mm256_add_pd(x, _mm256_blend_pd(_mm256_permute4x64_pd(x, _MM_SHUFFLE(1, 0, 0, 0)), zero, 0b0011));
+            x = _mm256_add_pd(x, carry);
+            _mm256_storeu_pd(out + i, x);
+            carry = _mm256_permute4x64_pd(x, _MM_SHUFFLE(3, 3, 3, 3));
+        }
+        double running = _mm256_cvtsd_f64(carry);
+        for (; i < count; i++)
+        {
+            running += values[i];
+            out[i] = running;
+        }
+    }
+
+#undef AVX2
+#endif
+
+    const ArrayKernels &selectKernels()
+    {
+        static const ArrayKernels scalar{"scalar", sumScalar, dotScalar, minScalar, maxScalar, scaleScalar, addScalar, mulScalar, prefixSumScalar};
+#if ARRAY_OPS_X86
+        static const ArrayKernels avx2{"avx2", sumAvx2, dotAvx2, minAvx2, maxAvx2, scaleAvx2, addAvx2, mulAvx2, prefixSumAvx2};
+        static const ArrayKernels sse2{"sse2", sumSse2, dotSse2, minSse2, maxSse2, scaleSse2, addSse2, mulSse2, prefixSumSse2};
+
+        __builtin_cpu_init();
+        (void)scalar;
+        return __builtin_cpu_supports("avx2") ? avx2 : sse2;
+#else
+        return scalar;
+#endif
+    }
+}
+
+const ArrayKernels &arrayKernels()
+{
+    static const ArrayKernels &kernels = selectKernels();
+    return kernels;
+}
@@ -0,0 +1,27 @@
+#ifndef ARRAY_OPS_H
+#define ARRAY_OPS_H
+
+#include <cstddef>
+
+// Bulk kernels over contiguous doubles, behind the numeric array builtins.
+// On x86-64 there is an SSE2 version of each and an AVX2 one, picked once
+// by what the CPU supports; elsewhere plain loops. Sums and dot products
+// accumulate in several lanes at once, so their rounding can differ in the
+// last bits from a left-to-right loop. min and max need count > 0; out may
+// alias an input.
+struct ArrayKernels
+{
+    const char *name;
+    double (*sum)(const double *values, size_t count);
+    double (*dot)(const double *a, const double *b, size_t count);
+    double (*min)(const double *values, size_t count);
+    double (*max)(const double *values, size_t count);
+    void (*scale)(double *out, const double *values, double factor, size_t count);
+    void (*add)(double *out, const double *a, const double *b, size_t count);
+    void (*mul)(double *out, const double *a, const double *b, size_t count);
+    void (*prefixSum)(double *out, const double *values, size_t count);
+};
+
+const ArrayKernels &arrayKernels();
+
+#endif // ARRAY_OPS_H
@@ -0,0 +1,230 @@
+#include "Bytecode.h"
+
+#include <sstream>
+#include <algorithm>
+#include <iomanip>
+#include <stdexcept>
+
+uint32_t Chunk::lineAt(size_t offset) const
+{
+    auto after = std::upper_bound(lines.begin(), lines.end(), offset, [](size_t offset, const LineStart &start)
+                                  { return offset < start.offset; });
+    return after == lines.begin() ? 0 : std::prev(after)->line;
+}
+
+uint32_t Chunk::addConstant(Value value)
+{
+    auto it = constantIndex.find(value.raw());
+    if (it != constantIndex.end())
+    {
+        return it->second;
+    }
+
+    if (constants.size() >= UINT32_MAX)
+    {
+        throw std::runtime_error("Too many constants in one function");
+    }
+
+    uint32_t index = static_cast<uint32_t>(constants.size());
+    constants.push_back(value);
+    constantIndex[value.raw()] = index;
+    return index;
+}
+
+uint16_t Chunk::addName(Symbol name)
+{
+    auto it = nameIndex.find(name);
+    if (it != nameIndex.end())
+    {
+        return it->second;
+    }
+
+    if (names.size() > UINT16_MAX)
+    {
+        throw std::runtime_error("Too many names in one function");
+    }
+
+    uint16_t index = static_cast<uint16_t>(names.size());
+    names.push_back(name);
+    nameIndex[name] = index;
+    return index;
+}
+
+uint32_t Chunk::addString(Symbol text)
+{
+    auto it = stringIndex.find(text);
+    if (it != stringIndex.end())
+    {
+        return it->second;
+    }
+
+    if (strings.size() >= UINT32_MAX)
+    {
+        throw std::runtime_error("Too many strings in one function");
+    }
+
+    uint32_t index = static_cast<uint32_t>(strings.size());
+    strings.push_back(text);
+    stringIndex[text] = index;
+    return index;
+}
+
+uint16_t Chunk::addTemplate(std::vector<Symbol> keys)
+{
+    if (objectTemplates.size() > UINT16_MAX)
+    {
+        throw std::runtime_error("Too many object literals in one function");
+    }
+
+    objectTemplates.push_back({std::move(keys)});
+    return static_cast<uint16_t>(objectTemplates.size() - 1);
+}
+
+uint16_t Chunk::addCache()
+{
+    if (caches.size() > UINT16_MAX)
+    {
+        throw std::runtime_error("Too many property accesses in one function");
+    }
+
+    caches.emplace_back();
+    return static_cast<uint16_t>(caches.size() - 1);
+}
+
+const char *opcodeName(OpCode op)
+{
+    switch (op)
+    {
+#define OPCODE_NAME(name) \
+    case OpCode::name:    \
+        return #name;
+        OPCODES(OPCODE_NAME)
+#undef OPCODE_NAME
+    }
+    return "?";
+}
+
+static void disassembleInto(std::ostringstream &out, const FunctionProto &proto)
+{
+    const Chunk &chunk = proto.chunk;
+    out << "== " << proto.name.str() << " ==\n";
+
+    size_t offset = 0;
+    uint32_t previousLine = UINT32_MAX;
+    while (offset < chunk.code.size())
+    {
+        OpCode op = static_cast<OpCode>(chunk.code[offset]);
+        uint32_t line = chunk.lineAt(offset);
+        out << std::setw(4) << std::setfill('0') << offset << std::setfill(' ') << " ";
+        if (line == previousLine)
+        {
+            out << "   | ";
+        }
+        else
+        {
+            out << std::setw(4) << line << " ";
+        }
+        out << opcodeName(op);
+        previousLine = line;
+        offset++;
+
+        auto readShort = [&]()
+        {
+            uint16_t value = chunk.code[offset] | (chunk.code[offset + 1] << 8);
+            offset += 2;
+            return value;
+        };
+        auto readInt = [&]()
+        {
+            uint32_t low = readShort();
+            return low | (static_cast<uint32_t>(readShort()) << 16);
+        };
+
+        switch (op)
+        {
+        case OpCode::Constant:
+            out << " " << chunk.constants[readShort()].toString();
+            break;
+        case OpCode::ConstantWide:
+            out << " " << chunk.constants[readInt()].toString();
+            break;
+        case OpCode::String:
+            out << " " << std::quoted(chunk.strings[readInt()].str());
+            break;
+        case OpCode::GetLocal:
+        case OpCode::SetLocal:
+            out << " " << readShort();
+            break;
+        case OpCode::GetGlobal:
+        case OpCode::SetGlobal:
+            out << " " << readInt();
+            break;
+        case OpCode::Jump:
+        case OpCode::JumpIfFalse:
+        case OpCode::JumpUnlessLess:
+        case OpCode::JumpUnlessLessEqual:
+        case OpCode::JumpUnlessGreater:
+        case OpCode::JumpUnlessGreaterEqual:
+        case OpCode::JumpUnlessEqual:
+        case OpCode::JumpUnlessNotEqual:
+            out << " -> " << std::setw(4) << std::setfill('0') << readInt() << std::setfill(' ');
+            break;
+        case OpCode::GetEnv:
+        case OpCode::SetEnv:
+        {
+            int depth = chunk.code[offset++];
+            out << " " << depth << " " << readShort();
+            break;
+        }
+        case OpCode::NewObject:
+        {
+            out << " {";
+            const std::vector<Symbol> &keys = chunk.objectTemplates[readShort()].keys;
+            for (size_t i = 0; i < keys.size(); i++)
+            {
+                out << (i ? ", " : "") << keys[i].str();
+            }
+            out << "}";
+            break;
+        }
+        case OpCode::InitProp:
+        case OpCode::NewArray:
+        case OpCode::AppendArray:
+            out << " " << readShort();
+            break;
+        case OpCode::InitPropWide:
+            out << " " << readInt();
+            break;
+        case OpCode::GetProp:
+        case OpCode::SetProp:
+        {
+            out << " " << chunk.names[readShort()].str();
+            out << " @" << readShort();
+            break;
+        }
+        case OpCode::Closure:
+            out << " <function " << chunk.functions[readShort()]->name.str() << ">";
+            break;
+        case OpCode::Call:
+        case OpCode::TailCall:
+            out << " " << static_cast<int>(chunk.code[offset++]);
+            break;
+        default:
+            break;
+        }
+        out << "\n";
+    }
+
+    for (const auto &function : chunk.functions)
+    {
+        out << "\n";
+        disassembleInto(out, *function);
+    }
+}
+
+std::string disassemble(const FunctionProto &proto)
+{
+    std::ostringstream out;
+    disassembleInto(out, proto);
+    return out.str();
+}
@@ -0,0 +1,171 @@
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#include "Values.h"
+#include "Shape.h"
+#include "Jit.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Operand widths follow each name: multi-byte operands are little endian.
+#define OPCODES(X)                                                    \
+    X(Constant)    /* u16 constant index; push constant */            \
+    X(ConstantWide) /* u32 constant index; push constant */           \
+    X(String)      /* u32 string index; push a string of that text */ \
+    X(Null)        /* push null */                                    \
+    X(Pop)         /* discard top */                                  \
+    X(GetLocal)    /* u16 slot; push stack slot of the frame */       \
+    X(SetLocal)    /* u16 slot; store top, leave it */                \
+    X(GetGlobal)   /* u32 slot; push global slot */                   \
+    X(SetGlobal)   /* u32 slot; store top, leave it */                \
+    X(GetEnv)      /* u8 depth, u16 slot; push environment slot */    \
+    X(SetEnv)      /* u8 depth, u16 slot; store top, leave it */      \
+    X(Closure)     /* u16 function index; push new FunctionVal */     \
+    X(NewObject)   /* u16 template index; push object with its shape */ \
+    X(InitProp)    /* u16 slot; obj val -> obj */                     \
+    X(InitPropWide) /* u32 slot; obj val -> obj */                    \
+    X(NewArray)    /* u16 count; elements... -> array */              \
+    X(AppendArray) /* u16 count; array elements... -> array */        \
+    X(GetProp)     /* u16 name, u16 cache; obj -> val */              \
+    X(SetProp)     /* u16 name, u16 cache; obj val -> val */          \
+    X(GetIndex)    /* obj key -> val */                               \
+    X(SetIndex)    /* obj key val -> val */                           \
+    X(Add)                                                            \
+    X(Sub)                                                            \
+    X(Mul)                                                            \
+    X(Div)                                                            \
+    X(Mod)                                                            \
+    X(Less)        /* a b -> a < b */                                 \
+    X(LessEqual)                                                      \
+    X(Greater)                                                        \
+    X(GreaterEqual)                                                   \
+    X(Equal)                                                          \
+    X(NotEqual)                                                       \
+    X(Jump)        /* u32 target; continue at offset target */        \
+    X(JumpIfFalse) /* u32 target; cond -> ; jump unless cond truthy */ \
+    X(JumpUnlessLess) /* u32 target; a b -> ; jump unless a < b */    \
+    X(JumpUnlessLessEqual)                                            \
+    X(JumpUnlessGreater)                                              \
+    X(JumpUnlessGreaterEqual)                                         \
+    X(JumpUnlessEqual)                                                \
+    X(JumpUnlessNotEqual)                                             \
+    X(Call)        /* u8 argc; args... callee -> result */            \
+    X(TailCall)    /* u8 argc; args... callee -> replaces this frame */ \
+    X(Return)      /* result -> (caller frame) result */
+
+enum class OpCode : uint8_t
+{
+#define OPCODE_ENUM(name) name,
+    OPCODES(OPCODE_ENUM)
+#undef OPCODE_ENUM
+};
+
+struct FunctionProto;
+
+// Keys of one object literal site in slot order. The shape is resolved the
+// first time the literal runs, so every object it creates shares it.
+struct ObjectTemplate
+{
+    std::vector<Symbol> keys;
+    Shape *shape = nullptr;
+};
+
+struct Chunk
+{
+    std::vector<uint8_t> code;
+    std::vector<Value> constants;
+    std::vector<Symbol> names;
+    std::vector<Symbol> strings; // interned text of string literals
+    std::vector<std::unique_ptr<FunctionProto>> functions;
+
+    // Source line of the code from each offset on, in offset order; only
+    // changes of line get an entry.
+    struct LineStart
+    {
+        uint32_t offset;
+        uint32_t line;
+    };
+    std::vector<LineStart> lines;
+
+    // Filled in by the VM as the code runs.
+    mutable std::vector<ObjectTemplate> objectTemplates;
+    mutable std::vector<PropertyCache> caches;
+
+    // Deduplication indexes for the constant pool, name table and string
+    // table, keyed on the raw value bits and the symbol respectively.
+    std::unordered_map<uint64_t, uint32_t> constantIndex;
+    std::unordered_map<Symbol, uint16_t> nameIndex;
+    std::unordered_map<Symbol, uint32_t> stringIndex;
+
+    void emit(OpCode op) { code.push_back(static_cast<uint8_t>(op)); }
+    void emitByte(uint8_t byte) { code.push_back(byte); }
+    void emitShort(uint16_t value)
+    {
+        code.push_back(static_cast<uint8_t>(value & 0xff));
+        code.push_back(static_cast<uint8_t>(value >> 8));
+    }
+    void emitInt(uint32_t value)
+    {
+        emitShort(static_cast<uint16_t>(value & 0xffff));
+        emitShort(static_cast<uint16_t>(value >> 16));
+    }
+    void patchInt(size_t offset, uint32_t value)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            code[offset + i] = static_cast<uint8_t>(value >> (8 * i));
+        }
+    }
+
+    // Code emitted from here on comes from line.
+    void markLine(uint32_t line)
+    {
+        uint32_t offset = static_cast<uint32_t>(code.size());
+        if (!lines.empty() && lines.back().offset == offset)
+        {
+            lines.back().line = line;
+        }
+        else if (lines.empty() || lines.back().line != line)
+        {
+            lines.push_back({offset, line});
+        }
+    }
+    uint32_t currentLine() const { return lines.empty() ? 0 : lines.back().line; }
+    uint32_t lineAt(size_t offset) const;
+
+    uint32_t addConstant(Value value);
+    uint16_t addName(Symbol name);
+    uint32_t addString(Symbol text);
+    uint16_t addTemplate(std::vector<Symbol> keys);
+    uint16_t addCache();
+};
+
+// Compiled form of a function body or of a whole script. Protos own their
+// nested functions and must outlive every FunctionVal created from them.
+//
+// Locals of a function live in its frame on the VM stack, at fixed offsets
+// from the frame base. Only a captured function, one whose locals are used
+// by a nested function, gets a heap Environment to hold them instead.
+struct FunctionProto
+{
+    Symbol name;
+    uint32_t line = 0; // of the declaration
+    std::vector<Symbol> parameters;
+    int localCount = 0;
+    bool captured = false;
+    Chunk chunk;
+
+    // Tiering state, updated by the VM: calls counts up to the JIT's
+    // threshold, and jit holds the machine code once compiled.
+    mutable uint32_t calls = 0;
+    mutable std::unique_ptr<JitCode> jit;
+};
+
+const char *opcodeName(OpCode op);
+std::string disassemble(const FunctionProto &proto);
+
+#endif // BYTECODE_H
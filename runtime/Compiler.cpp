@@ -0,0 +1,592 @@
+#include "Compiler.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_map>
+
+std::unique_ptr<FunctionProto> Compiler::compile(Program *program)
+{
+    auto script = std::make_unique<FunctionProto>();
+    script->name = intern("<script>");
+
+    current = script.get();
+    compile_body(program->body, false);
+    current = nullptr;
+
+    return script;
+}
+
+// Every statement leaves exactly one value on the stack; a body keeps only
+// the last one, matching eval_program and the tree-walking call path. In a
+// function, the last statement is compiled in tail position.
+void Compiler::compile_body(const std::vector<Stmt *> &body, bool function)
+{
+    if (function && !body.empty())
+    {
+        for (size_t i = 0; i + 1 < body.size(); i++)
+        {
+            if (body[i]->line)
+            {
+                chunk().markLine(body[i]->line);
+            }
+            compile_stmt(body[i]);
+            chunk().emit(OpCode::Pop);
+        }
+        compile_tail(body.back());
+        return;
+    }
+
+    compile_statements(body);
+    chunk().emit(OpCode::Return);
+}
+
+// Leaves the value of the last statement, or null if there are none.
+void Compiler::compile_statements(const std::vector<Stmt *> &body)
+{
+    if (body.empty())
+    {
+        chunk().emit(OpCode::Null);
+    }
+
+    for (size_t i = 0; i < body.size(); i++)
+    {
+        // So that the Pop or Return after the statement shares its line.
+        if (body[i]->line)
+        {
+            chunk().markLine(body[i]->line);
+        }
+
+        compile_stmt(body[i]);
+        if (i + 1 < body.size())
+        {
+            chunk().emit(OpCode::Pop);
+        }
+    }
+}
+
+// Compiles stmt to return its value from the function. A call there is a
+// tail call, and so is one at the end of either branch of an if or of a
+// block.
+void Compiler::compile_tail(Stmt *stmt)
+{
+    if (!stmt)
+    {
+        chunk().emit(OpCode::Null);
+        chunk().emit(OpCode::Return);
+        return;
+    }
+    if (stmt->line)
+    {
+        chunk().markLine(stmt->line);
+    }
+
+    switch (stmt->kind)
+    {
+    case NodeType::CallExpr:
+        compile_call_expr(static_cast<CallExpr *>(stmt), true);
+        break;
+    case NodeType::IfStmt:
+    {
+        IfStmt *branch = static_cast<IfStmt *>(stmt);
+        size_t skipThen = compile_condition(branch->condition);
+        compile_tail(branch->thenBranch);
+        patch_jump(skipThen);
+        chunk().markLine(stmt->line);
+        compile_tail(branch->elseBranch);
+        break;
+    }
+    case NodeType::BlockStmt:
+    {
+        std::vector<Stmt *> &body = static_cast<BlockStmt *>(stmt)->body;
+        if (body.empty())
+        {
+            compile_tail(nullptr);
+            break;
+        }
+        compile_body(body, true);
+        break;
+    }
+    default:
+        compile_stmt(stmt);
+        chunk().emit(OpCode::Return);
+        break;
+    }
+}
+
+// Jumps are to absolute offsets in the chunk; a forward one is emitted with
+// a placeholder that patch_jump fills in once the target is reached.
+size_t Compiler::emit_jump(OpCode op)
+{
+    chunk().emit(op);
+    chunk().emitInt(UINT32_MAX);
+    return chunk().code.size() - 4;
+}
+
+void Compiler::emit_jump_to(size_t target)
+{
+    chunk().emit(OpCode::Jump);
+    chunk().emitInt(static_cast<uint32_t>(target));
+}
+
+void Compiler::patch_jump(size_t operand)
+{
+    if (chunk().code.size() > UINT32_MAX)
+    {
+        throw std::runtime_error("Function too large to jump within");
+    }
+    chunk().patchInt(operand, static_cast<uint32_t>(chunk().code.size()));
+}
+
+// Emits a jump taken when condition is false and returns it for patching.
+// A comparison fuses with the jump, so no boolean is pushed and tested.
+size_t Compiler::compile_condition(Expr *condition)
+{
+    if (condition->kind != NodeType::BinaryExpr || !isComparison(static_cast<BinaryExpr *>(condition)->op))
+    {
+        compile_stmt(condition);
+        return emit_jump(OpCode::JumpIfFalse);
+    }
+
+    BinaryExpr *comparison = static_cast<BinaryExpr *>(condition);
+    compile_stmt(comparison->left);
+    compile_stmt(comparison->right);
+
+    switch (comparison->op)
+    {
+    case Operator::Less:
+        return emit_jump(OpCode::JumpUnlessLess);
+    case Operator::LessEqual:
+        return emit_jump(OpCode::JumpUnlessLessEqual);
+    case Operator::Greater:
+        return emit_jump(OpCode::JumpUnlessGreater);
+    case Operator::GreaterEqual:
+        return emit_jump(OpCode::JumpUnlessGreaterEqual);
+    case Operator::Equal:
+        return emit_jump(OpCode::JumpUnlessEqual);
+    default:
+        return emit_jump(OpCode::JumpUnlessNotEqual);
+    }
+}
+
+void Compiler::compile_if_stmt(IfStmt *stmt)
+{
+    size_t skipThen = compile_condition(stmt->condition);
+
+    if (stmt->thenBranch)
+    {
+        compile_stmt(stmt->thenBranch);
+    }
+    else
+    {
+        chunk().emit(OpCode::Null);
+    }
+    size_t skipElse = emit_jump(OpCode::Jump);
+
+    patch_jump(skipThen);
+    if (stmt->elseBranch)
+    {
+        compile_stmt(stmt->elseBranch);
+    }
+    else
+    {
+        chunk().emit(OpCode::Null);
+    }
+    patch_jump(skipElse);
+}
+
+// Loops test their condition at the top and jump back to it after the
+// body; they leave null behind.
+void Compiler::compile_while_stmt(WhileStmt *stmt)
+{
+    size_t start = chunk().code.size();
+    size_t exit = compile_condition(stmt->condition);
+
+    if (stmt->body)
+    {
+        compile_stmt(stmt->body);
+        chunk().emit(OpCode::Pop);
+    }
+    emit_jump_to(start);
+
+    patch_jump(exit);
+    chunk().emit(OpCode::Null);
+}
+
+void Compiler::compile_for_stmt(ForStmt *stmt)
+{
+    if (stmt->init)
+    {
+        compile_stmt(stmt->init);
+        chunk().emit(OpCode::Pop);
+    }
+
+    size_t start = chunk().code.size();
+    size_t exit = SIZE_MAX;
+    if (stmt->condition)
+    {
+        exit = compile_condition(stmt->condition);
+    }
+
+    if (stmt->body)
+    {
+        compile_stmt(stmt->body);
+        chunk().emit(OpCode::Pop);
+    }
+    if (stmt->increment)
+    {
+        compile_stmt(stmt->increment);
+        chunk().emit(OpCode::Pop);
+    }
+    emit_jump_to(start);
+
+    if (exit != SIZE_MAX)
+    {
+        patch_jump(exit);
+    }
+    chunk().emit(OpCode::Null);
+}
+
+void Compiler::emit_constant(Value value)
+{
+    uint32_t index = chunk().addConstant(value);
+    if (index <= UINT16_MAX)
+    {
+        chunk().emit(OpCode::Constant);
+        chunk().emitShort(static_cast<uint16_t>(index));
+    }
+    else
+    {
+        chunk().emit(OpCode::ConstantWide);
+        chunk().emitInt(index);
+    }
+}
+
+void Compiler::emit_variable(bool store, int depth, int slot)
+{
+    if (depth == functionDepth)
+    {
+        chunk().emit(store ? OpCode::SetGlobal : OpCode::GetGlobal);
+        chunk().emitInt(static_cast<uint32_t>(slot));
+        return;
+    }
+
+    if (slot > UINT16_MAX)
+    {
+        throw std::runtime_error("Too many local variables in one function");
+    }
+
+    if (depth == 0 && !captured.back())
+    {
+        chunk().emit(store ? OpCode::SetLocal : OpCode::GetLocal);
+        chunk().emitShort(static_cast<uint16_t>(slot));
+        return;
+    }
+
+    // Only captured functions have an environment, so the hops to the
+    // target skip every function in between that keeps its locals on the
+    // stack.
+    int hops = 0;
+    for (int i = 0; i < depth; i++)
+    {
+        if (captured[captured.size() - 1 - i])
+        {
+            hops++;
+        }
+    }
+    if (hops > UINT8_MAX)
+    {
+        throw std::runtime_error("Functions nested too deeply");
+    }
+
+    chunk().emit(store ? OpCode::SetEnv : OpCode::GetEnv);
+    chunk().emitByte(static_cast<uint8_t>(hops));
+    chunk().emitShort(static_cast<uint16_t>(slot));
+}
+
+// Code for stmt is attributed to its line; whatever the enclosing node
+// emits after it goes back to the enclosing line.
+void Compiler::compile_stmt(Stmt *stmt)
+{
+    uint32_t enclosingLine = chunk().currentLine();
+    if (stmt->line)
+    {
+        chunk().markLine(stmt->line);
+    }
+
+    switch (stmt->kind)
+    {
+    case NodeType::NumericLiteral:
+        emit_constant(Value::canonicalNumber(static_cast<NumericLiteral *>(stmt)->value));
+        break;
+    case NodeType::StringLiteral:
+        chunk().emit(OpCode::String);
+        chunk().emitInt(chunk().addString(static_cast<StringLiteral *>(stmt)->value));
+        break;
+    case NodeType::Identifier:
+    {
+        Identifier *ident = static_cast<Identifier *>(stmt);
+        emit_variable(false, ident->depth, ident->slot);
+        break;
+    }
+    case NodeType::ObjectLiteral:
+        compile_object_expr(static_cast<ObjectLiteral *>(stmt));
+        break;
+    case NodeType::ArrayLiteral:
+        compile_array_expr(static_cast<ArrayLiteral *>(stmt));
+        break;
+    case NodeType::AssignmentExpr:
+        compile_assignment(static_cast<AssignmentExpr *>(stmt));
+        break;
+    case NodeType::BinaryExpr:
+        compile_binary_expr(static_cast<BinaryExpr *>(stmt));
+        break;
+    case NodeType::CallExpr:
+        compile_call_expr(static_cast<CallExpr *>(stmt));
+        break;
+    case NodeType::MemberExpr:
+        compile_member_expr(static_cast<MemberExpr *>(stmt));
+        break;
+    case NodeType::VarDeclaration:
+        compile_var_declaration(static_cast<VarDeclaration *>(stmt));
+        break;
+    case NodeType::FunctionDeclaration:
+        compile_function_declaration(static_cast<FunctionDeclaration *>(stmt));
+        break;
+    case NodeType::IfStmt:
+        compile_if_stmt(static_cast<IfStmt *>(stmt));
+        break;
+    case NodeType::WhileStmt:
+        compile_while_stmt(static_cast<WhileStmt *>(stmt));
+        break;
+    case NodeType::ForStmt:
+        compile_for_stmt(static_cast<ForStmt *>(stmt));
+        break;
+    case NodeType::BlockStmt:
+        compile_statements(static_cast<BlockStmt *>(stmt)->body);
+        break;
+    default:
+        throw std::runtime_error("Unknown AST Node");
+    }
+
+    chunk().markLine(enclosingLine);
+}
+
+void Compiler::compile_var_declaration(VarDeclaration *declaration)
+{
+    if (declaration->value)
+    {
+        compile_stmt(declaration->value);
+    }
+    else
+    {
+        chunk().emit(OpCode::Null);
+    }
+
+    emit_variable(true, 0, declaration->slot);
+}
+
+void Compiler::compile_function_declaration(FunctionDeclaration *declaration)
+{
+    auto function = std::make_unique<FunctionProto>();
+    function->name = declaration->name;
+    function->line = declaration->line;
+    function->parameters = declaration->parameters;
+    function->localCount = declaration->localCount;
+    function->captured = declaration->captured;
+
+    FunctionProto *enclosing = current;
+    current = function.get();
+    functionDepth++;
+    captured.push_back(declaration->captured);
+    compile_body(declaration->body, true);
+    captured.pop_back();
+    functionDepth--;
+    current = enclosing;
+
+    if (chunk().functions.size() > UINT16_MAX)
+    {
+        throw std::runtime_error("Too many functions in one scope");
+    }
+    chunk().functions.push_back(std::move(function));
+
+    chunk().emit(OpCode::Closure);
+    chunk().emitShort(static_cast<uint16_t>(chunk().functions.size() - 1));
+    emit_variable(true, 0, declaration->slot);
+}
+
+void Compiler::compile_assignment(AssignmentExpr *node)
+{
+    if (node->assignee->kind == NodeType::MemberExpr)
+    {
+        compile_member_assignment(static_cast<MemberExpr *>(node->assignee), node->value);
+        return;
+    }
+    if (node->assignee->kind != NodeType::Identifier)
+    {
+        throw std::runtime_error("Left hand side of assignment must be an identifier or member");
+    }
+
+    Identifier *target = static_cast<Identifier *>(node->assignee);
+    compile_stmt(node->value);
+    emit_variable(true, target->depth, target->slot);
+}
+
+void Compiler::compile_binary_expr(BinaryExpr *binop)
+{
+    compile_stmt(binop->left);
+    compile_stmt(binop->right);
+
+    switch (binop->op)
+    {
+    case Operator::Add:
+        chunk().emit(OpCode::Add);
+        break;
+    case Operator::Subtract:
+        chunk().emit(OpCode::Sub);
+        break;
+    case Operator::Multiply:
+        chunk().emit(OpCode::Mul);
+        break;
+    case Operator::Divide:
+        chunk().emit(OpCode::Div);
+        break;
+    case Operator::Modulo:
+        chunk().emit(OpCode::Mod);
+        break;
+    case Operator::Less:
+        chunk().emit(OpCode::Less);
+        break;
+    case Operator::LessEqual:
+        chunk().emit(OpCode::LessEqual);
+        break;
+    case Operator::Greater:
+        chunk().emit(OpCode::Greater);
+        break;
+    case Operator::GreaterEqual:
+        chunk().emit(OpCode::GreaterEqual);
+        break;
+    case Operator::Equal:
+        chunk().emit(OpCode::Equal);
+        break;
+    case Operator::NotEqual:
+        chunk().emit(OpCode::NotEqual);
+        break;
+    }
+}
+
+// Literal keys are known statically, so the object is created with its
+// final shape and each value is stored straight into its slot.
+void Compiler::compile_object_expr(ObjectLiteral *obj)
+{
+    std::vector<Symbol> keys;
+    std::unordered_map<Symbol, uint32_t> slotOf;
+    std::vector<uint32_t> slots;
+
+    for (Property *prop : obj->properties)
+    {
+        auto found = slotOf.emplace(prop->key, static_cast<uint32_t>(keys.size()));
+        if (found.second)
+        {
+            keys.push_back(prop->key);
+        }
+        slots.push_back(found.first->second);
+    }
+
+    chunk().emit(OpCode::NewObject);
+    chunk().emitShort(chunk().addTemplate(std::move(keys)));
+
+    for (size_t i = 0; i < obj->properties.size(); i++)
+    {
+        Property *prop = obj->properties[i];
+        if (prop->value)
+        {
+            compile_stmt(prop->value);
+        }
+        else
+        {
+            emit_variable(false, prop->depth, prop->slot);
+        }
+
+        if (slots[i] <= UINT16_MAX)
+        {
+            chunk().emit(OpCode::InitProp);
+            chunk().emitShort(static_cast<uint16_t>(slots[i]));
+        }
+        else
+        {
+            chunk().emit(OpCode::InitPropWide);
+            chunk().emitInt(slots[i]);
+        }
+    }
+}
+
+// Elements go on the stack a chunk at a time, the first making the array
+// and the rest appended to it, so no count overflows its operand.
+void Compiler::compile_array_expr(ArrayLiteral *array)
+{
+    const std::vector<Expr *> &elements = array->elements;
+    size_t begin = 0;
+    do
+    {
+        size_t end = std::min(elements.size(), begin + UINT16_MAX);
+        for (size_t i = begin; i < end; i++)
+        {
+            compile_stmt(elements[i]);
+        }
+
+        chunk().emit(begin == 0 ? OpCode::NewArray : OpCode::AppendArray);
+        chunk().emitShort(static_cast<uint16_t>(end - begin));
+        begin = end;
+    } while (begin < elements.size());
+}
+
+void Compiler::compile_member_expr(MemberExpr *expr)
+{
+    compile_stmt(expr->object);
+
+    if (expr->computed)
+    {
+        compile_stmt(expr->property);
+        chunk().emit(OpCode::GetIndex);
+        return;
+    }
+
+    chunk().emit(OpCode::GetProp);
+    chunk().emitShort(chunk().addName(static_cast<Identifier *>(expr->property)->symbol));
+    chunk().emitShort(chunk().addCache());
+}
+
+void Compiler::compile_member_assignment(MemberExpr *member, Expr *value)
+{
+    compile_stmt(member->object);
+
+    if (member->computed)
+    {
+        compile_stmt(member->property);
+        compile_stmt(value);
+        chunk().emit(OpCode::SetIndex);
+        return;
+    }
+
+    compile_stmt(value);
+    chunk().emit(OpCode::SetProp);
+    chunk().emitShort(chunk().addName(static_cast<Identifier *>(member->property)->symbol));
+    chunk().emitShort(chunk().addCache());
+}
+
+void Compiler::compile_call_expr(CallExpr *expr, bool tail)
+{
+    if (expr->args.size() > UINT8_MAX)
+    {
+        throw std::runtime_error("Too many arguments in call");
+    }
+
+    for (Expr *arg : expr->args)
+    {
+        compile_stmt(arg);
+    }
+    compile_stmt(expr->caller);
+
+    chunk().emit(tail ? OpCode::TailCall : OpCode::Call);
+    chunk().emitByte(static_cast<uint8_t>(expr->args.size()));
+}
@@ -0,0 +1,46 @@
+#ifndef COMPILER_H
+#define COMPILER_H
+
+#include "../frontend/Ast.h"
+#include "Bytecode.h"
+
+#include <memory>
+#include <vector>
+
+class Compiler
+{
+private:
+    FunctionProto *current = nullptr;
+    int functionDepth = 0; // depth at which a resolved binding is global
+    std::vector<bool> captured; // per enclosing function, innermost last
+
+    Chunk &chunk() { return current->chunk; }
+
+    void emit_constant(Value value);
+    void emit_variable(bool store, int depth, int slot);
+    size_t emit_jump(OpCode op);
+    void emit_jump_to(size_t target);
+    void patch_jump(size_t operand);
+    void compile_stmt(Stmt *stmt);
+    void compile_tail(Stmt *stmt);
+    void compile_body(const std::vector<Stmt *> &body, bool function);
+    void compile_statements(const std::vector<Stmt *> &body);
+    size_t compile_condition(Expr *condition);
+    void compile_if_stmt(IfStmt *stmt);
+    void compile_while_stmt(WhileStmt *stmt);
+    void compile_for_stmt(ForStmt *stmt);
+    void compile_var_declaration(VarDeclaration *declaration);
+    void compile_function_declaration(FunctionDeclaration *declaration);
+    void compile_assignment(AssignmentExpr *node);
+    void compile_binary_expr(BinaryExpr *binop);
+    void compile_object_expr(ObjectLiteral *obj);
+    void compile_array_expr(ArrayLiteral *array);
+    void compile_call_expr(CallExpr *expr, bool tail = false);
+    void compile_member_expr(MemberExpr *expr);
+    void compile_member_assignment(MemberExpr *member, Expr *value);
+
+public:
+    std::unique_ptr<FunctionProto> compile(Program *program);
+};
+
+#endif // COMPILER_H
@@ -1,99 +1,299 @@
 #include "Environment.h"
 #include "Values.h"
+#include "Heap.h"
+#include "Native.h"
+#include "Isolate.h"
+#include "ArrayOps.h"
+#include "Parallel.h"
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <chrono>
 #include <ctime>
 #include <sstream>
 #include <iomanip>
 
-RuntimeVal *getCurrentTime(std::vector<RuntimeVal *> args, Environment *scope)
+static void print(NativeArgs args)
+{
+    std::ostream &out = Isolate::output();
+    for (Value arg : args)
+    {
+        out << arg.toString() << " ";
+    }
+    out << "\n";
+}
+
+static std::string currentTime()
 {
     auto now = std::chrono::system_clock::now();
     std::time_t now_c = std::chrono::system_clock::to_time_t(now);
 
+    std::tm local;
+    localtime_r(&now_c, &local);
+
     std::stringstream ss;
-    ss << std::put_time(std::localtime(&now_c), "%Y-%m-%d %H:%M:%S");
-    std::string formatted_time = ss.str();
+    ss << std::put_time(&local, "%Y-%m-%d %H:%M:%S");
+    return ss.str();
+}
+
+static ObjectVal *gcStats()
+{
+    Heap &heap = Heap::current();
+    const GcStats &stats = heap.getStats();
+
+    ObjectVal *object = ObjectVal::create(heap);
+    object->set(intern("minorCollections"), Value::integer(static_cast<int64_t>(stats.minorCollections)));
+    object->set(intern("majorCollections"), Value::integer(static_cast<int64_t>(stats.majorCollections)));
+    object->set(intern("totalPauseMs"), Value::number(stats.totalPauseMs));
+    object->set(intern("maxPauseMs"), Value::number(stats.maxPauseMs));
+    object->set(intern("liveObjects"), Value::integer(static_cast<int64_t>(stats.liveObjects)));
+    object->set(intern("liveBytes"), Value::integer(static_cast<int64_t>(stats.liveBytes)));
+    object->set(intern("bytesAllocated"), Value::integer(static_cast<int64_t>(stats.bytesAllocated)));
 
-    return new StringVal(formatted_time);
+    return object;
 }
 
-Environment createGlobalEnv()
+static double mathSqrt(double x) { return std::sqrt(x); }
+static double mathFloor(double x) { return std::floor(x); }
+static double mathAbs(double x) { return std::fabs(x); }
+static double mathPow(double x, double y) { return std::pow(x, y); }
+
+// The elements of an array as doubles. Packed arrays are read in place;
+// boxed ones are copied, and must hold only numbers.
+class Numbers
 {
-    Environment env = new Environment();
+private:
+    std::vector<double> copy;
 
-    env.declareVar("true", new BooleanVal(true), true);
-    env.declareVar("false", new BooleanVal(false), true);
-    env.declareVar("null", new NullVal(), true);
+public:
+    const double *data;
+    size_t size;
 
-    env.declareVar("print", new NativeFunctionVal([](std::vector<RuntimeVal *> args, Environment *scope) -> RuntimeVal *
-                                                  {
-                                                      for (RuntimeVal *arg : args)
-                                                      {
-                                                          std::cout << arg->toString() << " ";
-                                                      }
-                                                      std::cout << "\n";
-                                                      return new NullVal(); }),
-                   true);
+    explicit Numbers(const ArrayVal *array) : data(array->numbers.data()), size(array->size())
+    {
+        if (array->packed)
+        {
+            return;
+        }
 
-    env.declareVar("time", new NativeFunctionVal(getCurrentTime), true);
+        copy.reserve(size);
+        for (Value value : array->values)
+        {
+            if (!value.isNumber())
+            {
+                throw std::runtime_error("Expected an array of numbers, got one containing " + value.toString());
+            }
+            copy.push_back(value.asNumber());
+        }
+        data = copy.data();
+    }
+};
 
-    return env;
+static void checkSameLength(const Numbers &a, const Numbers &b)
+{
+    if (a.size != b.size)
+    {
+        throw std::runtime_error("Expected arrays of the same length, got " + std::to_string(a.size) + " and " + std::to_string(b.size));
+    }
 }
 
-Environment::Environment(Environment *parentENV) : parent(parentENV)
+// min and max take either two numbers or one array, which must not be empty.
+template <double (*Pair)(double, double), double (*ArrayKernels::*Reduce)(const double *, size_t)>
+static Value minMax(Value first, Value second)
 {
-    global = parentENV ? true : false;
+    if (first.type() == ValueType::Array)
+    {
+        Numbers values(first.as<ArrayVal>());
+        return values.size ? Value::number((arrayKernels().*Reduce)(values.data, values.size)) : Value::null();
+    }
+    if (!first.isNumber())
+    {
+        throwArgumentError("a number or an array", 0);
+    }
+    if (!second.isNumber())
+    {
+        throwArgumentError("a number", 1);
+    }
+    return Value::number(Pair(first.asNumber(), second.asNumber()));
 }
 
-RuntimeVal *Environment::declareVar(const std::string &varname, RuntimeVal *value, bool constant)
+static double mathMin(double x, double y) { return std::min(x, y); }
+static double mathMax(double x, double y) { return std::max(x, y); }
+
+static int64_t arrayLength(ArrayVal *array) { return static_cast<int64_t>(array->size()); }
+
+static ArrayVal *arrayFill(int64_t count, Value value)
 {
-    if (variables.find(varname) != variables.end())
+    if (count < 0 || count > UINT32_MAX)
     {
-        throw std::runtime_error("Variable already declared");
+        throw std::runtime_error("Array length out of range: " + std::to_string(count));
     }
 
-    variables[varname] = value;
-
-    if (constant)
+    Heap &heap = Heap::current();
+    size_t length = static_cast<size_t>(count);
+    if (value.isNumber())
     {
-        constants.insert(varname);
+        ArrayVal *array = ArrayVal::create(heap, length);
+        std::fill(array->numbers.begin(), array->numbers.end(), value.asNumber());
+        return array;
     }
 
-    return value;
+    std::vector<Value> values(length, value);
+    return ArrayVal::create(heap, values.data(), length);
+}
+
+static double arraySum(ArrayVal *array)
+{
+    Numbers values(array);
+    return arrayKernels().sum(values.data, values.size);
+}
+
+static double arrayDot(ArrayVal *a, ArrayVal *b)
+{
+    Numbers x(a), y(b);
+    checkSameLength(x, y);
+    return arrayKernels().dot(x.data, y.data, x.size);
+}
+
+static ArrayVal *arrayScale(ArrayVal *array, double factor)
+{
+    Numbers values(array);
+    ArrayVal *result = ArrayVal::create(Heap::current(), values.size);
+    arrayKernels().scale(result->numbers.data(), values.data, factor, values.size);
+    return result;
+}
+
+template <void (*ArrayKernels::*Combine)(double *, const double *, const double *, size_t)>
+static ArrayVal *arrayElementwise(ArrayVal *a, ArrayVal *b)
+{
+    Numbers x(a), y(b);
+    checkSameLength(x, y);
+    ArrayVal *result = ArrayVal::create(Heap::current(), x.size);
+    (arrayKernels().*Combine)(result->numbers.data(), x.data, y.data, x.size);
+    return result;
+}
+
+static ArrayVal *arrayPrefixSum(ArrayVal *array)
+{
+    Numbers values(array);
+    ArrayVal *result = ArrayVal::create(Heap::current(), values.size);
+    arrayKernels().prefixSum(result->numbers.data(), values.data, values.size);
+    return result;
 }
 
-RuntimeVal *Environment::assignVar(const std::string &varname, RuntimeVal *value)
+Environment *createGlobalEnv()
 {
-    Environment *env = resolve(varname);
+    Heap &heap = Heap::current();
+    Environment *env = heap.allocate<Environment>();
+    heap.addRoot(env);
+
+    env->declareVar(intern("true"), Value::boolean(true), true);
+    env->declareVar(intern("false"), Value::boolean(false), true);
+    env->declareVar(intern("null"), Value::null(), true);
+
+    env->declareVar(intern("print"), makeNative(native<print>(), false), true);
+    env->declareVar(intern("time"), makeNative(native<currentTime>()), true);
+    env->declareVar(intern("gcStats"), makeNative(native<gcStats>()), true);
+
+    env->declareVar(intern("sqrt"), makeNative(native<mathSqrt>()), true);
+    env->declareVar(intern("floor"), makeNative(native<mathFloor>()), true);
+    env->declareVar(intern("abs"), makeNative(native<mathAbs>()), true);
+    env->declareVar(intern("pow"), makeNative(native<mathPow>()), true);
+    env->declareVar(intern("min"), makeNative(native<minMax<mathMin, &ArrayKernels::min>>()), true);
+    env->declareVar(intern("max"), makeNative(native<minMax<mathMax, &ArrayKernels::max>>()), true);
 
-    if (env->constants.find(varname) != env->constants.end())
+    env->declareVar(intern("len"), makeNative(native<arrayLength>()), true);
+    env->declareVar(intern("fill"), makeNative(native<arrayFill>()), true);
+    env->declareVar(intern("sum"), makeNative(native<arraySum>()), true);
+    env->declareVar(intern("dot"), makeNative(native<arrayDot>()), true);
+    env->declareVar(intern("scaleArray"), makeNative(native<arrayScale>()), true);
+    env->declareVar(intern("addArrays"), makeNative(native<arrayElementwise<&ArrayKernels::add>>()), true);
+    env->declareVar(intern("mulArrays"), makeNative(native<arrayElementwise<&ArrayKernels::mul>>()), true);
+    env->declareVar(intern("prefixSum"), makeNative(native<arrayPrefixSum>()), true);
+
+    env->declareVar(intern("parallelMap"), makeNative(native<parallelMap>()), true);
+    env->declareVar(intern("parallelReduce"), makeNative(parallelReduce), true);
+    env->declareVar(intern("parallelFor"), makeNative(native<parallelFor>()), true);
+
+    return env;
+}
+
+Environment::Environment(Environment *parentENV, size_t slotCount) : parent(parentENV), slots(slotCount)
+{
+}
+
+Value Environment::declareVar(Symbol varname, Value value, bool constant)
+{
+    return set(reserveVar(varname, constant), value);
+}
+
+int Environment::reserveVar(Symbol varname, bool constant)
+{
+    if (names.find(varname) != names.end())
+    {
+        throw std::runtime_error("Variable already declared");
+    }
+
+    int slot = static_cast<int>(slots.size());
+    slots.push_back(Value::null());
+    names[varname] = slot;
+
+    if (constant)
     {
-        throw std::runtime_error("Cannot assign to constant");
+        constants.insert(varname);
     }
 
-    env->variables[varname] = value;
+    return slot;
+}
 
-    return value;
+int Environment::findVar(Symbol varname) const
+{
+    auto it = names.find(varname);
+    return it == names.end() ? -1 : it->second;
 }
 
-RuntimeVal *Environment::lookupVar(std::string varname)
+bool Environment::isConstant(Symbol varname) const
 {
-    Environment *env = resolve(varname);
-    return env->variables[varname];
+    return constants.find(varname) != constants.end();
 }
 
-Environment *Environment::resolve(const std::string &varname)
+std::vector<Symbol> Environment::namesFrom(size_t first) const
 {
-    if (variables.find(varname) != variables.end())
+    std::vector<Symbol> result(slots.size() > first ? slots.size() - first : 0);
+    for (const auto &entry : names)
     {
-        return this;
+        if (static_cast<size_t>(entry.second) >= first)
+        {
+            result[entry.second - first] = entry.first;
+        }
     }
+    return result;
+}
 
-    if (parent == nullptr)
+// Drops named slots reserved at or after slotCount, used to roll back a
+// failed resolution so its declarations do not linger.
+void Environment::truncate(size_t slotCount)
+{
+    for (auto it = names.begin(); it != names.end();)
     {
-        std::cerr << "Variable not found: " << varname << "\n";
+        if (static_cast<size_t>(it->second) >= slotCount)
+        {
+            constants.erase(it->first);
+            it = names.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
     }
+    slots.resize(slotCount);
+}
 
-    return parent->resolve(varname);
+void Environment::trace(Heap &heap)
+{
+    heap.mark(parent);
+    for (Value value : slots)
+    {
+        heap.mark(value);
+    }
 }
@@ -4,27 +4,61 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <string>
+#include <vector>
 #include <stdexcept>
 
-struct RuntimeVal;
+#include "Values.h"
+#include "Heap.h"
 
-class Environment
+// Variables live in a flat slot array; the Resolver maps every identifier
+// to a (depth, slot) pair ahead of time, so lookups never hash names. Only
+// the global environment also keeps a name table, used by the Resolver and
+// by host code declaring builtins.
+class Environment : public GcObject
 {
 private:
     Environment *parent;
-    bool global;
-    std::unordered_map<std::string, RuntimeVal *> variables;
-    std::unordered_set<std::string> constants;
+    std::vector<Value> slots;
+    std::unordered_map<Symbol, int> names;
+    std::unordered_set<Symbol> constants;
 
 public:
-    Environment(Environment *parentENV = nullptr);
+    Environment(Environment *parentENV = nullptr, size_t slotCount = 0);
 
-    RuntimeVal *declareVar(const std::string &name, RuntimeVal *value, bool constant);
-    RuntimeVal *lookupVar(std::string varname);
-    RuntimeVal *assignVar(const std::string &varname, RuntimeVal *value);
-    Environment *resolve(const std::string &varname);
+    Value declareVar(Symbol name, Value value, bool constant);
+    int reserveVar(Symbol name, bool constant);
+    int findVar(Symbol name) const;
+    bool isConstant(Symbol name) const;
+    // Names of the named slots from first on, in slot order.
+    std::vector<Symbol> namesFrom(size_t first) const;
+    void truncate(size_t slotCount);
+    size_t size() const { return slots.size(); }
+
+    Environment *ancestor(int depth)
+    {
+        Environment *env = this;
+        while (depth-- > 0)
+        {
+            env = env->parent;
+        }
+        return env;
+    }
+
+    Value get(int slot) const { return slots[slot]; }
+
+    Value set(int slot, Value value)
+    {
+        slots[slot] = value;
+        Heap::current().writeBarrier(this, value);
+        return value;
+    }
+
+    Value lookup(int depth, int slot) { return ancestor(depth)->get(slot); }
+    Value assign(int depth, int slot, Value value) { return ancestor(depth)->set(slot, value); }
+
+    void trace(Heap &heap) override;
 };
 
-Environment createGlobalEnv();
+Environment *createGlobalEnv();
 
 #endif
@@ -0,0 +1,252 @@
+#include "Heap.h"
+#include "Environment.h"
+
+#include <chrono>
+#include <algorithm>
+
+static thread_local Heap *active = nullptr;
+
+Heap &Heap::current()
+{
+    if (!active)
+    {
+        static Heap heap;
+        active = &heap;
+    }
+    return *active;
+}
+
+Heap *Heap::makeCurrent(Heap *heap)
+{
+    Heap *previous = active;
+    active = heap;
+    return previous;
+}
+
+Heap::~Heap()
+{
+    for (GcObject *list : {nursery, tenured})
+    {
+        while (list)
+        {
+            GcObject *next = list->next;
+            delete list;
+            list = next;
+        }
+    }
+}
+
+const char *heapKindName(size_t kind)
+{
+    static const char *const names[HeapKinds] = {nullptr, nullptr, nullptr, "Object", "NativeFn", "Function", "String", "Array", "Environment"};
+    return kind < HeapKinds ? names[kind] : nullptr;
+}
+
+void Heap::removeRootSource(RootSource *source)
+{
+    rootSources.erase(std::remove(rootSources.begin(), rootSources.end(), source), rootSources.end());
+}
+
+void Heap::track(GcObject *object, size_t size, uint8_t kind)
+{
+    object->size = static_cast<uint32_t>(size);
+    object->kind = kind;
+    object->next = nursery;
+    nursery = object;
+    nurseryBytes += size;
+    stats.bytesAllocated += size;
+
+    KindStats &counts = stats.kinds[kind];
+    counts.allocations++;
+    counts.bytesAllocated += size;
+    counts.liveObjects++;
+    counts.liveBytes += size;
+}
+
+void Heap::release(GcObject *object)
+{
+    KindStats &counts = stats.kinds[object->kind];
+    counts.liveObjects--;
+    counts.liveBytes -= object->size;
+    delete object;
+}
+
+void Heap::markRoots()
+{
+    for (GcObject *root : globalRoots)
+    {
+        mark(root);
+    }
+    for (GcObject *root : objectRoots)
+    {
+        mark(root);
+    }
+    for (Value root : valueRoots)
+    {
+        mark(root);
+    }
+    for (RootSource *source : rootSources)
+    {
+        source->traceRoots(*this);
+    }
+
+    // Old objects written with young values since the last collection act
+    // as extra roots for a minor collection.
+    if (minor)
+    {
+        for (GcObject *object : remembered)
+        {
+            object->trace(*this);
+        }
+    }
+}
+
+void Heap::drain()
+{
+    while (!gray.empty())
+    {
+        GcObject *object = gray.back();
+        gray.pop_back();
+        object->trace(*this);
+    }
+}
+
+void Heap::sweepNursery()
+{
+    if (scratch)
+    {
+        GcObject **link = &nursery;
+        nurseryBytes = 0;
+        while (GcObject *object = *link)
+        {
+            if (object->marked)
+            {
+                object->marked = false;
+                nurseryBytes += object->size;
+                link = &object->next;
+            }
+            else
+            {
+                *link = object->next;
+                release(object);
+            }
+        }
+        nurseryLimit = std::max<size_t>(1 << 20, nurseryBytes * 2);
+        return;
+    }
+
+    GcObject *object = nursery;
+    while (object)
+    {
+        GcObject *next = object->next;
+        if (object->marked)
+        {
+            object->marked = false;
+            object->old = true;
+            object->next = tenured;
+            tenured = object;
+            tenuredBytes += object->size;
+        }
+        else
+        {
+            release(object);
+        }
+        object = next;
+    }
+    nursery = nullptr;
+    nurseryBytes = 0;
+}
+
+void Heap::sweepTenured()
+{
+    GcObject **link = &tenured;
+    tenuredBytes = 0;
+    while (GcObject *object = *link)
+    {
+        if (object->marked)
+        {
+            object->marked = false;
+            tenuredBytes += object->size;
+            link = &object->next;
+        }
+        else
+        {
+            *link = object->next;
+            release(object);
+        }
+    }
+}
+
+void Heap::collect(bool major)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    minor = !major;
+    markRoots();
+    drain();
+
+    // Every surviving young object is promoted, so no old-to-young edges
+    // remain afterwards. Clear the set before sweeping may free its entries.
+    for (GcObject *object : remembered)
+    {
+        object->remembered = false;
+    }
+    remembered.clear();
+
+    // The old generation is swept before the nursery so that freshly
+    // promoted survivors are not visited twice.
+    if (major)
+    {
+        sweepTenured();
+    }
+    sweepNursery();
+    minor = false;
+
+    if (major)
+    {
+        stats.majorCollections++;
+        tenuredLimit = std::max<size_t>(8 << 20, tenuredBytes * 2);
+    }
+    else
+    {
+        stats.minorCollections++;
+    }
+
+    double pause = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    stats.totalPauseMs += pause;
+    stats.maxPauseMs = std::max(stats.maxPauseMs, pause);
+
+    if (!major && tenuredBytes >= tenuredLimit)
+    {
+        collect(true);
+    }
+}
+
+void Heap::chargeBorrowed(Heap &worker)
+{
+    for (const Resize &resize : worker.borrowed)
+    {
+        resized(resize.object, resize.before, resize.after);
+    }
+    worker.borrowed.clear();
+}
+
+void Heap::reachSafePoint()
+{
+    safePointRequested.store(false, std::memory_order_relaxed);
+    if (onSafePoint)
+    {
+        onSafePoint();
+    }
+}
+
+const GcStats &Heap::getStats()
+{
+    stats.liveObjects = 0;
+    for (const KindStats &kind : stats.kinds)
+    {
+        stats.liveObjects += kind.liveObjects;
+    }
+    stats.liveBytes = nurseryBytes + tenuredBytes;
+    return stats;
+}
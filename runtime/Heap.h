@@ -0,0 +1,269 @@
+#ifndef HEAP_H
+#define HEAP_H
+
+#include "Values.h"
+#include "Shape.h"
+
+#include <vector>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <utility>
+#include <new>
+
+// Allocations are counted per kind of object: a heap value's ValueType, or
+// EnvironmentKind for environments.
+constexpr size_t EnvironmentKind = static_cast<size_t>(ValueType::Array) + 1;
+constexpr size_t HeapKinds = EnvironmentKind + 1;
+
+inline uint8_t heapKind(const RuntimeVal *value) { return static_cast<uint8_t>(value->type); }
+inline uint8_t heapKind(const GcObject *) { return EnvironmentKind; }
+
+// Null for the kinds that never reach the heap.
+const char *heapKindName(size_t kind);
+
+struct KindStats
+{
+    size_t allocations = 0;
+    size_t bytesAllocated = 0;
+    size_t liveObjects = 0;
+    size_t liveBytes = 0;
+};
+
+struct GcStats
+{
+    size_t minorCollections = 0;
+    size_t majorCollections = 0;
+    double totalPauseMs = 0;
+    double maxPauseMs = 0;
+    size_t liveObjects = 0;
+    size_t liveBytes = 0;
+    size_t bytesAllocated = 0;
+    KindStats kinds[HeapKinds];
+};
+
+// Anything that holds values outside the heap graph for longer than a
+// RootScope, such as the VM's value stack and call frames.
+class RootSource
+{
+public:
+    virtual ~RootSource() = default;
+    virtual void traceRoots(Heap &heap) = 0;
+};
+
+// Precise, non-moving, generational mark-sweep collector for RuntimeVals
+// and Environments. New objects go to the nursery; a minor collection
+// traces from the roots and the remembered set, frees dead nursery
+// objects and promotes the survivors. A major collection traces the whole
+// graph once the old generation has grown past its threshold.
+class Heap
+{
+private:
+    GcObject *nursery = nullptr;
+    GcObject *tenured = nullptr;
+
+    size_t nurseryBytes = 0;
+    size_t tenuredBytes = 0;
+    size_t nurseryLimit = 1 << 20;
+    size_t tenuredLimit = 8 << 20;
+
+    std::vector<GcObject *> globalRoots;
+    std::vector<RootSource *> rootSources;
+    std::vector<GcObject *> remembered;
+    std::vector<GcObject *> gray;
+    bool minor = false;
+
+    GcStats stats;
+    Shape rootShape;
+
+    std::atomic<bool> safePointRequested{false};
+
+    struct Resize
+    {
+        GcObject *object;
+        size_t before;
+        size_t after;
+    };
+    std::vector<Resize> borrowed; // of a scratch heap
+
+    void track(GcObject *object, size_t size, uint8_t kind);
+    void release(GcObject *object);
+    void markRoots();
+    void drain();
+    void sweepNursery();
+    void sweepTenured();
+    void reachSafePoint();
+
+public:
+    // Run on the heap's own thread at the first safe point after another
+    // thread calls requestSafePoint(): an allocation, a call, or a loop
+    // going round in either interpreter. Nothing is midway through an
+    // update there, so it may read the heap's and the run's counters.
+    std::function<void()> onSafePoint;
+
+    // Set on the heaps of parallel workers (see Parallel.h), which borrow
+    // the objects of the heap that started them. The owner collects before
+    // it does, so all of those are old, and a scratch heap never marks or
+    // promotes one of its own: each collection is a full one of its own
+    // objects alone. Old objects it grows, such as ropes it flattens, are
+    // only recorded, for the owner to charge with chargeBorrowed once the
+    // workers are done.
+    bool scratch = false;
+
+    // Temporaries the evaluator holds in C++ locals across an allocation.
+    std::vector<Value> valueRoots;
+    std::vector<GcObject *> objectRoots;
+
+    Heap() = default;
+    Heap(const Heap &) = delete;
+    Heap &operator=(const Heap &) = delete;
+    ~Heap();
+
+    // The heap new objects on this thread go to. Threads that have not made
+    // another heap current share the process-wide default one, so any
+    // thread but the main one should run inside an Isolate.
+    static Heap &current();
+    // Returns the heap it replaces, to be made current again afterwards.
+    static Heap *makeCurrent(Heap *heap);
+
+    void requestSafePoint() { safePointRequested.store(true, std::memory_order_relaxed); }
+
+    void poll()
+    {
+        if (safePointRequested.load(std::memory_order_relaxed))
+        {
+            reachSafePoint();
+        }
+    }
+
+    template <typename T, typename... Args>
+    T *allocate(Args &&...args)
+    {
+        if (nurseryBytes >= nurseryLimit)
+        {
+            collect(false);
+        }
+        poll();
+
+        T *object = new T(std::forward<Args>(args)...);
+        track(object, sizeof(T), heapKind(object));
+        return object;
+    }
+
+    // Allocates T followed by `extra` bytes of trailing storage. T must
+    // provide an unsized class operator delete.
+    template <typename T, typename... Args>
+    T *allocateWithTrailing(size_t extra, Args &&...args)
+    {
+        if (nurseryBytes >= nurseryLimit)
+        {
+            collect(false);
+        }
+        poll();
+
+        void *memory = ::operator new(sizeof(T) + extra);
+        T *object = new (memory) T(std::forward<Args>(args)...);
+        track(object, sizeof(T) + extra, heapKind(object));
+        return object;
+    }
+
+    // Charges memory an object owns outside its own allocation, such as an
+    // array's elements, when it grows or shrinks from `before` bytes.
+    void resized(GcObject *object, size_t before, size_t after)
+    {
+        if (scratch && object->old)
+        {
+            borrowed.push_back({object, before, after});
+            return;
+        }
+        object->size = static_cast<uint32_t>(object->size - before + after);
+        (object->old ? tenuredBytes : nurseryBytes) += after - before;
+        KindStats &kind = stats.kinds[object->kind];
+        kind.liveBytes += after - before;
+        if (after > before)
+        {
+            stats.bytesAllocated += after - before;
+            kind.bytesAllocated += after - before;
+        }
+    }
+
+    Shape *emptyShape() { return &rootShape; }
+
+    void addRoot(GcObject *object) { globalRoots.push_back(object); }
+    void addRootSource(RootSource *source) { rootSources.push_back(source); }
+    void removeRootSource(RootSource *source);
+
+    void writeBarrier(GcObject *owner, Value value)
+    {
+        if (owner->old && !owner->remembered && value.isHeap() && !value.asHeap()->old)
+        {
+            owner->remembered = true;
+            remembered.push_back(owner);
+        }
+    }
+
+    void mark(GcObject *object)
+    {
+        if (!object || object->marked || (minor && object->old))
+        {
+            return;
+        }
+        object->marked = true;
+        gray.push_back(object);
+    }
+
+    void mark(Value value)
+    {
+        if (value.isHeap())
+        {
+            mark(value.asHeap());
+        }
+    }
+
+    // Charges what a scratch heap recorded of this heap's objects.
+    void chargeBorrowed(Heap &worker);
+
+    void collect(bool major);
+    const GcStats &getStats();
+};
+
+// Keeps evaluator temporaries reachable until the enclosing C++ scope exits,
+// including when it exits by exception.
+class RootScope
+{
+private:
+    Heap &heap;
+    size_t values;
+    size_t objects;
+
+public:
+    RootScope(Heap &heap = Heap::current())
+        : heap(heap), values(heap.valueRoots.size()), objects(heap.objectRoots.size()) {}
+
+    ~RootScope()
+    {
+        reset();
+    }
+
+    // Drops everything pushed since the scope was opened.
+    void reset()
+    {
+        heap.valueRoots.resize(values);
+        heap.objectRoots.resize(objects);
+    }
+
+    Value push(Value value)
+    {
+        heap.valueRoots.push_back(value);
+        return value;
+    }
+
+    template <typename T>
+    T *push(T *object)
+    {
+        heap.objectRoots.push_back(object);
+        return object;
+    }
+};
+
+#endif // HEAP_H
@@ -1,199 +1,581 @@
 #include "../frontend/Parser.h"
 
 #include "Interpreter.h"
+#include "Heap.h"
+#include "Profiler.h"
+#include "Stats.h"
+#include "VM.h"
+
+#include <pthread.h>
 
 #include <iostream>
 #include <algorithm>
+#include <charconv>
+#include <cmath>
 
-bool isTruthy(RuntimeVal *val)
+bool isTruthy(Value val)
 {
-    if (val->type == ValueType::Boolean)
+    switch (val.type())
     {
-        return static_cast<BooleanVal *>(val)->value;
+    case ValueType::Boolean:
+        return val.asBoolean();
+    case ValueType::Null:
+        return false;
+    case ValueType::Number:
+        return val.asNumber() != 0;
+    case ValueType::String:
+        return val.as<StringVal>()->length != 0;
+    case ValueType::Object:
+    case ValueType::Array:
+    case ValueType::NativeFn:
+    case ValueType::Function:
+        return true;
     }
-    else if (val->type == ValueType::Null)
+
+    return false;
+}
+
+Value eval_program(Program *program, Environment *env)
+{
+    Value lastEvaluated = Value::null();
+
+    for (Stmt *statement : program->body)
     {
-        return false;
+        lastEvaluated = evaluate(statement, env);
     }
-    else if (val->type == ValueType::Number)
+    return lastEvaluated;
+}
+
+static StringVal *to_string_val(Heap &heap, Value value)
+{
+    return value.type() == ValueType::String ? value.as<StringVal>() : StringVal::create(heap, value.toString());
+}
+
+Value concat_values(Value lhs, Value rhs)
+{
+    Heap &heap = Heap::current();
+    RootScope roots(heap);
+    roots.push(lhs);
+    roots.push(rhs);
+
+    StringVal *left = roots.push(to_string_val(heap, lhs));
+    StringVal *right = roots.push(to_string_val(heap, rhs));
+    return Value::object(StringVal::concat(heap, left, right));
+}
+
+Value eval_binary_expr(BinaryExpr *binop, Environment *env)
+{
+    RootScope roots;
+    Value lhs = roots.push(evaluate(binop->left, env));
+    Value rhs = evaluate(binop->right, env);
+
+    if (isComparison(binop->op))
     {
-        return static_cast<NumberVal *>(val)->value != 0;
+        return Value::boolean(eval_comparison(lhs, rhs, binop->op));
     }
-    else if (val->type == ValueType::String)
+    return eval_numeric_binary_expr(lhs, rhs, binop->op);
+}
+
+// A comparison decides the branch directly, without making a boolean for
+// isTruthy to take apart again.
+bool eval_condition(Expr *condition, Environment *env)
+{
+    if (condition->kind == NodeType::BinaryExpr && isComparison(static_cast<BinaryExpr *>(condition)->op))
     {
-        return !static_cast<StringVal *>(val)->value.empty();
+        BinaryExpr *comparison = static_cast<BinaryExpr *>(condition);
+        RootScope roots;
+        Value lhs = roots.push(evaluate(comparison->left, env));
+        Value rhs = evaluate(comparison->right, env);
+        return eval_comparison(lhs, rhs, comparison->op);
     }
-    else if (val->type == ValueType::Object)
+
+    return isTruthy(evaluate(condition, env));
+}
+
+// An if gives the value of the branch it took, or null. Loops give null.
+// Names declared in a loop body are slots of the enclosing function, so an
+// iteration allocates nothing.
+Value eval_if_stmt(IfStmt *stmt, Environment *env)
+{
+    Stmt *branch = eval_condition(stmt->condition, env) ? stmt->thenBranch : stmt->elseBranch;
+    return branch ? evaluate(branch, env) : Value::null();
+}
+
+Value eval_while_stmt(WhileStmt *stmt, Environment *env)
+{
+    Heap &heap = Heap::current();
+    while (eval_condition(stmt->condition, env))
     {
-        return true;
+        heap.poll();
+        evaluate(stmt->body, env);
     }
-    else if (val->type == ValueType::NativeFn)
+    return Value::null();
+}
+
+Value eval_for_stmt(ForStmt *stmt, Environment *env)
+{
+    if (stmt->init)
     {
-        return true;
+        evaluate(stmt->init, env);
     }
-    else if (val->type == ValueType::Function)
+    Heap &heap = Heap::current();
+    while (!stmt->condition || eval_condition(stmt->condition, env))
     {
-        return true;
+        heap.poll();
+        evaluate(stmt->body, env);
+        if (stmt->increment)
+        {
+            evaluate(stmt->increment, env);
+        }
     }
-
-    return false;
+    return Value::null();
 }
 
-RuntimeVal *eval_program(Program *program, Environment *env)
+Value eval_block_stmt(BlockStmt *block, Environment *env)
 {
-    RuntimeVal *lastEvaluated = new NullVal();
+    Value lastEvaluated = Value::null();
 
-    for (Stmt *statement : program->body)
+    for (Stmt *statement : block->body)
     {
         lastEvaluated = evaluate(statement, env);
     }
     return lastEvaluated;
 }
 
-RuntimeVal *eval_binary_expr(BinaryExpr *binop, Environment *env)
+Value eval_identifier(Identifier *ident, Environment *env)
+{
+    Value val = env->lookup(ident->depth, ident->slot);
+    return val;
+}
+
+// Equal numbers name the same property, however they are stored, and
+// unequal ones never do: integral numbers are keyed by the digits they
+// print as, and anything else by the shortest text that reads back as
+// the same double.
+static std::string number_key(double number)
+{
+    std::string digits = Value::number(number == 0 ? 0 : number).toString();
+    if (digits.find_first_not_of("-0123456789") == std::string::npos)
+    {
+        return digits;
+    }
+
+    char buffer[32];
+    char *end = std::to_chars(buffer, buffer + sizeof(buffer), number).ptr;
+    return std::string(buffer, end);
+}
+
+Symbol to_property_key(Value key, bool intern)
 {
-    RuntimeVal *lhs = evaluate(binop->left, env);
-    RuntimeVal *rhs = evaluate(binop->right, env);
+    if (key.type() != ValueType::String && key.type() != ValueType::Number)
+    {
+        throw std::runtime_error("Property key must be a string or number");
+    }
 
-    if (lhs->type == ValueType::Number && rhs->type == ValueType::Number)
+    SymbolTable &symbols = SymbolTable::global();
+    if (key.type() == ValueType::String)
     {
-        return eval_numeric_binary_expr(
-            (NumberVal *)lhs,
-            (NumberVal *)rhs,
-            binop->op);
+        std::string_view name = key.as<StringVal>()->view();
+        return intern ? symbols.intern(name) : symbols.find(name);
     }
 
-    return new NullVal();
+    std::string name = number_key(key.asNumber());
+    return intern ? symbols.intern(name) : symbols.find(name);
 }
 
-NumberVal *eval_numeric_binary_expr(
-    NumberVal *lhs,
-    NumberVal *rhs,
-    const std::string &op)
+ObjectVal *to_object(Value value, Symbol key)
 {
-    double result = 0;
-    if (op == "+")
-        result = lhs->value + rhs->value;
-    else if (op == "-")
-        result = lhs->value - rhs->value;
-    else if (op == "*")
-        result = lhs->value * rhs->value;
-    else if (op == "/")
-        result = lhs->value / rhs->value;
-    else
-        result = static_cast<int>(lhs->value) % static_cast<int>(rhs->value);
+    if (value.type() != ValueType::Object)
+    {
+        throw std::runtime_error("Cannot access property '" + key.str() + "' of " + value.toString());
+    }
 
-    return new NumberVal{result};
+    return value.as<ObjectVal>();
 }
 
-RuntimeVal *eval_identifier(Identifier *ident, Environment *env)
+// Reads past the end of an array give null, like a missing property.
+static size_t to_array_index(Value key)
 {
-    RuntimeVal *val = env->lookupVar(ident->symbol);
-    return val;
+    if (key.isInt() && key.asInt() >= 0)
+    {
+        return static_cast<size_t>(key.asInt());
+    }
+
+    double index = key.isNumber() ? key.asNumber() : -1;
+    if (!(index >= 0) || index != std::floor(index))
+    {
+        throw std::runtime_error("Array index must be a non-negative integer, got " + key.toString());
+    }
+
+    return index < 9007199254740992.0 ? static_cast<size_t>(index) : SIZE_MAX;
+}
+
+Value get_index(Value object, Value key)
+{
+    if (object.type() == ValueType::Array)
+    {
+        return object.as<ArrayVal>()->get(to_array_index(key));
+    }
+
+    // Reads never intern: symbols are kept for good, and a name that has
+    // none is on no object.
+    Symbol symbol = to_property_key(key, false);
+    if (!symbol.valid())
+    {
+        if (object.type() != ValueType::Object)
+        {
+            throw std::runtime_error("Cannot access property '" + key.toString() + "' of " + object.toString());
+        }
+        return Value::null();
+    }
+    return to_object(object, symbol)->get(symbol);
+}
+
+// Arrays grow by one element at a time: writing at the length appends.
+void set_index(Value object, Value key, Value value)
+{
+    if (object.type() == ValueType::Array)
+    {
+        ArrayVal *array = object.as<ArrayVal>();
+        size_t index = to_array_index(key);
+        if (index > array->size())
+        {
+            throw std::runtime_error("Array index " + key.toString() + " is past the end of an array of length " + std::to_string(array->size()));
+        }
+        array->set(index, value);
+        return;
+    }
+
+    Symbol symbol = to_property_key(key);
+    to_object(object, symbol)->set(symbol, value);
+}
+
+Value eval_member_expr(MemberExpr *expr, Environment *env)
+{
+    RootScope roots;
+    Value object = roots.push(evaluate(expr->object, env));
+    if (expr->computed)
+    {
+        return get_index(object, evaluate(expr->property, env));
+    }
+
+    Symbol key = static_cast<Identifier *>(expr->property)->symbol;
+    return to_object(object, key)->get(key);
 }
 
-RuntimeVal *eval_assignment(AssignmentExpr *node, Environment *env)
+Value eval_assignment(AssignmentExpr *node, Environment *env)
 {
+    if (node->assignee->kind == NodeType::MemberExpr)
+    {
+        MemberExpr *member = static_cast<MemberExpr *>(node->assignee);
+        RootScope roots;
+        Value object = roots.push(evaluate(member->object, env));
+        Value key = member->computed ? roots.push(evaluate(member->property, env)) : Value::null();
+        Value value = evaluate(node->value, env);
+
+        if (member->computed)
+        {
+            set_index(object, key, value);
+            return value;
+        }
+
+        Symbol symbol = static_cast<Identifier *>(member->property)->symbol;
+        to_object(object, symbol)->set(symbol, value);
+        return value;
+    }
+
     if (node->assignee->kind != NodeType::Identifier)
     {
-        throw std::runtime_error("Left hand side of assignment must be an identifier");
+        throw std::runtime_error("Left hand side of assignment must be an identifier or member");
     }
 
-    std::string varname = static_cast<Identifier *>(node->assignee)->symbol;
-    return env->assignVar(varname, evaluate(node->value, env));
+    Identifier *target = static_cast<Identifier *>(node->assignee);
+    return env->assign(target->depth, target->slot, evaluate(node->value, env));
 }
 
-RuntimeVal *eval_var_declaration(VarDeclaration *declaration, Environment *env)
+Value eval_var_declaration(VarDeclaration *declaration, Environment *env)
 {
-    RuntimeVal *val = declaration->value ? evaluate(declaration->value, env) : new NullVal();
-    return env->declareVar(declaration->identifier, val, declaration->constant);
+    Value val = declaration->value ? evaluate(declaration->value, env) : Value::null();
+    return env->set(declaration->slot, val);
 }
 
-RuntimeVal *eval_object_expr(ObjectLiteral *obj, Environment *env)
+Value eval_object_expr(ObjectLiteral *obj, Environment *env)
 {
-    ObjectVal *object = new ObjectVal();
+    Heap &heap = Heap::current();
+    RootScope roots(heap);
+    ObjectVal *object = roots.push(ObjectVal::create(heap, heap.emptyShape(), obj->properties.size()));
 
     for (auto &prop : obj->properties)
     {
-        RuntimeVal *runtimeVal = prop->value ? evaluate(prop->value, env) : env->lookupVar(prop->key);
+        Value runtimeVal = prop->value ? evaluate(prop->value, env) : env->lookup(prop->depth, prop->slot);
+
+        object->set(prop->key, runtimeVal);
+    }
+
+    return Value::object(object);
+}
 
-        object->properties[prop->key] = runtimeVal;
+Value eval_array_expr(ArrayLiteral *array, Environment *env)
+{
+    Heap &heap = Heap::current();
+    RootScope roots(heap);
+    std::vector<Value> elements;
+    elements.reserve(array->elements.size());
+
+    for (Expr *element : array->elements)
+    {
+        elements.push_back(roots.push(evaluate(element, env)));
     }
 
-    return object;
+    return Value::object(ArrayVal::create(heap, elements.data(), elements.size()));
+}
+
+size_t maxCallDepth = DefaultMaxCallDepth;
+
+static thread_local size_t callDepth = 0;
+static thread_local const char *stackBase = nullptr;
+
+// Each script call takes several C++ frames here, so the native stack can
+// run out before maxCallDepth; stop at three quarters of its size. Worker
+// threads may have smaller stacks than the main one, so each thread looks
+// up its own.
+static size_t nativeStackBudget()
+{
+    static thread_local const size_t budget = []()
+    {
+        size_t size = 8 * 1024 * 1024;
+        pthread_attr_t attributes;
+        if (pthread_getattr_np(pthread_self(), &attributes) == 0)
+        {
+            pthread_attr_getstacksize(&attributes, &size);
+            pthread_attr_destroy(&attributes);
+        }
+        return size / 4 * 3;
+    }();
+    return budget;
 }
 
-RuntimeVal *eval_call_expr(CallExpr *expr, Environment *env)
+// Counts script-level calls on the C++ stack so runaway recursion ends in a
+// catchable error instead of overflowing it. Calls to natives are not
+// counted, just as they take no frame in the VM, so both stop at the same
+// depth.
+struct CallDepthGuard
 {
-    std::vector<RuntimeVal *> args(expr->args.size());
+    bool counted;
 
-    std::transform(expr->args.begin(), expr->args.end(), args.begin(), [env](Expr *arg)
-                   { return evaluate(arg, env); });
+    explicit CallDepthGuard(Value callee) : counted(callee.type() == ValueType::Function)
+    {
+        if (!counted)
+        {
+            return;
+        }
 
-    RuntimeVal *fn = evaluate(expr->caller, env);
+        char marker;
+        if (callDepth == 0)
+        {
+            stackBase = &marker;
+        }
 
-    if (fn->type == ValueType::NativeFn)
+        if (callDepth >= maxCallDepth)
+        {
+            throw std::runtime_error("Maximum call depth exceeded (" + std::to_string(maxCallDepth) + ")");
+        }
+        if (static_cast<size_t>(stackBase - &marker) > nativeStackBudget())
+        {
+            throw std::runtime_error("Maximum call depth exceeded (native stack exhausted at depth " + std::to_string(callDepth) + ")");
+        }
+        callDepth++;
+    }
 
+    ~CallDepthGuard()
     {
-        RuntimeVal *result = (static_cast<NativeFunctionVal *>(fn))->call(args, env);
-        return result;
+        if (counted)
+        {
+            callDepth--;
+        }
     }
+};
+
+static Value eval_arguments(CallExpr *expr, Environment *env, RootScope &roots, std::vector<Value> &args)
+{
+    args.resize(expr->args.size());
+    std::transform(expr->args.begin(), expr->args.end(), args.begin(), [env, &roots](Expr *arg)
+                   { return roots.push(evaluate(arg, env)); });
 
-    if (fn->type == ValueType::Function)
+    return roots.push(evaluate(expr->caller, env));
+}
+
+// Calls fn with args, both already held by roots. A call that is the last
+// statement of a function body is a tail call: rather than recursing, the
+// loop continues with the callee, so tail recursion runs in constant space.
+static Value apply_function(Value fn, std::vector<Value> &args, RootScope &roots, ProfiledCall &profiled)
+{
+    Heap &heap = Heap::current();
+
+    for (;;)
     {
-        FunctionVal *function = static_cast<FunctionVal *>(fn);
-        Environment *scope = new Environment(function->declarationEnv);
+        executionStats.calls++;
+        heap.poll();
+
+        if (fn.type() == ValueType::NativeFn)
+        {
+            return fn.as<NativeFunctionVal>()->call(NativeArgs{args.data(), args.size()});
+        }
+
+        if (fn.type() != ValueType::Function)
+        {
+            throw std::runtime_error("Attempted to call a non-function");
+        }
+
+        FunctionVal *function = fn.as<FunctionVal>();
+        profiled.enter(function);
+        Environment *scope = roots.push(heap.allocate<Environment>(function->declarationEnv, function->localCount));
+
+        for (size_t i = 0; i < function->parameters.size() && i < args.size(); i++)
+        {
+            scope->set(static_cast<int>(i), args[i]);
+        }
+
+        if (function->body.empty())
+        {
+            return Value();
+        }
+
+        for (size_t i = 0; i + 1 < function->body.size(); i++)
+        {
+            evaluate(function->body[i], scope);
+        }
 
-        for (size_t i = 0; i < function->parameters.size(); i++)
+        // An if or block in tail position passes it on to the statement it
+        // ends with.
+        Stmt *last = function->body.back();
+        for (;;)
         {
-            scope->declareVar(function->parameters[i], args[i], false);
+            if (last->kind == NodeType::IfStmt)
+            {
+                IfStmt *branch = static_cast<IfStmt *>(last);
+                last = eval_condition(branch->condition, scope) ? branch->thenBranch : branch->elseBranch;
+            }
+            else if (last->kind == NodeType::BlockStmt)
+            {
+                BlockStmt *block = static_cast<BlockStmt *>(last);
+                for (size_t i = 0; i + 1 < block->body.size(); i++)
+                {
+                    evaluate(block->body[i], scope);
+                }
+                last = block->body.empty() ? nullptr : block->body.back();
+            }
+            else
+            {
+                break;
+            }
+
+            if (!last)
+            {
+                return Value::null();
+            }
         }
 
-        RuntimeVal *result;
+        if (last->kind != NodeType::CallExpr)
+        {
+            return evaluate(last, scope);
+        }
+
+        CallExpr *tail = static_cast<CallExpr *>(last);
+        fn = eval_arguments(tail, scope, roots, args);
 
-        for (Stmt *stmt : function->body)
+        // Only the callee and its arguments are live now.
+        roots.reset();
+        roots.push(fn);
+        for (Value arg : args)
         {
-            result = evaluate(stmt, scope);
+            roots.push(arg);
         }
+    }
+}
 
-        return result;
+Value eval_call_expr(CallExpr *expr, Environment *env)
+{
+    RootScope roots;
+    ProfiledCall profiled;
+    std::vector<Value> args;
+
+    Value fn = eval_arguments(expr, env, roots, args);
+    CallDepthGuard guard(fn);
+    return apply_function(fn, args, roots, profiled);
+}
+
+Value call_value(Value callee, NativeArgs args)
+{
+    if (callee.type() == ValueType::Function && callee.as<FunctionVal>()->proto)
+    {
+        return VM::current()->call(callee, args);
     }
 
-    throw std::runtime_error("Attempted to call a non-function");
+    RootScope roots;
+    CallDepthGuard guard(callee);
+    ProfiledCall profiled;
+    std::vector<Value> values(args.begin(), args.end());
+
+    roots.push(callee);
+    for (Value arg : values)
+    {
+        roots.push(arg);
+    }
+    return apply_function(callee, values, roots, profiled);
 }
 
-RuntimeVal *eval_function_declaration(FunctionDeclaration *declaration, Environment *env)
+Value eval_function_declaration(FunctionDeclaration *declaration, Environment *env)
 {
-    FunctionVal *function = new FunctionVal(declaration->body, declaration->name, declaration->parameters, env);
+    FunctionVal *function = Heap::current().allocate<FunctionVal>(declaration->body, declaration->name, declaration->parameters, env);
+    function->localCount = declaration->localCount;
+    function->line = declaration->line;
 
-    return env->declareVar(declaration->name, function, true);
+    return env->set(declaration->slot, Value::object(function));
 }
 
-RuntimeVal *evaluate(Stmt *astNode, Environment *env)
+Value evaluate(Stmt *astNode, Environment *env)
 {
+    Profiler::poll(astNode);
+    executionStats.nodesEvaluated++;
+
     switch (astNode->kind)
     {
     case NodeType::NumericLiteral:
     {
         NumericLiteral *numLiteral = static_cast<NumericLiteral *>(astNode);
-        return new NumberVal{numLiteral->value};
+        return Value::canonicalNumber(numLiteral->value);
     }
+    case NodeType::StringLiteral:
+        return Value::object(StringVal::literal(Heap::current(), static_cast<StringLiteral *>(astNode)->value));
     case NodeType::Identifier:
         return eval_identifier(static_cast<Identifier *>(astNode), env);
     case NodeType::ObjectLiteral:
         return eval_object_expr(static_cast<ObjectLiteral *>(astNode), env);
+    case NodeType::ArrayLiteral:
+        return eval_array_expr(static_cast<ArrayLiteral *>(astNode), env);
     case NodeType::AssignmentExpr:
         return eval_assignment(static_cast<AssignmentExpr *>(astNode), env);
     case NodeType::BinaryExpr:
         return eval_binary_expr(static_cast<BinaryExpr *>(astNode), env);
     case NodeType::CallExpr:
         return eval_call_expr(static_cast<CallExpr *>(astNode), env);
+    case NodeType::MemberExpr:
+        return eval_member_expr(static_cast<MemberExpr *>(astNode), env);
     case NodeType::Program:
         return eval_program(static_cast<Program *>(astNode), env);
     case NodeType::VarDeclaration:
         return eval_var_declaration(static_cast<VarDeclaration *>(astNode), env);
     case NodeType::FunctionDeclaration:
         return eval_function_declaration(static_cast<FunctionDeclaration *>(astNode), env);
+    case NodeType::IfStmt:
+        return eval_if_stmt(static_cast<IfStmt *>(astNode), env);
+    case NodeType::WhileStmt:
+        return eval_while_stmt(static_cast<WhileStmt *>(astNode), env);
+    case NodeType::ForStmt:
+        return eval_for_stmt(static_cast<ForStmt *>(astNode), env);
+    case NodeType::BlockStmt:
+        return eval_block_stmt(static_cast<BlockStmt *>(astNode), env);
     default:
         std::cerr << "Unknown AST Node\n";
         exit(1);
@@ -5,18 +5,184 @@
 #include "Values.h"
 #include "Environment.h"
 
-RuntimeVal *evaluate(Stmt *astNode, Environment *env);
-RuntimeVal *eval_program(Program *program, Environment *env);
-RuntimeVal *eval_binary_expr(BinaryExpr *binop, Environment *env);
-NumberVal *eval_numeric_binary_expr(NumberVal *lhs, NumberVal *rhs, const std::string &op);
-RuntimeVal *eval_identifier(Identifier *ident, Environment *env);
-RuntimeVal *eval_assignment(AssignmentExpr *node, Environment *env);
-RuntimeVal *eval_object_expr(ObjectLiteral *obj, Environment *env);
-RuntimeVal *eval_call_expr(CallExpr *obj, Environment *env);
-RuntimeVal *eval_var_declaration(VarDeclaration *declaration, Environment *env);
-RuntimeVal *eval_function_declaration(FunctionDeclaration *declaration, Environment *env);
-RuntimeVal *eval_for_stmt(ForStmt *stmt, Environment *env);
-RuntimeVal *eval_while_stmt(WhileStmt *stmt, Environment *env);
-RuntimeVal *eval_if_stmt(IfStmt *stmt, Environment *env);
+#include <cmath>
+
+constexpr size_t DefaultMaxCallDepth = 10000;
+
+// Deepest nesting of script function calls before evaluation fails with an
+// error; shared by the tree-walker and the VM.
+extern size_t maxCallDepth;
+
+// Joins the text of two values into a new string, at least one of them a
+// string already.
+Value concat_values(Value lhs, Value rhs);
+
+// Arithmetic shared by both interpreters and constant folding. Two ints
+// stay ints through +, -, * and %, falling back to doubles when the result
+// no longer fits; / always gives a double, and % of doubles is fmod. + with
+// a string on either side concatenates; anything else but two numbers
+// gives null.
+inline Value eval_numeric_binary_expr(Value lhs, Value rhs, Operator op)
+{
+    if (lhs.isInt() && rhs.isInt())
+    {
+        int64_t a = lhs.asInt();
+        int64_t b = rhs.asInt();
+        int64_t result;
+        switch (op)
+        {
+        case Operator::Add:
+            return Value::integer(a + b);
+        case Operator::Subtract:
+            return Value::integer(a - b);
+        case Operator::Multiply:
+            if (!__builtin_mul_overflow(a, b, &result))
+            {
+                return Value::integer(result);
+            }
+            break;
+        case Operator::Modulo:
+            if (b != 0)
+            {
+                return Value::integer(a % b);
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    else if (!lhs.isNumber() || !rhs.isNumber())
+    {
+        if (op == Operator::Add && (lhs.type() == ValueType::String || rhs.type() == ValueType::String))
+        {
+            return concat_values(lhs, rhs);
+        }
+        return Value::null();
+    }
+
+    double a = lhs.asNumber();
+    double b = rhs.asNumber();
+    switch (op)
+    {
+    case Operator::Add:
+        return Value::number(a + b);
+    case Operator::Subtract:
+        return Value::number(a - b);
+    case Operator::Multiply:
+        return Value::number(a * b);
+    case Operator::Divide:
+        return Value::number(a / b);
+    case Operator::Modulo:
+        return Value::number(std::fmod(a, b));
+    default:
+        return Value::null();
+    }
+}
+
+// Comparisons shared by both interpreters, as a bool so that a branch can
+// use the result directly. Numbers compare by value whichever way they are
+// stored, strings by their text; == and != compare anything else by
+// identity, and ordering anything else is false.
+inline bool eval_comparison(Value lhs, Value rhs, Operator op)
+{
+    if (lhs.isInt() && rhs.isInt())
+    {
+        int64_t a = lhs.asInt();
+        int64_t b = rhs.asInt();
+        switch (op)
+        {
+        case Operator::Less:
+            return a < b;
+        case Operator::LessEqual:
+            return a <= b;
+        case Operator::Greater:
+            return a > b;
+        case Operator::GreaterEqual:
+            return a >= b;
+        case Operator::Equal:
+            return a == b;
+        default:
+            return a != b;
+        }
+    }
+
+    if (lhs.isNumber() && rhs.isNumber())
+    {
+        double a = lhs.asNumber();
+        double b = rhs.asNumber();
+        switch (op)
+        {
+        case Operator::Less:
+            return a < b;
+        case Operator::LessEqual:
+            return a <= b;
+        case Operator::Greater:
+            return a > b;
+        case Operator::GreaterEqual:
+            return a >= b;
+        case Operator::Equal:
+            return a == b;
+        default:
+            return a != b;
+        }
+    }
+
+    if (lhs.type() == ValueType::String && rhs.type() == ValueType::String)
+    {
+        int order = lhs.as<StringVal>()->view().compare(rhs.as<StringVal>()->view());
+        switch (op)
+        {
+        case Operator::Less:
+            return order < 0;
+        case Operator::LessEqual:
+            return order <= 0;
+        case Operator::Greater:
+            return order > 0;
+        case Operator::GreaterEqual:
+            return order >= 0;
+        case Operator::Equal:
+            return order == 0;
+        default:
+            return order != 0;
+        }
+    }
+
+    switch (op)
+    {
+    case Operator::Equal:
+        return lhs == rhs;
+    case Operator::NotEqual:
+        return lhs != rhs;
+    default:
+        return false;
+    }
+}
+
+Value evaluate(Stmt *astNode, Environment *env);
+bool isTruthy(Value val);
+// With intern false, a key no symbol exists for gives an invalid Symbol
+// rather than a new one.
+Symbol to_property_key(Value key, bool intern = true);
+ObjectVal *to_object(Value value, Symbol key);
+Value get_index(Value object, Value key);
+void set_index(Value object, Value key, Value value);
+Value eval_program(Program *program, Environment *env);
+Value eval_binary_expr(BinaryExpr *binop, Environment *env);
+Value eval_identifier(Identifier *ident, Environment *env);
+Value eval_assignment(AssignmentExpr *node, Environment *env);
+Value eval_object_expr(ObjectLiteral *obj, Environment *env);
+Value eval_array_expr(ArrayLiteral *array, Environment *env);
+Value eval_call_expr(CallExpr *obj, Environment *env);
+// Calls a function or native from native code, with whichever interpreter
+// created the function.
+Value call_value(Value callee, NativeArgs args);
+Value eval_member_expr(MemberExpr *expr, Environment *env);
+Value eval_var_declaration(VarDeclaration *declaration, Environment *env);
+Value eval_function_declaration(FunctionDeclaration *declaration, Environment *env);
+bool eval_condition(Expr *condition, Environment *env);
+Value eval_for_stmt(ForStmt *stmt, Environment *env);
+Value eval_while_stmt(WhileStmt *stmt, Environment *env);
+Value eval_if_stmt(IfStmt *stmt, Environment *env);
+Value eval_block_stmt(BlockStmt *block, Environment *env);
 
 #endif // INTERPRETER_H
\ No newline at end of file
@@ -0,0 +1,138 @@
+#include "Isolate.h"
+#include "../frontend/Parser.h"
+#include "Compiler.h"
+#include "Interpreter.h"
+#include "Optimizer.h"
+#include "Resolver.h"
+#include "VM.h"
+
+#include <iostream>
+#include <stdexcept>
+
+static thread_local std::ostream *currentOutput = nullptr;
+
+void SharedProgram::declareGlobals(Environment *env) const
+{
+    if (env->size() != builtinCount)
+    {
+        throw std::runtime_error("A shared program must run in a fresh global environment");
+    }
+
+    for (size_t i = 0; i < globals.size(); i++)
+    {
+        env->reserveVar(globals[i], constants[i]);
+    }
+}
+
+CodeCache::CodeCache(const AstCache *disk) : disk(disk)
+{
+}
+
+std::shared_ptr<const SharedProgram> CodeCache::build(std::string_view source, Environment *globals) const
+{
+    auto shared = std::make_shared<SharedProgram>();
+
+    Program *program = disk ? disk->load(source) : nullptr;
+    if (!program)
+    {
+        Parser parser;
+        program = parser.produceAST(source);
+        if (disk && program->diagnostics.empty())
+        {
+            disk->store(source, program);
+        }
+    }
+    shared->program.reset(program);
+
+    Optimizer optimizer;
+    optimizer.optimize(program);
+
+    // Resolve against the caller's environment, then take the globals back
+    // out so it is left fresh like everyone else's.
+    shared->builtinCount = globals->size();
+    Resolver resolver(globals);
+    resolver.resolve(program);
+
+    shared->globals = globals->namesFrom(shared->builtinCount);
+    for (Symbol name : shared->globals)
+    {
+        shared->constants.push_back(globals->isConstant(name));
+    }
+    globals->truncate(shared->builtinCount);
+
+    return shared;
+}
+
+std::shared_ptr<const SharedProgram> CodeCache::get(std::string_view source, Environment *globals)
+{
+    std::promise<std::shared_ptr<const SharedProgram>> promise;
+    Entry entry;
+    bool building = false;
+
+    {
+        std::string key(source);
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(key);
+        if (it == entries.end())
+        {
+            it = entries.emplace(std::move(key), promise.get_future().share()).first;
+            building = true;
+        }
+        entry = it->second;
+    }
+
+    // Errors are cached too: the same source fails the same way.
+    if (building)
+    {
+        try
+        {
+            promise.set_value(build(source, globals));
+        }
+        catch (...)
+        {
+            promise.set_exception(std::current_exception());
+        }
+    }
+
+    return entry.get();
+}
+
+Isolate::Scope::Scope(Isolate &isolate)
+    : previousHeap(Heap::makeCurrent(&isolate.heap)), previousOutput(currentOutput)
+{
+    currentOutput = &isolate.out;
+}
+
+Isolate::Scope::~Scope()
+{
+    Heap::makeCurrent(previousHeap);
+    currentOutput = previousOutput;
+}
+
+Isolate::Isolate()
+{
+    Scope scope(*this);
+    globals = createGlobalEnv();
+}
+
+Value Isolate::run(const SharedProgram &shared, bool treeWalk)
+{
+    Scope scope(*this);
+    shared.declareGlobals(globals);
+
+    if (treeWalk)
+    {
+        return evaluate(shared.program.get(), globals);
+    }
+
+    Compiler compiler;
+    scripts.push_back(compiler.compile(shared.program.get()));
+
+    VM vm(heap);
+    return vm.run(scripts.back().get(), globals);
+}
+
+std::ostream &Isolate::output()
+{
+    return currentOutput ? *currentOutput : std::cout;
+}
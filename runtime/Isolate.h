@@ -0,0 +1,97 @@
+#ifndef ISOLATE_H
+#define ISOLATE_H
+
+#include "../frontend/Ast.h"
+#include "../frontend/AstCache.h"
+#include "Bytecode.h"
+#include "Environment.h"
+#include "Heap.h"
+
+#include <future>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// A Program that was parsed, optimized and resolved once and is only read
+// from then on, so any number of isolates can run it at the same time. The
+// Resolver placed its globals right after the builtins of a fresh global
+// environment; an isolate reserves the same names in the same order before
+// running it, which makes every resolved slot line up.
+struct SharedProgram
+{
+    std::unique_ptr<Program> program;
+    size_t builtinCount = 0;
+    std::vector<Symbol> globals; // reserved by the Resolver, in slot order
+    std::vector<bool> constants;
+
+    void declareGlobals(Environment *env) const;
+};
+
+// Source text -> SharedProgram, safe to use from any thread. The first
+// isolate to ask for a source builds the program while later ones wait for
+// it, so each distinct source is parsed once per process.
+class CodeCache
+{
+private:
+    using Entry = std::shared_future<std::shared_ptr<const SharedProgram>>;
+
+    std::mutex mutex;
+    std::unordered_map<std::string, Entry> entries;
+    const AstCache *disk;
+
+    std::shared_ptr<const SharedProgram> build(std::string_view source, Environment *globals) const;
+
+public:
+    explicit CodeCache(const AstCache *disk = nullptr);
+
+    // globals must be a fresh global environment; it is only borrowed to
+    // resolve against and is left as it was.
+    std::shared_ptr<const SharedProgram> get(std::string_view source, Environment *globals);
+};
+
+// One independent instance of the runtime with its own heap, global
+// environment and output buffer. An isolate may move between threads but
+// is used by one at a time; while a Scope for it is open, Heap::current()
+// and print on that thread refer to this isolate.
+class Isolate
+{
+private:
+    Heap heap;
+    Environment *globals = nullptr;
+    std::ostringstream out;
+    std::vector<std::unique_ptr<FunctionProto>> scripts; // closures point into these
+
+public:
+    class Scope
+    {
+    private:
+        Heap *previousHeap;
+        std::ostream *previousOutput;
+
+    public:
+        explicit Scope(Isolate &isolate);
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+        ~Scope();
+    };
+
+    Isolate();
+    Isolate(const Isolate &) = delete;
+    Isolate &operator=(const Isolate &) = delete;
+
+    Environment *environment() const { return globals; }
+    std::string printed() const { return out.str(); }
+
+    Value run(const SharedProgram &shared, bool treeWalk = false);
+
+    // Where print writes on this thread: the current isolate's buffer, or
+    // std::cout outside any isolate.
+    static std::ostream &output();
+};
+
+#endif // ISOLATE_H
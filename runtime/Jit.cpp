@@ -0,0 +1,666 @@
+#include "Jit.h"
+#include "Bytecode.h"
+
+#include <cmath>
+#include <cstring>
+#include <initializer_list>
+#include <sys/mman.h>
+#include <unistd.h>
+
+bool jitEnabled = true;
+
+JitCode::JitCode(void *memory, size_t size, std::vector<Exit> exits)
+    : memory(memory), size(size), exits(std::move(exits))
+{
+}
+
+JitCode::~JitCode()
+{
+    munmap(memory, size);
+}
+
+#if defined(__x86_64__)
+
+namespace
+{
+
+enum Register : uint8_t
+{
+    Rax = 0,
+    Rcx = 1,
+    Rdx = 2,
+};
+
+// Second byte of each two-byte jcc.
+enum Condition : uint8_t
+{
+    Overflow = 0x80,
+    Below = 0x82,
+    AboveEqual = 0x83,
+    Equal = 0x84,
+    NotEqual = 0x85,
+    BelowEqual = 0x86,
+    Parity = 0x8a,
+    Less = 0x8c,
+    GreaterEqual = 0x8d,
+    LessEqual = 0x8e,
+    Greater = 0x8f,
+};
+
+// Just the x86-64 the compiler below needs, with 32-bit jumps to labels
+// that are patched once the code is complete. rbx holds the frame base.
+class Assembler
+{
+private:
+    struct Label
+    {
+        size_t position = SIZE_MAX;
+        std::vector<size_t> uses;
+    };
+    std::vector<Label> labels;
+
+    void imm32(uint32_t value)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            code.push_back(static_cast<uint8_t>(value >> (8 * i)));
+        }
+    }
+    void imm64(uint64_t value)
+    {
+        imm32(static_cast<uint32_t>(value));
+        imm32(static_cast<uint32_t>(value >> 32));
+    }
+    void target(size_t label)
+    {
+        labels[label].uses.push_back(code.size());
+        imm32(0);
+    }
+
+public:
+    std::vector<uint8_t> code;
+
+    void bytes(std::initializer_list<uint8_t> list) { code.insert(code.end(), list); }
+
+    size_t label()
+    {
+        labels.emplace_back();
+        return labels.size() - 1;
+    }
+    void bind(size_t label) { labels[label].position = code.size(); }
+
+    void jump(size_t label)
+    {
+        bytes({0xe9});
+        target(label);
+    }
+    void jump(Condition condition, size_t label)
+    {
+        bytes({0x0f, condition});
+        target(label);
+    }
+
+    void finish()
+    {
+        for (const Label &label : labels)
+        {
+            for (size_t use : label.uses)
+            {
+                uint32_t offset = static_cast<uint32_t>(label.position - (use + 4));
+                std::memcpy(&code[use], &offset, sizeof(offset));
+            }
+        }
+    }
+
+    // mov reg, [rbx + 8 * slot] and back.
+    void load(Register reg, int slot)
+    {
+        bytes({0x48, 0x8b, static_cast<uint8_t>(0x83 | reg << 3)});
+        imm32(static_cast<uint32_t>(slot * sizeof(Value)));
+    }
+    void store(int slot)
+    {
+        bytes({0x48, 0x89, 0x83});
+        imm32(static_cast<uint32_t>(slot * sizeof(Value)));
+    }
+
+    void loadConstant(Value value, Register reg = Rax)
+    {
+        bytes({0x48, static_cast<uint8_t>(0xb8 | reg)});
+        imm64(value.raw());
+    }
+
+    // Branches to notInt unless reg holds an int, using rdx.
+    void checkInt(Register reg, size_t notInt)
+    {
+        bytes({0x48, 0x89, static_cast<uint8_t>(0xc2 | reg << 3)}); // mov rdx, reg
+        bytes({0x48, 0xc1, 0xea, 48});                               // shr rdx, 48
+        bytes({0x81, 0xe2});                                         // and edx, sign | quiet NaN | int tag
+        imm32(0xfffe);
+        bytes({0x81, 0xfa}); // cmp edx, quiet NaN | int tag
+        imm32(Value::integer(0).raw() >> 48);
+        jump(NotEqual, notInt);
+    }
+
+    // Branches to notDouble when reg holds anything but a double.
+    void checkDouble(Register reg, size_t notDouble)
+    {
+        bytes({0x48, 0x89, static_cast<uint8_t>(0xc2 | reg << 3)}); // mov rdx, reg
+        bytes({0x48, 0xc1, 0xea, 50});                               // shr rdx, 50
+        bytes({0x81, 0xe2});                                         // and edx, quiet NaN
+        imm32(0x1fff);
+        bytes({0x81, 0xfa});
+        imm32(0x1fff);
+        jump(Equal, notDouble);
+    }
+
+    // Sign-extends the payload of an int.
+    void unbox(Register reg)
+    {
+        bytes({0x48, 0xc1, static_cast<uint8_t>(0xe0 | reg), 16}); // shl reg, 16
+        bytes({0x48, 0xc1, static_cast<uint8_t>(0xf8 | reg), 16}); // sar reg, 16
+    }
+
+    // Converts the number in reg to a double in xmm<xmm>, or branches to
+    // notNumber.
+    void toDouble(uint8_t xmm, Register reg, size_t notNumber)
+    {
+        size_t notInt = label();
+        size_t done = label();
+        checkInt(reg, notInt);
+        unbox(reg);
+        bytes({0xf2, 0x48, 0x0f, 0x2a, static_cast<uint8_t>(0xc0 | xmm << 3 | reg)}); // cvtsi2sd
+        jump(done);
+        bind(notInt);
+        checkDouble(reg, notNumber);
+        bytes({0x66, 0x48, 0x0f, 0x6e, static_cast<uint8_t>(0xc0 | xmm << 3 | reg)}); // movq xmm, reg
+        bind(done);
+    }
+
+    // Boxes the int64 in rax like Value::integer: an int when it fits in
+    // the payload, otherwise a double.
+    void boxInt()
+    {
+        size_t tooWide = label();
+        size_t done = label();
+        bytes({0x48, 0x89, 0xc2});       // mov rdx, rax
+        bytes({0x48, 0xc1, 0xe2, 16});   // shl rdx, 16
+        bytes({0x48, 0xc1, 0xfa, 16});   // sar rdx, 16
+        bytes({0x48, 0x39, 0xc2});       // cmp rdx, rax
+        jump(NotEqual, tooWide);
+        bytes({0x48, 0xc1, 0xe0, 16});   // shl rax, 16
+        bytes({0x48, 0xc1, 0xe8, 16});   // shr rax, 16
+        bytes({0x48, 0xba});             // mov rdx, int tag
+        imm64(Value::integer(0).raw());
+        bytes({0x48, 0x09, 0xd0});       // or rax, rdx
+        jump(done);
+        bind(tooWide);
+        bytes({0xf2, 0x48, 0x0f, 0x2a, 0xc0}); // cvtsi2sd xmm0, rax
+        bytes({0x66, 0x48, 0x0f, 0x7e, 0xc0}); // movq rax, xmm0
+        bind(done);
+    }
+
+    // Moves the double in xmm0 to rax like Value::number, which gives every
+    // NaN the same bits.
+    void boxDouble()
+    {
+        bytes({0x66, 0x48, 0x0f, 0x7e, 0xc0}); // movq rax, xmm0
+        bytes({0x66, 0x0f, 0x2e, 0xc0});       // ucomisd xmm0, xmm0
+        bytes({0x7b, 10});                     // jnp over the next instruction
+        loadConstant(Value::number(NAN));
+    }
+
+    void call(const void *function)
+    {
+        bytes({0x48, 0xb8}); // mov rax, function
+        imm64(reinterpret_cast<uint64_t>(function));
+        bytes({0xff, 0xd0}); // call rax
+    }
+
+    void prologue()
+    {
+        bytes({0x53});             // push rbx, which also aligns the stack for calls
+        bytes({0x48, 0x89, 0xfb}); // mov rbx, rdi
+    }
+    void epilogue(uint32_t exit)
+    {
+        bytes({0xb8}); // mov eax, exit
+        imm32(exit);
+        bytes({0x5b, 0xc3}); // pop rbx; ret
+    }
+};
+
+// Branches to unless when the comparison op of the two slots below top is
+// false, and falls through when it is true; both operands stay in place.
+// Numbers compare like eval_comparison; anything else branches to deopt,
+// since == and != on other values need the interpreter.
+void emitComparison(Assembler &as, OpCode op, int top, size_t unless, size_t deopt)
+{
+    int lhs = top - 2;
+    int rhs = top - 1;
+    size_t doubles = as.label();
+    size_t done = as.label();
+
+    as.load(Rax, lhs);
+    as.load(Rcx, rhs);
+    as.checkInt(Rax, doubles);
+    as.checkInt(Rcx, doubles);
+    as.unbox(Rax);
+    as.unbox(Rcx);
+    as.bytes({0x48, 0x39, 0xc8}); // cmp rax, rcx
+    switch (op)
+    {
+    case OpCode::Less:
+        as.jump(GreaterEqual, unless);
+        break;
+    case OpCode::LessEqual:
+        as.jump(Greater, unless);
+        break;
+    case OpCode::Greater:
+        as.jump(LessEqual, unless);
+        break;
+    case OpCode::GreaterEqual:
+        as.jump(Less, unless);
+        break;
+    case OpCode::Equal:
+        as.jump(NotEqual, unless);
+        break;
+    default:
+        as.jump(Equal, unless);
+        break;
+    }
+    as.jump(done);
+
+    // Unordered operands, from a NaN, set the parity flag, and every
+    // comparison but != is false for them.
+    as.bind(doubles);
+    as.load(Rax, lhs);
+    as.load(Rcx, rhs);
+    as.toDouble(0, Rax, deopt);
+    as.toDouble(1, Rcx, deopt);
+    switch (op)
+    {
+    case OpCode::Less:
+        as.bytes({0x66, 0x0f, 0x2e, 0xc8}); // ucomisd xmm1, xmm0
+        as.jump(BelowEqual, unless);
+        break;
+    case OpCode::LessEqual:
+        as.bytes({0x66, 0x0f, 0x2e, 0xc8});
+        as.jump(Below, unless);
+        break;
+    case OpCode::Greater:
+        as.bytes({0x66, 0x0f, 0x2e, 0xc1}); // ucomisd xmm0, xmm1
+        as.jump(BelowEqual, unless);
+        break;
+    case OpCode::GreaterEqual:
+        as.bytes({0x66, 0x0f, 0x2e, 0xc1});
+        as.jump(Below, unless);
+        break;
+    case OpCode::Equal:
+        as.bytes({0x66, 0x0f, 0x2e, 0xc1});
+        as.jump(Parity, unless);
+        as.jump(NotEqual, unless);
+        break;
+    default:
+        as.bytes({0x66, 0x0f, 0x2e, 0xc1});
+        as.jump(Parity, done);
+        as.jump(Equal, unless);
+        break;
+    }
+    as.bind(done);
+}
+
+// The comparison opcode a fused compare-and-branch performs.
+OpCode comparisonOf(OpCode branch)
+{
+    switch (branch)
+    {
+    case OpCode::JumpUnlessLess:
+        return OpCode::Less;
+    case OpCode::JumpUnlessLessEqual:
+        return OpCode::LessEqual;
+    case OpCode::JumpUnlessGreater:
+        return OpCode::Greater;
+    case OpCode::JumpUnlessGreaterEqual:
+        return OpCode::GreaterEqual;
+    case OpCode::JumpUnlessEqual:
+        return OpCode::Equal;
+    default:
+        return OpCode::NotEqual;
+    }
+}
+
+double modulo(double a, double b)
+{
+    return std::fmod(a, b);
+}
+
+// One arithmetic instruction on the two slots below top, leaving the
+// result in the lower one. Two ints take the integer path and everything
+// else the double path, matching eval_numeric_binary_expr; an operand that
+// is not a number branches to deopt.
+void emitArithmetic(Assembler &as, OpCode op, int top, size_t deopt)
+{
+    int lhs = top - 2;
+    int rhs = top - 1;
+    size_t doubles = as.label();
+    size_t done = as.label();
+
+    as.load(Rax, lhs);
+    as.load(Rcx, rhs);
+
+    if (op != OpCode::Div)
+    {
+        as.checkInt(Rax, doubles);
+        as.checkInt(Rcx, doubles);
+        as.unbox(Rax);
+        as.unbox(Rcx);
+        switch (op)
+        {
+        case OpCode::Add:
+            as.bytes({0x48, 0x01, 0xc8}); // add rax, rcx
+            break;
+        case OpCode::Sub:
+            as.bytes({0x48, 0x29, 0xc8}); // sub rax, rcx
+            break;
+        case OpCode::Mul:
+            as.bytes({0x48, 0x0f, 0xaf, 0xc1}); // imul rax, rcx
+            as.jump(Overflow, doubles);
+            break;
+        default:
+            as.bytes({0x48, 0x85, 0xc9}); // test rcx, rcx
+            as.jump(Equal, doubles);
+            as.bytes({0x48, 0x99});       // cqo
+            as.bytes({0x48, 0xf7, 0xf9}); // idiv rcx
+            as.bytes({0x48, 0x89, 0xd0}); // mov rax, rdx
+            break;
+        }
+        as.boxInt();
+        as.store(lhs);
+        as.jump(done);
+    }
+
+    // The integer path may have unboxed the operands already.
+    as.bind(doubles);
+    as.load(Rax, lhs);
+    as.load(Rcx, rhs);
+    as.toDouble(0, Rax, deopt);
+    as.toDouble(1, Rcx, deopt);
+    switch (op)
+    {
+    case OpCode::Add:
+        as.bytes({0xf2, 0x0f, 0x58, 0xc1}); // addsd xmm0, xmm1
+        break;
+    case OpCode::Sub:
+        as.bytes({0xf2, 0x0f, 0x5c, 0xc1}); // subsd xmm0, xmm1
+        break;
+    case OpCode::Mul:
+        as.bytes({0xf2, 0x0f, 0x59, 0xc1}); // mulsd xmm0, xmm1
+        break;
+    case OpCode::Div:
+        as.bytes({0xf2, 0x0f, 0x5e, 0xc1}); // divsd xmm0, xmm1
+        break;
+    default:
+        as.call(reinterpret_cast<const void *>(&modulo));
+        break;
+    }
+    as.boxDouble();
+    as.store(lhs);
+    as.bind(done);
+}
+
+} // namespace
+
+std::unique_ptr<JitCode> JitCode::compile(const FunctionProto &proto)
+{
+    // Compiled code keeps its operand stack in the frame, within the slack
+    // the VM leaves above every frame's locals.
+    constexpr int MaxStack = 512;
+
+    if (proto.captured)
+    {
+        return nullptr;
+    }
+
+    const std::vector<uint8_t> &code = proto.chunk.code;
+    Assembler as;
+    std::vector<Exit> exits;
+    std::vector<std::pair<size_t, uint32_t>> exitLabels;
+
+    // Every instruction gets a label for jumps to branch to, and the stack
+    // height it runs at. The compiler only emits structured control flow,
+    // so code after an unconditional jump is always the target of an
+    // earlier forward jump, which already recorded its height.
+    std::vector<size_t> labels(code.size());
+    std::vector<int> depths(code.size(), -1);
+    for (size_t &label : labels)
+    {
+        label = as.label();
+    }
+
+    as.prologue();
+
+    size_t offset = 0;
+    int depth = 0;
+    bool reachable = true;
+    OpCode last = OpCode::Return;
+    auto readShort = [&]()
+    {
+        uint16_t value = code[offset] | (code[offset + 1] << 8);
+        offset += 2;
+        return value;
+    };
+    auto readInt = [&]()
+    {
+        uint32_t low = readShort();
+        return low | (static_cast<uint32_t>(readShort()) << 16);
+    };
+    // Records the height a jump arrives with; false if it disagrees.
+    auto jumpTo = [&](uint32_t target, int height)
+    {
+        if (target >= code.size() || (depths[target] >= 0 && depths[target] != height))
+        {
+            return false;
+        }
+        depths[target] = height;
+        return true;
+    };
+
+    while (offset < code.size())
+    {
+        size_t start = offset;
+        if (!reachable)
+        {
+            if (depths[start] < 0)
+            {
+                return nullptr;
+            }
+            depth = depths[start];
+            reachable = true;
+        }
+        else if (!jumpTo(static_cast<uint32_t>(start), depth))
+        {
+            return nullptr;
+        }
+        as.bind(labels[start]);
+
+        int top = proto.localCount + depth;
+        last = static_cast<OpCode>(code[offset++]);
+
+        // Guards of this instruction resume the interpreter at its start.
+        auto deopt = [&]()
+        {
+            size_t label = as.label();
+            exits.push_back({static_cast<uint32_t>(start), static_cast<uint32_t>(top)});
+            exitLabels.push_back({label, static_cast<uint32_t>(exits.size())});
+            return label;
+        };
+
+        switch (last)
+        {
+        case OpCode::Constant:
+            as.loadConstant(proto.chunk.constants[readShort()]);
+            as.store(top);
+            depth++;
+            break;
+        case OpCode::ConstantWide:
+            as.loadConstant(proto.chunk.constants[readInt()]);
+            as.store(top);
+            depth++;
+            break;
+        case OpCode::Null:
+            as.loadConstant(Value::null());
+            as.store(top);
+            depth++;
+            break;
+        case OpCode::Pop:
+            depth--;
+            break;
+        case OpCode::GetLocal:
+            as.load(Rax, readShort());
+            as.store(top);
+            depth++;
+            break;
+        case OpCode::SetLocal:
+        {
+            uint16_t slot = readShort();
+            as.load(Rax, top - 1);
+            as.store(slot);
+            break;
+        }
+        case OpCode::Add:
+        case OpCode::Sub:
+        case OpCode::Mul:
+        case OpCode::Div:
+        case OpCode::Mod:
+            emitArithmetic(as, last, top, deopt());
+            depth--;
+            break;
+        case OpCode::Less:
+        case OpCode::LessEqual:
+        case OpCode::Greater:
+        case OpCode::GreaterEqual:
+        case OpCode::Equal:
+        case OpCode::NotEqual:
+        {
+            size_t isFalse = as.label();
+            size_t done = as.label();
+            emitComparison(as, last, top, isFalse, deopt());
+            as.loadConstant(Value::boolean(true));
+            as.jump(done);
+            as.bind(isFalse);
+            as.loadConstant(Value::boolean(false));
+            as.bind(done);
+            as.store(top - 2);
+            depth--;
+            break;
+        }
+        case OpCode::Jump:
+        {
+            uint32_t target = readInt();
+            if (!jumpTo(target, depth))
+            {
+                return nullptr;
+            }
+            as.jump(labels[target]);
+            reachable = false;
+            break;
+        }
+        case OpCode::JumpIfFalse:
+        {
+            // Booleans and null; other conditions go to the interpreter's
+            // isTruthy.
+            uint32_t target = readInt();
+            size_t failed = deopt();
+            depth--;
+            if (!jumpTo(target, depth))
+            {
+                return nullptr;
+            }
+            size_t next = as.label();
+            as.load(Rax, top - 1);
+            as.loadConstant(Value::boolean(true), Rdx);
+            as.bytes({0x48, 0x39, 0xd0}); // cmp rax, rdx
+            as.jump(Equal, next);
+            as.loadConstant(Value::boolean(false), Rdx);
+            as.bytes({0x48, 0x39, 0xd0});
+            as.jump(Equal, labels[target]);
+            as.loadConstant(Value::null(), Rdx);
+            as.bytes({0x48, 0x39, 0xd0});
+            as.jump(Equal, labels[target]);
+            as.jump(failed);
+            as.bind(next);
+            break;
+        }
+        case OpCode::JumpUnlessLess:
+        case OpCode::JumpUnlessLessEqual:
+        case OpCode::JumpUnlessGreater:
+        case OpCode::JumpUnlessGreaterEqual:
+        case OpCode::JumpUnlessEqual:
+        case OpCode::JumpUnlessNotEqual:
+        {
+            uint32_t target = readInt();
+            size_t failed = deopt();
+            depth -= 2;
+            if (!jumpTo(target, depth))
+            {
+                return nullptr;
+            }
+            emitComparison(as, comparisonOf(last), top, labels[target], failed);
+            break;
+        }
+        case OpCode::Return:
+            as.load(Rax, top - 1);
+            as.store(0);
+            as.epilogue(0);
+            depth--;
+            reachable = false;
+            break;
+        default:
+            return nullptr;
+        }
+
+        if (depth > MaxStack)
+        {
+            return nullptr;
+        }
+    }
+
+    if (reachable)
+    {
+        return nullptr;
+    }
+
+    for (const auto &exit : exitLabels)
+    {
+        as.bind(exit.first);
+        as.epilogue(exit.second);
+    }
+    as.finish();
+
+    size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t size = (as.code.size() + pageSize - 1) / pageSize * pageSize;
+    void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        return nullptr;
+    }
+    std::memcpy(memory, as.code.data(), as.code.size());
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(memory, size);
+        return nullptr;
+    }
+
+    return std::unique_ptr<JitCode>(new JitCode(memory, size, std::move(exits)));
+}
+
+#else
+
+std::unique_ptr<JitCode> JitCode::compile(const FunctionProto &proto)
+{
+    (void)proto;
+    return nullptr;
+}
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "Values.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+struct FunctionProto;
+
+// Whether the VM compiles hot functions to machine code; --no-jit clears
+// it. Read by every VM, so only change it while none is running.
+extern bool jitEnabled;
+
+// Machine code for one FunctionProto, from the baseline compiler in
+// Jit.cpp. Only uncaptured functions made of constants, locals,
+// arithmetic, comparisons and jumps are compiled, on x86-64; anything else
+// stays interpreted.
+//
+// The code works on the frame in place: locals at base and the operand
+// stack right above them, at the same slots the interpreter would use.
+// Arithmetic and comparisons are guarded on their operands being numbers,
+// and branches on their condition being a boolean or null. When a guard
+// fails the code stops before that instruction, and the interpreter
+// resumes the frame from it with the stack exactly as the compiled code
+// left it.
+class JitCode
+{
+public:
+    // Calls before a function is compiled, and deoptimizations before its
+    // code is thrown away for good.
+    static constexpr uint32_t Threshold = 1000;
+    static constexpr uint32_t MaxDeopts = 100;
+
+    // Where a deoptimized call continues: a bytecode offset, and the stack
+    // height from the frame base at that point.
+    struct Exit
+    {
+        uint32_t offset;
+        uint32_t stackSize;
+    };
+
+private:
+    using Entry = uint32_t (*)(Value *base);
+
+    void *memory;
+    size_t size;
+    std::vector<Exit> exits;
+
+    JitCode(void *memory, size_t size, std::vector<Exit> exits);
+
+public:
+    uint32_t deopts = 0;
+
+    JitCode(const JitCode &) = delete;
+    JitCode &operator=(const JitCode &) = delete;
+    ~JitCode();
+
+    // Null when proto uses something the compiler does not handle.
+    static std::unique_ptr<JitCode> compile(const FunctionProto &proto);
+
+    // Runs the function for the frame at base and returns null with the
+    // result in base[0], or the exit to resume the interpreter from.
+    const Exit *run(Value *base)
+    {
+        uint32_t exit = reinterpret_cast<Entry>(memory)(base);
+        return exit == 0 ? nullptr : &exits[exit - 1];
+    }
+};
+
+#endif // JIT_H
@@ -0,0 +1,205 @@
+#ifndef NATIVE_H
+#define NATIVE_H
+
+#include "Values.h"
+#include "Heap.h"
+
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+// Compile-time binding of C++ functions as natives. native<F>() returns a
+// NativeCall whose body unboxes each argument to F's parameter type, calls
+// F directly and boxes the result, so a call costs no more than the
+// conversions themselves:
+//
+//     double hypot(double x, double y);
+//     env->declareVar(intern("hypot"), makeNative(native<hypot>()), true);
+//
+// Supported parameter types are double, int64_t (an integral number),
+// bool, Value, std::string_view, std::string, ObjectVal *, ArrayVal * and
+// NativeArgs, which receives all remaining arguments. Supported return
+// types are void, double, int64_t, bool, Value, std::string, ObjectVal *
+// and ArrayVal *.
+
+template <typename T>
+struct NativeType;
+
+[[noreturn]] inline void throwArgumentError(const char *expected, size_t index)
+{
+    throw std::runtime_error(std::string("Expected ") + expected + " for argument " + std::to_string(index + 1));
+}
+
+template <>
+struct NativeType<double>
+{
+    static double from(NativeArgs args, size_t index)
+    {
+        Value value = args[index];
+        if (!value.isNumber())
+        {
+            throwArgumentError("a number", index);
+        }
+        return value.asNumber();
+    }
+
+    static Value to(double value) { return Value::number(value); }
+};
+
+template <>
+struct NativeType<int64_t>
+{
+    static int64_t from(NativeArgs args, size_t index)
+    {
+        Value value = args[index];
+        if (value.isInt())
+        {
+            return value.asInt();
+        }
+
+        double number = value.isNumber() ? value.asNumber() : 0.5;
+        if (!(number >= -9007199254740992.0 && number <= 9007199254740992.0) || number != std::floor(number))
+        {
+            throwArgumentError("an integer", index);
+        }
+        return static_cast<int64_t>(number);
+    }
+
+    static Value to(int64_t value) { return Value::integer(value); }
+};
+
+template <>
+struct NativeType<bool>
+{
+    static bool from(NativeArgs args, size_t index)
+    {
+        Value value = args[index];
+        if (value.type() != ValueType::Boolean)
+        {
+            throwArgumentError("a boolean", index);
+        }
+        return value.asBoolean();
+    }
+
+    static Value to(bool value) { return Value::boolean(value); }
+};
+
+template <>
+struct NativeType<Value>
+{
+    static Value from(NativeArgs args, size_t index) { return args[index]; }
+    static Value to(Value value) { return value; }
+};
+
+template <>
+struct NativeType<std::string_view>
+{
+    static std::string_view from(NativeArgs args, size_t index)
+    {
+        Value value = args[index];
+        if (value.type() != ValueType::String)
+        {
+            throwArgumentError("a string", index);
+        }
+        return value.as<StringVal>()->view();
+    }
+};
+
+template <>
+struct NativeType<std::string>
+{
+    static std::string from(NativeArgs args, size_t index)
+    {
+        return std::string(NativeType<std::string_view>::from(args, index));
+    }
+
+    static Value to(const std::string &value)
+    {
+        return Value::object(StringVal::create(Heap::current(), value));
+    }
+};
+
+template <>
+struct NativeType<ObjectVal *>
+{
+    static ObjectVal *from(NativeArgs args, size_t index)
+    {
+        Value value = args[index];
+        if (value.type() != ValueType::Object)
+        {
+            throwArgumentError("an object", index);
+        }
+        return value.as<ObjectVal>();
+    }
+
+    static Value to(ObjectVal *value) { return Value::object(value); }
+};
+
+template <>
+struct NativeType<ArrayVal *>
+{
+    static ArrayVal *from(NativeArgs args, size_t index)
+    {
+        Value value = args[index];
+        if (value.type() != ValueType::Array)
+        {
+            throwArgumentError("an array", index);
+        }
+        return value.as<ArrayVal>();
+    }
+
+    static Value to(ArrayVal *value) { return Value::object(value); }
+};
+
+template <>
+struct NativeType<NativeArgs>
+{
+    static NativeArgs from(NativeArgs args, size_t index) { return args.from(index); }
+};
+
+template <auto F, typename Signature = decltype(F)>
+struct NativeAdapter;
+
+template <auto F, typename R, typename... A>
+struct NativeAdapter<F, R (*)(A...)>
+{
+    template <size_t... I>
+    static Value invoke(NativeArgs args, std::index_sequence<I...>)
+    {
+        if constexpr (std::is_void_v<R>)
+        {
+            F(NativeType<std::decay_t<A>>::from(args, I)...);
+            return Value::null();
+        }
+        else
+        {
+            return NativeType<std::decay_t<R>>::to(F(NativeType<std::decay_t<A>>::from(args, I)...));
+        }
+    }
+
+    static Value call(NativeArgs args)
+    {
+        return invoke(args, std::index_sequence_for<A...>());
+    }
+};
+
+template <auto F>
+constexpr NativeCall native()
+{
+    return &NativeAdapter<F>::call;
+}
+
+// Natives with effects outside the heap, such as output, pass parallel =
+// false so that the parallel builtins only ever call them in order.
+inline Value makeNative(NativeCall call, bool parallel = true)
+{
+    NativeFunctionVal *function = Heap::current().allocate<NativeFunctionVal>(call);
+    function->parallel = parallel;
+    return Value::object(function);
+}
+
+#endif // NATIVE_H
@@ -0,0 +1,374 @@
+#include "Optimizer.h"
+#include "Interpreter.h"
+
+// Whether removing stmt would remove a declaration the Resolver hoists.
+static bool declares(Stmt *stmt)
+{
+    if (!stmt)
+    {
+        return false;
+    }
+
+    switch (stmt->kind)
+    {
+    case NodeType::VarDeclaration:
+    case NodeType::FunctionDeclaration:
+        return true;
+    case NodeType::ForStmt:
+        return declares(static_cast<ForStmt *>(stmt)->init) || declares(static_cast<ForStmt *>(stmt)->body);
+    case NodeType::WhileStmt:
+        return declares(static_cast<WhileStmt *>(stmt)->body);
+    case NodeType::IfStmt:
+        return declares(static_cast<IfStmt *>(stmt)->thenBranch) || declares(static_cast<IfStmt *>(stmt)->elseBranch);
+    case NodeType::BlockStmt:
+        for (Stmt *inner : static_cast<BlockStmt *>(stmt)->body)
+        {
+            if (declares(inner))
+            {
+                return true;
+            }
+        }
+        return false;
+    default:
+        return false;
+    }
+}
+
+void Optimizer::optimize(Program *program)
+{
+    arena = &program->arena;
+    scopes.emplace_back();
+
+    for (Stmt *stmt : program->body)
+    {
+        hoist(stmt);
+    }
+    optimize_body(program->body);
+
+    scopes.clear();
+    arena = nullptr;
+}
+
+void Optimizer::hoist(Stmt *stmt)
+{
+    if (!stmt)
+    {
+        return;
+    }
+
+    switch (stmt->kind)
+    {
+    case NodeType::VarDeclaration:
+        scopes.back().bindings[static_cast<VarDeclaration *>(stmt)->identifier] = nullptr;
+        break;
+    case NodeType::FunctionDeclaration:
+        scopes.back().bindings[static_cast<FunctionDeclaration *>(stmt)->name] = nullptr;
+        break;
+    case NodeType::ForStmt:
+        hoist(static_cast<ForStmt *>(stmt)->init);
+        hoist(static_cast<ForStmt *>(stmt)->body);
+        break;
+    case NodeType::WhileStmt:
+        hoist(static_cast<WhileStmt *>(stmt)->body);
+        break;
+    case NodeType::IfStmt:
+        hoist(static_cast<IfStmt *>(stmt)->thenBranch);
+        hoist(static_cast<IfStmt *>(stmt)->elseBranch);
+        break;
+    case NodeType::BlockStmt:
+        for (Stmt *inner : static_cast<BlockStmt *>(stmt)->body)
+        {
+            hoist(inner);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+NumericLiteral *Optimizer::constant(Symbol name) const
+{
+    for (size_t i = scopes.size(); i-- > 0;)
+    {
+        auto it = scopes[i].bindings.find(name);
+        if (it != scopes[i].bindings.end())
+        {
+            return it->second;
+        }
+    }
+
+    return nullptr;
+}
+
+// A literal standing in for the expression `replaced`, on its line.
+NumericLiteral *Optimizer::literal(double value, Stmt *replaced)
+{
+    NumericLiteral *node = arena->make<NumericLiteral>(value);
+    node->line = replaced->line;
+    return node;
+}
+
+// An IfStmt whose constant condition selects a missing branch does nothing.
+bool Optimizer::isDead(Stmt *stmt) const
+{
+    if (stmt->kind != NodeType::IfStmt)
+    {
+        return false;
+    }
+
+    IfStmt *branch = static_cast<IfStmt *>(stmt);
+    if (branch->condition->kind != NodeType::NumericLiteral)
+    {
+        return false;
+    }
+
+    bool taken = isTruthy(Value::number(static_cast<NumericLiteral *>(branch->condition)->value));
+    Stmt *selected = taken ? branch->thenBranch : branch->elseBranch;
+    Stmt *skipped = taken ? branch->elseBranch : branch->thenBranch;
+    return !selected && !declares(skipped);
+}
+
+// Constants are only recorded for declarations directly in a body, where
+// textual order is execution order: every later statement, including the
+// functions it declares, runs after the initializer.
+void Optimizer::optimize_body(std::vector<Stmt *> &body)
+{
+    size_t kept = 0;
+
+    for (size_t i = 0; i < body.size(); i++)
+    {
+        Stmt *stmt = optimize_stmt(body[i]);
+
+        if (stmt->kind == NodeType::VarDeclaration)
+        {
+            VarDeclaration *declaration = static_cast<VarDeclaration *>(stmt);
+            if (declaration->constant && declaration->value && declaration->value->kind == NodeType::NumericLiteral)
+            {
+                scopes.back().bindings[declaration->identifier] = static_cast<NumericLiteral *>(declaration->value);
+            }
+        }
+
+        // The last statement is the body's value, so it stays even if dead.
+        if (isDead(stmt) && i + 1 < body.size())
+        {
+            continue;
+        }
+        body[kept++] = stmt;
+    }
+
+    body.resize(kept);
+}
+
+void Optimizer::optimize_function(FunctionDeclaration *declaration)
+{
+    scopes.emplace_back();
+
+    for (Symbol param : declaration->parameters)
+    {
+        scopes.back().bindings[param] = nullptr;
+    }
+    for (Stmt *stmt : declaration->body)
+    {
+        hoist(stmt);
+    }
+    optimize_body(declaration->body);
+
+    scopes.pop_back();
+}
+
+Stmt *Optimizer::optimize_stmt(Stmt *stmt)
+{
+    switch (stmt->kind)
+    {
+    case NodeType::VarDeclaration:
+    {
+        VarDeclaration *declaration = static_cast<VarDeclaration *>(stmt);
+        if (declaration->value)
+        {
+            declaration->value = optimize_expr(declaration->value);
+        }
+        return stmt;
+    }
+    case NodeType::FunctionDeclaration:
+        optimize_function(static_cast<FunctionDeclaration *>(stmt));
+        return stmt;
+    case NodeType::IfStmt:
+        return optimize_if_stmt(static_cast<IfStmt *>(stmt));
+    case NodeType::ForStmt:
+    {
+        ForStmt *loop = static_cast<ForStmt *>(stmt);
+        if (loop->init)
+        {
+            loop->init = optimize_stmt(loop->init);
+        }
+        if (loop->condition)
+        {
+            loop->condition = optimize_condition(loop->condition);
+        }
+        if (loop->increment)
+        {
+            loop->increment = optimize_expr(loop->increment);
+        }
+        loop->body = optimize_stmt(loop->body);
+        return stmt;
+    }
+    case NodeType::WhileStmt:
+    {
+        WhileStmt *loop = static_cast<WhileStmt *>(stmt);
+        loop->condition = optimize_condition(loop->condition);
+        loop->body = optimize_stmt(loop->body);
+        return stmt;
+    }
+    case NodeType::BlockStmt:
+        // Not optimize_body: a block may be skipped or repeated, so its
+        // constants are not known to be set for the statements after it.
+        for (Stmt *&inner : static_cast<BlockStmt *>(stmt)->body)
+        {
+            inner = optimize_stmt(inner);
+        }
+        return stmt;
+    default:
+        return optimize_expr(static_cast<Expr *>(stmt));
+    }
+}
+
+Stmt *Optimizer::optimize_if_stmt(IfStmt *stmt)
+{
+    stmt->condition = optimize_condition(stmt->condition);
+    if (stmt->thenBranch)
+    {
+        stmt->thenBranch = optimize_stmt(stmt->thenBranch);
+    }
+    if (stmt->elseBranch)
+    {
+        stmt->elseBranch = optimize_stmt(stmt->elseBranch);
+    }
+
+    if (stmt->condition->kind != NodeType::NumericLiteral)
+    {
+        return stmt;
+    }
+
+    // A skipped branch that declares names must stay so the names still
+    // resolve; otherwise the taken branch replaces the whole statement.
+    bool taken = isTruthy(Value::number(static_cast<NumericLiteral *>(stmt->condition)->value));
+    Stmt *selected = taken ? stmt->thenBranch : stmt->elseBranch;
+    Stmt *skipped = taken ? stmt->elseBranch : stmt->thenBranch;
+
+    if (selected && !declares(skipped))
+    {
+        return selected;
+    }
+    return stmt;
+}
+
+Expr *Optimizer::optimize_binary_expr(BinaryExpr *binop)
+{
+    binop->left = optimize_expr(binop->left);
+    binop->right = optimize_expr(binop->right);
+
+    // There are no boolean literals to fold comparisons into; conditions
+    // fold them in optimize_condition.
+    if (isComparison(binop->op) || binop->left->kind != NodeType::NumericLiteral ||
+        binop->right->kind != NodeType::NumericLiteral)
+    {
+        return binop;
+    }
+
+    // Literals become values exactly as they would at runtime, so the fold
+    // takes the same integer or double path.
+    Value lhs = Value::canonicalNumber(static_cast<NumericLiteral *>(binop->left)->value);
+    Value rhs = Value::canonicalNumber(static_cast<NumericLiteral *>(binop->right)->value);
+
+    return literal(eval_numeric_binary_expr(lhs, rhs, binop->op).asNumber(), binop);
+}
+
+// Only the truthiness of a condition matters, so a comparison of two
+// literals can become 1 or 0, which the if and loop code then treats as a
+// constant condition.
+Expr *Optimizer::optimize_condition(Expr *condition)
+{
+    condition = optimize_expr(condition);
+    if (condition->kind != NodeType::BinaryExpr)
+    {
+        return condition;
+    }
+
+    BinaryExpr *comparison = static_cast<BinaryExpr *>(condition);
+    if (!isComparison(comparison->op) || comparison->left->kind != NodeType::NumericLiteral ||
+        comparison->right->kind != NodeType::NumericLiteral)
+    {
+        return condition;
+    }
+
+    Value lhs = Value::canonicalNumber(static_cast<NumericLiteral *>(comparison->left)->value);
+    Value rhs = Value::canonicalNumber(static_cast<NumericLiteral *>(comparison->right)->value);
+    return literal(eval_comparison(lhs, rhs, comparison->op) ? 1 : 0, condition);
+}
+
+Expr *Optimizer::optimize_expr(Expr *expr)
+{
+    switch (expr->kind)
+    {
+    case NodeType::Identifier:
+    {
+        NumericLiteral *known = constant(static_cast<Identifier *>(expr)->symbol);
+        return known ? literal(known->value, expr) : expr;
+    }
+    case NodeType::BinaryExpr:
+        return optimize_binary_expr(static_cast<BinaryExpr *>(expr));
+    case NodeType::AssignmentExpr:
+    {
+        // The target is left alone: assigning to a constant must still
+        // reach the Resolver's error.
+        AssignmentExpr *node = static_cast<AssignmentExpr *>(expr);
+        if (node->assignee->kind == NodeType::MemberExpr)
+        {
+            optimize_expr(node->assignee);
+        }
+        node->value = optimize_expr(node->value);
+        return expr;
+    }
+    case NodeType::CallExpr:
+    {
+        CallExpr *call = static_cast<CallExpr *>(expr);
+        call->caller = optimize_expr(call->caller);
+        for (Expr *&arg : call->args)
+        {
+            arg = optimize_expr(arg);
+        }
+        return expr;
+    }
+    case NodeType::MemberExpr:
+    {
+        MemberExpr *member = static_cast<MemberExpr *>(expr);
+        member->object = optimize_expr(member->object);
+        if (member->computed)
+        {
+            member->property = optimize_expr(member->property);
+        }
+        return expr;
+    }
+    case NodeType::ObjectLiteral:
+        for (Property *prop : static_cast<ObjectLiteral *>(expr)->properties)
+        {
+            if (prop->value)
+            {
+                prop->value = optimize_expr(prop->value);
+            }
+            else if (NumericLiteral *known = constant(prop->key))
+            {
+                prop->value = literal(known->value, prop);
+            }
+        }
+        return expr;
+    case NodeType::ArrayLiteral:
+        for (Expr *&element : static_cast<ArrayLiteral *>(expr)->elements)
+        {
+            element = optimize_expr(element);
+        }
+        return expr;
+    default:
+        return expr;
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include "../frontend/Ast.h"
+
+#include <unordered_map>
+#include <vector>
+
+// Rewrites a freshly parsed Program before it is resolved:
+//  - folds BinaryExprs whose operands are both numeric literals, and
+//    comparisons of literals in conditions,
+//  - replaces reads of `const` bindings initialised with a literal by the
+//    literal itself,
+//  - removes the branch of an IfStmt that a constant condition never takes.
+// Scoping mirrors the Resolver: declarations are hoisted to their function,
+// so a name declared anywhere in a function shadows outer constants there.
+class Optimizer
+{
+private:
+    struct Scope
+    {
+        // nullptr for bindings whose value is not a known literal
+        std::unordered_map<Symbol, NumericLiteral *> bindings;
+    };
+
+    Arena *arena = nullptr;
+    std::vector<Scope> scopes;
+
+    void hoist(Stmt *stmt);
+    NumericLiteral *constant(Symbol name) const;
+    NumericLiteral *literal(double value, Stmt *replaced);
+    bool isDead(Stmt *stmt) const;
+
+    void optimize_body(std::vector<Stmt *> &body);
+    Stmt *optimize_stmt(Stmt *stmt);
+    Expr *optimize_expr(Expr *expr);
+    Expr *optimize_condition(Expr *condition);
+    Expr *optimize_binary_expr(BinaryExpr *binop);
+    Stmt *optimize_if_stmt(IfStmt *stmt);
+    void optimize_function(FunctionDeclaration *declaration);
+
+public:
+    void optimize(Program *program);
+};
+
+#endif // OPTIMIZER_H
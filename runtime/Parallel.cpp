@@ -0,0 +1,619 @@
+#include "Parallel.h"
+
+#include "Environment.h"
+#include "Heap.h"
+#include "Interpreter.h"
+#include "Native.h"
+#include "Stats.h"
+#include "VM.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
+size_t parallelThreads = 0;
+
+WorkPool::WorkPool(size_t threads)
+{
+    for (size_t i = 0; i <= threads; i++)
+    {
+        deques.push_back(std::make_unique<Deque>());
+    }
+    for (size_t i = 1; i <= threads; i++)
+    {
+        this->threads.emplace_back(&WorkPool::threadMain, this, i);
+    }
+}
+
+WorkPool::~WorkPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+}
+
+WorkPool &WorkPool::shared()
+{
+    static WorkPool pool((parallelThreads ? parallelThreads : std::max(1u, std::thread::hardware_concurrency())) - 1);
+    return pool;
+}
+
+void WorkPool::threadMain(size_t worker)
+{
+    uint64_t seen = 0;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&]
+                      { return stopping || generation != seen; });
+            if (stopping)
+            {
+                return;
+            }
+            seen = generation;
+        }
+
+        work(worker);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--running == 0)
+        {
+            done.notify_one();
+        }
+    }
+}
+
+// The worker's own deque from the back, the end it last pushed to, or else
+// the front of another's.
+bool WorkPool::take(size_t worker, Range &range)
+{
+    for (size_t i = 0; i < deques.size(); i++)
+    {
+        Deque &deque = *deques[(worker + i) % deques.size()];
+        std::lock_guard<std::mutex> lock(deque.mutex);
+        if (deque.ranges.empty())
+        {
+            continue;
+        }
+        if (i == 0)
+        {
+            range = deque.ranges.back();
+            deque.ranges.pop_back();
+        }
+        else
+        {
+            range = deque.ranges.front();
+            deque.ranges.pop_front();
+        }
+        return true;
+    }
+    return false;
+}
+
+// Every index is counted off once its range is done, or skipped after a
+// failure, so the loop is over when none remain.
+void WorkPool::work(size_t worker)
+{
+    Range range;
+    while (remaining.load(std::memory_order_acquire) > 0)
+    {
+        if (!take(worker, range))
+        {
+            std::this_thread::yield();
+            continue;
+        }
+
+        while (range.end - range.begin > grain)
+        {
+            size_t middle = range.begin + (range.end - range.begin) / 2;
+            Deque &deque = *deques[worker];
+            std::lock_guard<std::mutex> lock(deque.mutex);
+            deque.ranges.push_back({middle, range.end});
+            range.end = middle;
+        }
+
+        if (!failed.load(std::memory_order_relaxed))
+        {
+            try
+            {
+                (*body)(worker, range.begin, range.end);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error)
+                {
+                    error = std::current_exception();
+                }
+                failed.store(true, std::memory_order_relaxed);
+            }
+        }
+        remaining.fetch_sub(range.end - range.begin, std::memory_order_acq_rel);
+    }
+}
+
+bool WorkPool::run(size_t count, size_t grain, const Body &body)
+{
+    std::unique_lock<std::mutex> hold(busy, std::try_to_lock);
+    if (!hold.owns_lock())
+    {
+        return false;
+    }
+    if (count == 0)
+    {
+        return true;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->body = &body;
+        this->grain = std::max<size_t>(grain, 1);
+        remaining.store(count, std::memory_order_relaxed);
+        failed.store(false, std::memory_order_relaxed);
+        deques[0]->ranges.push_back({0, count});
+        running = threads.size();
+        generation++;
+    }
+    wake.notify_all();
+
+    work(0);
+
+    std::exception_ptr thrown;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this]
+                  { return running == 0; });
+        this->body = nullptr;
+        thrown = std::exchange(error, nullptr);
+    }
+    if (thrown)
+    {
+        std::rethrow_exception(thrown);
+    }
+    return true;
+}
+
+namespace
+{
+    // What one worker keeps for the length of a loop. The heap holds what
+    // its calls returned until they are copied out.
+    struct Worker
+    {
+        Heap heap;
+        SharedAccesses shared;
+        VM vm;
+        uint64_t calls = 0;
+        std::vector<std::pair<size_t, Value>> partials; // of parallelReduce, by first index
+
+        Worker(const VM &owner) : vm(heap, owner, shared)
+        {
+            heap.scratch = true;
+        }
+
+        Value keep(Value value)
+        {
+            if (value.isHeap())
+            {
+                heap.valueRoots.push_back(value);
+            }
+            return value;
+        }
+    };
+
+    using Workers = std::vector<std::unique_ptr<Worker>>;
+    using RangeBody = std::function<void(Worker &worker, size_t begin, size_t end)>;
+}
+
+// Loops shorter than this run in order: a call on each worker would cost
+// more than it saves.
+static constexpr size_t MinParallelCount = 2;
+
+// Copies what workers returned into the caller's heap, which is current
+// again by now. Worker heaps never promote, so anything old was the
+// caller's all along and is kept as it is. Each object is copied once, so
+// whatever the results shared, cycles included, stays shared; closures
+// come with copies of the environments the worker made for them. The
+// copies stay rooted until the Transfer goes away.
+class Transfer
+{
+private:
+    Heap &heap;
+    RootScope roots;
+    std::unordered_map<const GcObject *, GcObject *> copies;
+
+    template <typename T>
+    T *record(const GcObject *source, T *copy)
+    {
+        copies[source] = roots.push(copy);
+        return copy;
+    }
+
+    GcObject *copied(const GcObject *source) const
+    {
+        auto found = copies.find(source);
+        return found == copies.end() ? nullptr : found->second;
+    }
+
+    // Copying the parent first may have led back to the environment
+    // itself, through a closure in one of its variables.
+    Environment *copy(Environment *source)
+    {
+        if (!source || source->old)
+        {
+            return source;
+        }
+        if (GcObject *done = copied(source))
+        {
+            return static_cast<Environment *>(done);
+        }
+
+        Environment *parent = copy(source->ancestor(1));
+        if (GcObject *done = copied(source))
+        {
+            return static_cast<Environment *>(done);
+        }
+
+        Environment *env = record(source, heap.allocate<Environment>(parent, source->size()));
+        for (size_t i = 0; i < source->size(); i++)
+        {
+            env->set(static_cast<int>(i), (*this)(source->get(static_cast<int>(i))));
+        }
+        return env;
+    }
+
+    RuntimeVal *copy(RuntimeVal *value)
+    {
+        switch (value->type)
+        {
+        case ValueType::String:
+        {
+            StringVal *source = static_cast<StringVal *>(value);
+            std::string text(source->length, '\0');
+            source->copyTo(text.data());
+            return record(source, StringVal::create(heap, text));
+        }
+        case ValueType::Array:
+        {
+            ArrayVal *source = static_cast<ArrayVal *>(value);
+            if (source->packed)
+            {
+                ArrayVal *array = record(source, ArrayVal::create(heap, source->size()));
+                std::copy(source->numbers.begin(), source->numbers.end(), array->numbers.begin());
+                return array;
+            }
+
+            ArrayVal *array = record(source, ArrayVal::create(heap, 0));
+            for (size_t i = 0; i < source->values.size(); i++)
+            {
+                array->set(i, (*this)(source->values[i]));
+            }
+            return array;
+        }
+        case ValueType::Object:
+        {
+            ObjectVal *source = static_cast<ObjectVal *>(value);
+            ObjectVal *object = record(source, ObjectVal::create(heap));
+            std::vector<Symbol> keys = source->keys();
+            for (uint32_t i = 0; i < keys.size(); i++)
+            {
+                object->set(keys[i], (*this)(source->slot(i)));
+            }
+            return object;
+        }
+        case ValueType::Function:
+        {
+            FunctionVal *source = static_cast<FunctionVal *>(value);
+            Environment *env = copy(source->declarationEnv);
+            if (GcObject *done = copied(source))
+            {
+                return static_cast<FunctionVal *>(done);
+            }
+
+            FunctionVal *function = record(source, heap.allocate<FunctionVal>(source->body, source->name, source->parameters, env));
+            function->localCount = source->localCount;
+            function->line = source->line;
+            function->proto = source->proto;
+            return function;
+        }
+        default:
+            // Natives are all made with the global environment.
+            return value;
+        }
+    }
+
+public:
+    explicit Transfer(Heap &heap) : heap(heap), roots(heap) {}
+
+    Value operator()(Value value)
+    {
+        if (!value.isHeap() || value.asHeap()->old)
+        {
+            return value;
+        }
+        if (GcObject *done = copied(value.asHeap()))
+        {
+            return Value::object(static_cast<RuntimeVal *>(done));
+        }
+        return Value::object(copy(value.asHeap()));
+    }
+};
+
+// Makes the stores the workers held back, unless one of them read an
+// element of an array the loop stores into at an index other than its
+// call's. Whether it saw the store then depends on the order of the calls,
+// so the loop has to run in order instead.
+static bool storeShared(const Workers &workers)
+{
+    std::unordered_set<const ArrayVal *> stored;
+    for (const std::unique_ptr<Worker> &worker : workers)
+    {
+        if (worker)
+        {
+            for (const SharedAccesses::Store &store : worker->shared.stores)
+            {
+                stored.insert(store.array);
+            }
+        }
+    }
+    for (const std::unique_ptr<Worker> &worker : workers)
+    {
+        if (worker && std::any_of(worker->shared.reads.begin(), worker->shared.reads.end(), [&](const ArrayVal *array)
+                                  { return stored.count(array) > 0; }))
+        {
+            return false;
+        }
+    }
+
+    for (const std::unique_ptr<Worker> &worker : workers)
+    {
+        if (worker)
+        {
+            for (const SharedAccesses::Store &store : worker->shared.stores)
+            {
+                store.array->numbers[static_cast<size_t>(store.index)] = store.value;
+            }
+        }
+    }
+    return true;
+}
+
+// Runs body over [0, count) on the shared pool, with a Worker for each
+// thread that takes part. Returns false when the loop must run in order
+// instead, having had no effect beyond allocations on the workers' heaps.
+//
+// That is the case whenever a call fails, whether by a write it may not
+// make or by an error of its own: which calls ran before the workers
+// stopped depends on the scheduling, so the stores they held back are
+// dropped and the loop runs again in order. It then ends the way it would
+// on a single thread, error or not.
+static bool runOnWorkers(size_t count, Value fn, Workers &workers, const RangeBody &body)
+{
+    Heap &heap = Heap::current();
+    VM *owner = VM::current();
+    bool compiled = fn.type() == ValueType::NativeFn || (fn.type() == ValueType::Function && fn.as<FunctionVal>()->proto);
+    WorkPool &pool = WorkPool::shared();
+
+    if (heap.scratch || !owner || !compiled || count < MinParallelCount || pool.workers() < 2)
+    {
+        return false;
+    }
+
+    // Everything the workers can reach is old from here on.
+    heap.collect(false);
+    if (fn.type() == ValueType::Function)
+    {
+        owner->warmUp(fn.as<FunctionVal>()->proto);
+    }
+
+    workers.resize(pool.workers());
+    WorkPool::Body run = [&](size_t index, size_t begin, size_t end)
+    {
+        std::unique_ptr<Worker> &worker = workers[index];
+        if (!worker)
+        {
+            worker = std::make_unique<Worker>(*owner);
+        }
+
+        Heap *previous = Heap::makeCurrent(&worker->heap);
+        uint64_t calls = executionStats.calls;
+        try
+        {
+            body(*worker, begin, end);
+        }
+        catch (...)
+        {
+            Heap::makeCurrent(previous);
+            throw;
+        }
+        worker->calls += executionStats.calls - calls;
+        Heap::makeCurrent(previous);
+    };
+
+    // Ropes of the caller's that workers flattened are charged to it once
+    // they are done, before anything can collect them.
+    auto chargeBorrowed = [&]()
+    {
+        for (const std::unique_ptr<Worker> &worker : workers)
+        {
+            if (worker)
+            {
+                heap.chargeBorrowed(worker->heap);
+            }
+        }
+    };
+
+    // A few ranges per worker leave room to even out uneven calls.
+    bool ran;
+    try
+    {
+        ran = pool.run(count, count / (pool.workers() * 8), run);
+    }
+    catch (...)
+    {
+        chargeBorrowed();
+        return false;
+    }
+    chargeBorrowed();
+    if (!ran || !storeShared(workers))
+    {
+        return false;
+    }
+
+    // The caller's thread counted its own calls already.
+    for (size_t i = 1; i < workers.size(); i++)
+    {
+        if (workers[i])
+        {
+            executionStats.calls += workers[i]->calls;
+        }
+    }
+    return true;
+}
+
+ArrayVal *parallelMap(ArrayVal *array, Value fn)
+{
+    Heap &heap = Heap::current();
+    size_t count = array->size();
+    std::vector<Value> results(count);
+    Workers workers;
+
+    bool parallel = runOnWorkers(count, fn, workers, [&](Worker &worker, size_t begin, size_t end)
+                         {
+                             for (size_t i = begin; i < end; i++)
+                             {
+                                 Value args[] = {array->get(i), Value::integer(static_cast<int64_t>(i))};
+                                 worker.shared.index = static_cast<int64_t>(i);
+                                 results[i] = worker.keep(worker.vm.call(fn, NativeArgs{args, 2}));
+                             }
+                         });
+
+    Transfer transfer(heap);
+    RootScope roots(heap);
+    ArrayVal *mapped = roots.push(ArrayVal::create(heap, 0));
+    for (size_t i = 0; i < count; i++)
+    {
+        if (parallel)
+        {
+            mapped->set(i, transfer(results[i]));
+            continue;
+        }
+        Value args[] = {array->get(i), Value::integer(static_cast<int64_t>(i))};
+        mapped->set(i, call_value(fn, NativeArgs{args, 2}));
+    }
+    return mapped;
+}
+
+Value parallelReduce(NativeArgs args)
+{
+    Heap &heap = Heap::current();
+    ArrayVal *array = NativeType<ArrayVal *>::from(args, 0);
+    Value fn = args[1];
+    size_t count = array->size();
+    Workers workers;
+
+    bool parallel = runOnWorkers(count, fn, workers, [&](Worker &worker, size_t begin, size_t end)
+                         {
+                             Value partial = array->get(begin);
+                             for (size_t i = begin + 1; i < end; i++)
+                             {
+                                 Value pair[] = {partial, array->get(i)};
+                                 partial = worker.vm.call(fn, NativeArgs{pair, 2});
+                             }
+                             worker.partials.emplace_back(begin, worker.keep(partial));
+                         });
+
+    // What is left to fold in order: the workers' results, or else the
+    // elements themselves.
+    Transfer transfer(heap);
+    std::vector<Value> values;
+    if (parallel)
+    {
+        std::vector<std::pair<size_t, Value>> partials;
+        for (const std::unique_ptr<Worker> &worker : workers)
+        {
+            if (worker)
+            {
+                partials.insert(partials.end(), worker->partials.begin(), worker->partials.end());
+            }
+        }
+        std::sort(partials.begin(), partials.end(), [](const auto &a, const auto &b)
+                  { return a.first < b.first; });
+        for (const auto &partial : partials)
+        {
+            values.push_back(transfer(partial.second));
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            values.push_back(array->get(i));
+        }
+    }
+
+    size_t first = 0;
+    Value accumulator = args.size() > 2 ? args[2] : values.empty() ? Value::null() : values[first++];
+    for (size_t i = first; i < values.size(); i++)
+    {
+        Value pair[] = {accumulator, values[i]};
+        accumulator = call_value(fn, NativeArgs{pair, 2});
+    }
+    return accumulator;
+}
+
+// A count, or an array holding the start and end.
+static std::pair<int64_t, int64_t> indexRange(Value range)
+{
+    auto index = [](Value value)
+    {
+        if (!value.isNumber() || value.asNumber() != std::floor(value.asNumber()) || std::fabs(value.asNumber()) > 9007199254740992.0)
+        {
+            throw std::runtime_error("parallelFor expects a count or a [start, end] range of integers");
+        }
+        return static_cast<int64_t>(value.asNumber());
+    };
+
+    if (range.type() == ValueType::Array && range.as<ArrayVal>()->size() == 2)
+    {
+        ArrayVal *bounds = range.as<ArrayVal>();
+        return {index(bounds->get(0)), index(bounds->get(1))};
+    }
+    return {0, index(range)};
+}
+
+void parallelFor(Value range, Value fn)
+{
+    auto [start, end] = indexRange(range);
+    size_t count = end > start ? static_cast<size_t>(end - start) : 0;
+    Workers workers;
+
+    bool parallel = runOnWorkers(count, fn, workers, [&](Worker &worker, size_t begin, size_t end)
+                         {
+                             for (size_t i = begin; i < end; i++)
+                             {
+                                 Value index = Value::integer(start + static_cast<int64_t>(i));
+                                 worker.shared.index = start + static_cast<int64_t>(i);
+                                 worker.vm.call(fn, NativeArgs{&index, 1});
+                             }
+                         });
+
+    if (!parallel)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            Value index = Value::integer(start + static_cast<int64_t>(i));
+            call_value(fn, NativeArgs{&index, 1});
+        }
+    }
+}
@@ -0,0 +1,110 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include "Values.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Threads the parallel builtins run on, the caller's included, or 0 for
+// one per hardware thread; --threads sets it. Read when the pool is first
+// used.
+extern size_t parallelThreads;
+
+// A fixed set of threads that runs one loop over an index range at a
+// time, with the calling thread joining in as worker 0. The range starts
+// out whole on the caller's deque. Whoever takes a range larger than the
+// grain splits it, keeps the lower half and pushes the upper half back on
+// its own deque, which idle workers steal from at the other end: big
+// pieces spread out first, and each worker mostly walks contiguous indices.
+class WorkPool
+{
+public:
+    using Body = std::function<void(size_t worker, size_t begin, size_t end)>;
+
+private:
+    struct Range
+    {
+        size_t begin;
+        size_t end;
+    };
+
+    struct Deque
+    {
+        std::mutex mutex;
+        std::deque<Range> ranges;
+    };
+
+    std::vector<std::unique_ptr<Deque>> deques; // one per worker
+    std::vector<std::thread> threads;
+
+    std::mutex busy; // held by the loop in progress
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    uint64_t generation = 0;
+    size_t running = 0; // threads yet to leave the current loop
+    bool stopping = false;
+
+    const Body *body = nullptr;
+    size_t grain = 1;
+    std::atomic<size_t> remaining{0};
+    std::atomic<bool> failed{false};
+    std::exception_ptr error;
+
+    void threadMain(size_t worker);
+    void work(size_t worker);
+    bool take(size_t worker, Range &range);
+
+public:
+    explicit WorkPool(size_t threads);
+    WorkPool(const WorkPool &) = delete;
+    WorkPool &operator=(const WorkPool &) = delete;
+    ~WorkPool();
+
+    // parallelThreads in all, created on first use.
+    static WorkPool &shared();
+
+    size_t workers() const { return deques.size(); }
+
+    // Runs body over [0, count) in ranges of at most grain indices, or
+    // returns false at once when another loop holds the pool. The first
+    // exception a body throws is rethrown once every worker has stopped;
+    // ranges not started by then are skipped.
+    bool run(size_t count, size_t grain, const Body &body);
+};
+
+// The parallel builtins. Each worker calls fn through a VM of its own on a
+// scratch heap (see Heap::scratch and VM), and what the calls return is
+// copied into the caller's heap afterwards. Callbacks may read anything,
+// but only write what they allocated themselves, or store numbers into
+// existing elements of packed arrays at the index they were called for;
+// those stores are made once the loop is done. A callback that tries
+// anything else, calls print, reads another element of an array the loop
+// stores into, or fails makes the whole loop run again in order on the
+// caller's thread, so a loop ends the same way whatever the number of
+// threads. Loops also run
+// in order under the tree-walker, inside another parallel loop, and while
+// another isolate holds the pool.
+//
+// parallelMap(array, fn) calls fn(element, index) for each element and
+// returns the results as a new array. parallelReduce(array, fn, initial)
+// folds the elements with fn(accumulator, element), which must be
+// associative: each worker folds the ranges it takes, and the results are
+// folded in index order onto initial, or onto the first element without
+// one. parallelFor(range, fn) calls fn(index) for each index of a count or
+// a [start, end] pair.
+ArrayVal *parallelMap(ArrayVal *array, Value fn);
+Value parallelReduce(NativeArgs args);
+void parallelFor(Value range, Value fn);
+
+#endif // PARALLEL_H
@@ -0,0 +1,177 @@
+#include "Profiler.h"
+#include "VM.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <ostream>
+#include <set>
+
+Profiler *Profiler::current = nullptr;
+
+Profiler::Profiler(std::string path, unsigned hz)
+    : path(std::move(path)), hz(std::max(1u, hz)), script(intern("<script>"))
+{
+}
+
+Profiler::~Profiler()
+{
+    stop();
+}
+
+void Profiler::start()
+{
+    current = this;
+    running = true;
+
+    sampler = std::thread([this]()
+                          {
+                              auto period = std::chrono::nanoseconds(1000000000 / hz);
+                              auto next = std::chrono::steady_clock::now() + period;
+                              while (running.load(std::memory_order_relaxed))
+                              {
+                                  std::this_thread::sleep_until(next);
+                                  next += period;
+                                  ticks.fetch_add(1, std::memory_order_relaxed);
+                              } });
+}
+
+void Profiler::stop()
+{
+    if (current == this)
+    {
+        current = nullptr;
+    }
+    running = false;
+    if (sampler.joinable())
+    {
+        sampler.join();
+    }
+}
+
+void Profiler::enter(const FunctionVal *function)
+{
+    calls.push_back({function->name, function->line});
+}
+
+void Profiler::leave()
+{
+    calls.pop_back();
+}
+
+void Profiler::record(std::vector<Frame> stack, uint32_t line)
+{
+    uint32_t weight = ticks.exchange(0, std::memory_order_relaxed);
+    if (weight == 0)
+    {
+        return;
+    }
+
+    stacks[{std::move(stack), line}] += weight;
+    samples += weight;
+}
+
+void Profiler::sample(const Stmt *node)
+{
+    std::vector<Frame> stack;
+    stack.reserve(calls.size() + 1);
+    stack.push_back({script, 0});
+    stack.insert(stack.end(), calls.begin(), calls.end());
+    record(std::move(stack), node->line);
+}
+
+void Profiler::sample(const std::vector<CallFrame> &frames)
+{
+    if (frames.empty())
+    {
+        return;
+    }
+
+    std::vector<Frame> stack;
+    stack.reserve(frames.size());
+    for (const CallFrame &frame : frames)
+    {
+        stack.push_back({frame.proto->name, frame.proto->line});
+    }
+
+    const CallFrame &top = frames.back();
+    record(std::move(stack), top.proto->chunk.lineAt(top.ip - top.proto->chunk.code.data()));
+}
+
+std::string Profiler::describe(const Frame &frame) const
+{
+    if (frame.line == 0)
+    {
+        return frame.function.str() + " (" + path + ")";
+    }
+    return frame.function.str() + " (" + path + ":" + std::to_string(frame.line) + ")";
+}
+
+void Profiler::report(std::ostream &table, std::ostream &folded) const
+{
+    struct Times
+    {
+        uint64_t self = 0;
+        uint64_t total = 0;
+    };
+
+    std::map<Frame, Times> functions;
+    std::map<std::pair<Frame, uint32_t>, uint64_t> lines;
+
+    for (const auto &entry : stacks)
+    {
+        const std::vector<Frame> &stack = entry.first.first;
+        uint32_t line = entry.first.second;
+        uint64_t count = entry.second;
+
+        for (const Frame &frame : stack)
+        {
+            folded << describe(frame) << ";";
+        }
+        folded << path << ":" << line << " " << count << "\n";
+
+        // Recursive functions count towards their total once per sample.
+        for (const Frame &frame : std::set<Frame>(stack.begin(), stack.end()))
+        {
+            functions[frame].total += count;
+        }
+        functions[stack.back()].self += count;
+        lines[{stack.back(), line}] += count;
+    }
+
+    double msPerSample = 1000.0 / hz;
+    auto percent = [this](uint64_t count)
+    { return samples ? 100.0 * count / samples : 0.0; };
+
+    table << "Profile: " << samples << " samples at " << hz << " Hz (" << std::fixed << std::setprecision(1)
+          << samples * msPerSample << " ms)\n\n";
+
+    std::vector<std::pair<Frame, Times>> byFunction(functions.begin(), functions.end());
+    std::sort(byFunction.begin(), byFunction.end(), [](const auto &a, const auto &b)
+              { return a.second.self != b.second.self ? a.second.self > b.second.self : a.second.total > b.second.total; });
+
+    table << "  self %  total %   self ms  total ms  function\n";
+    for (const auto &entry : byFunction)
+    {
+        table << std::setw(8) << percent(entry.second.self) << std::setw(9) << percent(entry.second.total)
+              << std::setw(10) << entry.second.self * msPerSample << std::setw(10) << entry.second.total * msPerSample
+              << "  " << describe(entry.first) << "\n";
+    }
+
+    std::vector<std::pair<std::pair<Frame, uint32_t>, uint64_t>> byLine(lines.begin(), lines.end());
+    std::sort(byLine.begin(), byLine.end(), [](const auto &a, const auto &b)
+              { return a.second > b.second; });
+    if (byLine.size() > 20)
+    {
+        byLine.resize(20);
+    }
+
+    table << "\n  self %   self ms  line\n";
+    for (const auto &entry : byLine)
+    {
+        table << std::setw(8) << percent(entry.second) << std::setw(10) << entry.second * msPerSample
+              << "  " << path << ":" << entry.first.second << " in " << entry.first.first.function.str() << "\n";
+    }
+
+    table << std::defaultfloat;
+}
@@ -0,0 +1,126 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "../frontend/Ast.h"
+#include "Values.h"
+
+#include <atomic>
+#include <cstdint>
+#include <iosfwd>
+#include <map>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+struct CallFrame;
+
+// Sampling profiler for a single-threaded run. A background thread counts
+// ticks at the requested rate; the interpreters poll for them between AST
+// nodes or instructions and record their script call stack and current
+// line, so every sample sees a consistent state. Ticks that arrive while a
+// native runs are all charged to the next sample.
+//
+// report() writes collapsed stacks, one `frame;frame;line count` per line,
+// for flamegraph tools, and a table of self and total time per function
+// and of the hottest lines.
+class Profiler
+{
+private:
+    struct Frame
+    {
+        Symbol function;
+        uint32_t line; // of the declaration, 0 for the script itself
+
+        bool operator<(const Frame &other) const
+        {
+            return function.id != other.function.id ? function.id < other.function.id : line < other.line;
+        }
+        bool operator==(const Frame &other) const { return function == other.function && line == other.line; }
+    };
+
+    static Profiler *current;
+
+    std::string path;
+    unsigned hz;
+    Symbol script; // named like the VM's top-level proto
+    std::atomic<uint32_t> ticks{0};
+    std::atomic<bool> running{false};
+    std::thread sampler;
+
+    std::vector<Frame> calls; // tree-walker only; the VM has its own frames
+    std::map<std::pair<std::vector<Frame>, uint32_t>, uint64_t> stacks;
+    uint64_t samples = 0;
+
+    void record(std::vector<Frame> stack, uint32_t line);
+    std::string describe(const Frame &frame) const;
+
+public:
+    Profiler(std::string path, unsigned hz);
+    Profiler(const Profiler &) = delete;
+    Profiler &operator=(const Profiler &) = delete;
+    ~Profiler();
+
+    // Starts sampling and makes this the profiler the interpreters report to.
+    void start();
+    void stop();
+
+    static Profiler *active() { return current; }
+
+    bool due() const { return ticks.load(std::memory_order_relaxed) != 0; }
+
+    // Called by the tree-walker before each node.
+    static void poll(const Stmt *node)
+    {
+        if (current && current->due())
+        {
+            current->sample(node);
+        }
+    }
+
+    void enter(const FunctionVal *function);
+    void leave();
+    void sample(const Stmt *node);
+    // frames.back().ip must be the instruction about to run.
+    void sample(const std::vector<CallFrame> &frames);
+
+    void report(std::ostream &table, std::ostream &folded) const;
+};
+
+// One script call on the tree-walker's stack, as the profiler sees it. A
+// tail call replaces the function the frame is in rather than nesting.
+class ProfiledCall
+{
+private:
+    Profiler *profiler = Profiler::active();
+    bool entered = false;
+
+public:
+    ProfiledCall() = default;
+    ProfiledCall(const ProfiledCall &) = delete;
+    ProfiledCall &operator=(const ProfiledCall &) = delete;
+
+    ~ProfiledCall()
+    {
+        if (entered)
+        {
+            profiler->leave();
+        }
+    }
+
+    void enter(const FunctionVal *function)
+    {
+        if (!profiler)
+        {
+            return;
+        }
+        if (entered)
+        {
+            profiler->leave();
+        }
+        profiler->enter(function);
+        entered = true;
+    }
+};
+
+#endif // PROFILER_H
@@ -0,0 +1,232 @@
+#include "Repl.h"
+#include "Interpreter.h"
+
+#include <iostream>
+#include <stdexcept>
+
+static bool declaresFunction(Stmt *stmt)
+{
+    if (!stmt)
+    {
+        return false;
+    }
+
+    switch (stmt->kind)
+    {
+    case NodeType::FunctionDeclaration:
+        return true;
+    case NodeType::ForStmt:
+        return declaresFunction(static_cast<ForStmt *>(stmt)->init) || declaresFunction(static_cast<ForStmt *>(stmt)->body);
+    case NodeType::WhileStmt:
+        return declaresFunction(static_cast<WhileStmt *>(stmt)->body);
+    case NodeType::IfStmt:
+        return declaresFunction(static_cast<IfStmt *>(stmt)->thenBranch) || declaresFunction(static_cast<IfStmt *>(stmt)->elseBranch);
+    case NodeType::BlockStmt:
+        for (Stmt *inner : static_cast<BlockStmt *>(stmt)->body)
+        {
+            if (declaresFunction(inner))
+            {
+                return true;
+            }
+        }
+        return false;
+    default:
+        return false;
+    }
+}
+
+Repl::Repl(Environment *env, bool treeWalk)
+    : env(env), treeWalk(treeWalk), resolver(env)
+{
+}
+
+// Just past the quote closing a string literal that was open at pos,
+// skipping escaped characters as the Lexer does, or npos if text ends
+// first.
+static size_t closingQuote(std::string_view text, size_t pos)
+{
+    while (pos < text.size() && text[pos] != '"')
+    {
+        pos += text[pos] == '\\' && pos + 1 < text.size() ? 2 : 1;
+    }
+    return pos < text.size() ? pos + 1 : std::string_view::npos;
+}
+
+// Only the new line is lexed; the bracket depth, last token and whether a
+// string literal is still open carry over from the lines before it.
+void Repl::scan(std::string_view line)
+{
+    if (inString)
+    {
+        size_t end = closingQuote(line, 0);
+        if (end == std::string_view::npos)
+        {
+            return;
+        }
+        inString = false;
+        last = TokenType::String;
+        line.remove_prefix(end);
+    }
+
+    Lexer lexer(line);
+
+    for (Token token = lexer.next(); token.type != TokenType::EndOfFile; token = lexer.next())
+    {
+        switch (token.type)
+        {
+        case TokenType::OpenParen:
+        case TokenType::OpenBrace:
+        case TokenType::OpenBracket:
+            depth++;
+            break;
+        case TokenType::CloseParen:
+        case TokenType::CloseBrace:
+        case TokenType::CloseBracket:
+            depth--;
+            break;
+        case TokenType::String:
+            inString = closingQuote(token.value, 1) == std::string_view::npos;
+            break;
+        default:
+            break;
+        }
+        last = token.type;
+    }
+}
+
+// An entry is complete once every bracket and string literal is closed and
+// it does not end in a token that needs an operand after it.
+bool Repl::complete() const
+{
+    if (depth > 0 || inString)
+    {
+        return false;
+    }
+
+    switch (last)
+    {
+    case TokenType::Equals:
+    case TokenType::Plus:
+    case TokenType::Minus:
+    case TokenType::Star:
+    case TokenType::Slash:
+    case TokenType::Percent:
+    case TokenType::Less:
+    case TokenType::LessEqual:
+    case TokenType::Greater:
+    case TokenType::GreaterEqual:
+    case TokenType::EqualEqual:
+    case TokenType::BangEqual:
+    case TokenType::Comma:
+    case TokenType::Dot:
+    case TokenType::Colon:
+    case TokenType::Let:
+    case TokenType::Const:
+    case TokenType::Fn:
+    case TokenType::If:
+    case TokenType::Else:
+    case TokenType::For:
+    case TokenType::While:
+        return false;
+    default:
+        return true;
+    }
+}
+
+Value Repl::execute()
+{
+    std::unique_ptr<Program> program(parser.produceAST(buffer));
+    for (const std::string &diagnostic : program->diagnostics)
+    {
+        std::cerr << diagnostic << "\n";
+    }
+    optimizer.optimize(program.get());
+    resolver.resolve(program.get());
+
+    bool keep = false;
+    for (Stmt *stmt : program->body)
+    {
+        keep = keep || declaresFunction(stmt);
+    }
+
+    // Kept entries are stored before they run, so functions they declare
+    // stay valid even if the entry fails partway.
+    if (treeWalk)
+    {
+        Program *current = program.get();
+        if (keep)
+        {
+            programs.push_back(std::move(program));
+        }
+        return evaluate(current, env);
+    }
+
+    std::unique_ptr<FunctionProto> script = compiler.compile(program.get());
+    const FunctionProto *current = script.get();
+    if (keep)
+    {
+        scripts.push_back(std::move(script));
+    }
+    return vm.run(current, env);
+}
+
+bool Repl::feed(std::string_view line, std::ostream &out)
+{
+    buffer.append(line);
+    buffer += '\n';
+    scan(line);
+
+    if (last == TokenType::EndOfFile)
+    {
+        buffer.clear(); // nothing but blank lines so far
+        return true;
+    }
+    if (!complete())
+    {
+        return false;
+    }
+
+    try
+    {
+        Value result = execute();
+        if (!result.isNull())
+        {
+            out << result.toString() << "\n";
+        }
+    }
+    catch (const std::runtime_error &error)
+    {
+        std::cerr << "Error: " << error.what() << "\n";
+    }
+
+    // clear() keeps the capacity for the next entry.
+    buffer.clear();
+    depth = 0;
+    inString = false;
+    last = TokenType::EndOfFile;
+    out.flush();
+    return true;
+}
+
+void Repl::run(std::istream &in, std::ostream &out, bool interactive)
+{
+    std::string line;
+
+    while (true)
+    {
+        if (interactive)
+        {
+            out << (pending() ? "... " : "> ") << std::flush;
+        }
+        if (!std::getline(in, line))
+        {
+            break;
+        }
+        feed(line, out);
+    }
+
+    if (pending())
+    {
+        std::cerr << "Error: Unexpected end of input\n";
+    }
+}
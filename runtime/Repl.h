@@ -0,0 +1,61 @@
+#ifndef REPL_H
+#define REPL_H
+
+#include "../frontend/Parser.h"
+#include "Bytecode.h"
+#include "Compiler.h"
+#include "Environment.h"
+#include "Optimizer.h"
+#include "Resolver.h"
+#include "VM.h"
+
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Interactive session over one warm global Environment. Input is read line
+// by line; once the lines read so far form complete statements they are
+// parsed, resolved against the globals earlier entries declared and run,
+// and the result is printed. The parser, passes, VM and line buffer live
+// for the whole session, so an entry costs only its own work.
+class Repl
+{
+private:
+    Environment *env;
+    bool treeWalk;
+
+    Parser parser;
+    Optimizer optimizer;
+    Resolver resolver;
+    Compiler compiler;
+    VM vm;
+
+    std::string buffer; // lines of the entry being read
+    int depth = 0;      // brackets opened in buffer and not yet closed
+    bool inString = false; // buffer ends inside a string literal
+    TokenType last = TokenType::EndOfFile;
+
+    // Entries that declared functions stay alive as long as the functions
+    // may be called: the VM's closures point at their compiled protos, the
+    // tree-walker's at their AST.
+    std::vector<std::unique_ptr<Program>> programs;
+    std::vector<std::unique_ptr<FunctionProto>> scripts;
+
+    void scan(std::string_view line);
+    bool complete() const;
+    Value execute();
+
+public:
+    Repl(Environment *env, bool treeWalk = false);
+
+    // Appends one line of input and runs the entry once it is complete.
+    // Returns false while the entry still needs more lines.
+    bool feed(std::string_view line, std::ostream &out);
+    bool pending() const { return !buffer.empty(); }
+
+    void run(std::istream &in, std::ostream &out, bool interactive);
+};
+
+#endif // REPL_H
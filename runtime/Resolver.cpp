@@ -0,0 +1,267 @@
+#include "Resolver.h"
+
+#include <stdexcept>
+
+Resolver::Resolver(Environment *globals) : globals(globals)
+{
+}
+
+void Resolver::resolve(Program *program)
+{
+    size_t reserved = globals->size();
+
+    try
+    {
+        for (Stmt *stmt : program->body)
+        {
+            hoist(stmt);
+        }
+        for (Stmt *stmt : program->body)
+        {
+            resolve_stmt(stmt);
+        }
+    }
+    catch (...)
+    {
+        scopes.clear();
+        globals->truncate(reserved);
+        throw;
+    }
+}
+
+int Resolver::declare(Symbol name, bool constant)
+{
+    if (scopes.empty())
+    {
+        return globals->reserveVar(name, constant);
+    }
+
+    Scope &scope = scopes.back();
+    if (scope.bindings.find(name) != scope.bindings.end())
+    {
+        throw std::runtime_error("Variable already declared");
+    }
+
+    scope.bindings[name] = {scope.count, constant};
+    return scope.count++;
+}
+
+bool Resolver::lookup(Symbol name, int &depth, int &slot, bool &constant)
+{
+    for (size_t i = scopes.size(); i-- > 0;)
+    {
+        auto it = scopes[i].bindings.find(name);
+        if (it != scopes[i].bindings.end())
+        {
+            depth = static_cast<int>(scopes.size() - 1 - i);
+            slot = it->second.slot;
+            constant = it->second.constant;
+            if (depth > 0)
+            {
+                scopes[i].captured = true;
+            }
+            return true;
+        }
+    }
+
+    int global = globals->findVar(name);
+    if (global < 0)
+    {
+        return false;
+    }
+
+    depth = static_cast<int>(scopes.size());
+    slot = global;
+    constant = globals->isConstant(name);
+    return true;
+}
+
+void Resolver::bind(Symbol name, int &depth, int &slot)
+{
+    bool constant;
+    if (!lookup(name, depth, slot, constant))
+    {
+        throw std::runtime_error("Variable not found: " + name.str());
+    }
+}
+
+void Resolver::hoist(Stmt *stmt)
+{
+    if (!stmt)
+    {
+        return;
+    }
+
+    switch (stmt->kind)
+    {
+    case NodeType::VarDeclaration:
+    {
+        VarDeclaration *declaration = static_cast<VarDeclaration *>(stmt);
+        declaration->slot = declare(declaration->identifier, declaration->constant);
+        break;
+    }
+    case NodeType::FunctionDeclaration:
+    {
+        FunctionDeclaration *declaration = static_cast<FunctionDeclaration *>(stmt);
+        declaration->slot = declare(declaration->name, true);
+        break;
+    }
+    case NodeType::ForStmt:
+        hoist(static_cast<ForStmt *>(stmt)->init);
+        hoist(static_cast<ForStmt *>(stmt)->body);
+        break;
+    case NodeType::WhileStmt:
+        hoist(static_cast<WhileStmt *>(stmt)->body);
+        break;
+    case NodeType::IfStmt:
+        hoist(static_cast<IfStmt *>(stmt)->thenBranch);
+        hoist(static_cast<IfStmt *>(stmt)->elseBranch);
+        break;
+    case NodeType::BlockStmt:
+        for (Stmt *inner : static_cast<BlockStmt *>(stmt)->body)
+        {
+            hoist(inner);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void Resolver::resolve_function(FunctionDeclaration *declaration)
+{
+    scopes.emplace_back();
+
+    for (Symbol param : declaration->parameters)
+    {
+        declare(param, false);
+    }
+    for (Stmt *stmt : declaration->body)
+    {
+        hoist(stmt);
+    }
+    for (Stmt *stmt : declaration->body)
+    {
+        resolve_stmt(stmt);
+    }
+
+    declaration->localCount = scopes.back().count;
+    declaration->captured = scopes.back().captured;
+    scopes.pop_back();
+}
+
+void Resolver::resolve_stmt(Stmt *stmt)
+{
+    if (!stmt)
+    {
+        return;
+    }
+
+    switch (stmt->kind)
+    {
+    case NodeType::Identifier:
+    {
+        Identifier *ident = static_cast<Identifier *>(stmt);
+        bind(ident->symbol, ident->depth, ident->slot);
+        break;
+    }
+    case NodeType::VarDeclaration:
+        resolve_stmt(static_cast<VarDeclaration *>(stmt)->value);
+        break;
+    case NodeType::FunctionDeclaration:
+        resolve_function(static_cast<FunctionDeclaration *>(stmt));
+        break;
+    case NodeType::AssignmentExpr:
+    {
+        AssignmentExpr *node = static_cast<AssignmentExpr *>(stmt);
+        resolve_stmt(node->value);
+
+        if (node->assignee->kind != NodeType::Identifier)
+        {
+            resolve_stmt(node->assignee);
+            break;
+        }
+
+        Identifier *target = static_cast<Identifier *>(node->assignee);
+        bool constant;
+        if (!lookup(target->symbol, target->depth, target->slot, constant))
+        {
+            throw std::runtime_error("Variable not found: " + target->symbol.str());
+        }
+        if (constant)
+        {
+            throw std::runtime_error("Cannot assign to constant");
+        }
+        break;
+    }
+    case NodeType::BinaryExpr:
+        resolve_stmt(static_cast<BinaryExpr *>(stmt)->left);
+        resolve_stmt(static_cast<BinaryExpr *>(stmt)->right);
+        break;
+    case NodeType::CallExpr:
+    {
+        CallExpr *call = static_cast<CallExpr *>(stmt);
+        resolve_stmt(call->caller);
+        for (Expr *arg : call->args)
+        {
+            resolve_stmt(arg);
+        }
+        break;
+    }
+    case NodeType::MemberExpr:
+    {
+        MemberExpr *member = static_cast<MemberExpr *>(stmt);
+        resolve_stmt(member->object);
+        if (member->computed)
+        {
+            resolve_stmt(member->property);
+        }
+        break;
+    }
+    case NodeType::ObjectLiteral:
+        for (Property *prop : static_cast<ObjectLiteral *>(stmt)->properties)
+        {
+            if (prop->value)
+            {
+                resolve_stmt(prop->value);
+            }
+            else
+            {
+                bind(prop->key, prop->depth, prop->slot);
+            }
+        }
+        break;
+    case NodeType::ArrayLiteral:
+        for (Expr *element : static_cast<ArrayLiteral *>(stmt)->elements)
+        {
+            resolve_stmt(element);
+        }
+        break;
+    case NodeType::ForStmt:
+    {
+        ForStmt *loop = static_cast<ForStmt *>(stmt);
+        resolve_stmt(loop->init);
+        resolve_stmt(loop->condition);
+        resolve_stmt(loop->increment);
+        resolve_stmt(loop->body);
+        break;
+    }
+    case NodeType::WhileStmt:
+        resolve_stmt(static_cast<WhileStmt *>(stmt)->condition);
+        resolve_stmt(static_cast<WhileStmt *>(stmt)->body);
+        break;
+    case NodeType::IfStmt:
+        resolve_stmt(static_cast<IfStmt *>(stmt)->condition);
+        resolve_stmt(static_cast<IfStmt *>(stmt)->thenBranch);
+        resolve_stmt(static_cast<IfStmt *>(stmt)->elseBranch);
+        break;
+    case NodeType::BlockStmt:
+        for (Stmt *inner : static_cast<BlockStmt *>(stmt)->body)
+        {
+            resolve_stmt(inner);
+        }
+        break;
+    default:
+        break;
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include "../frontend/Ast.h"
+#include "Environment.h"
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Static pass run between the Parser and execution. It assigns every
+// declaration a slot in its function's environment and annotates every
+// identifier use with how many environments to walk up and which slot to
+// read there. Declarations are hoisted to the top of their function, so
+// functions may refer to each other regardless of order.
+//
+// The outermost scope is the global Environment itself: top-level names
+// are reserved directly in it, which lets later programs (and builtins)
+// share the same bindings.
+class Resolver
+{
+private:
+    struct Binding
+    {
+        int slot;
+        bool constant;
+    };
+
+    struct Scope
+    {
+        std::unordered_map<Symbol, Binding> bindings;
+        int count = 0;
+        bool captured = false; // a nested function uses one of the bindings
+    };
+
+    Environment *globals;
+    std::vector<Scope> scopes; // function scopes, innermost last
+
+    int declare(Symbol name, bool constant);
+    bool lookup(Symbol name, int &depth, int &slot, bool &constant);
+    void bind(Symbol name, int &depth, int &slot);
+
+    void hoist(Stmt *stmt);
+    void resolve_stmt(Stmt *stmt);
+    void resolve_function(FunctionDeclaration *declaration);
+
+public:
+    Resolver(Environment *globals);
+
+    void resolve(Program *program);
+};
+
+#endif // RESOLVER_H
@@ -0,0 +1,107 @@
+#include "Runner.h"
+#include "../frontend/Source.h"
+#include "Isolate.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+namespace
+{
+    struct Result
+    {
+        std::vector<std::string> diagnostics; // from parsing
+        std::string output;
+        std::string error;
+        bool done = false;
+    };
+}
+
+size_t runScripts(const std::vector<std::string> &paths, size_t jobs, bool treeWalk, const AstCache *disk)
+{
+    if (jobs == 0)
+    {
+        jobs = std::max(1u, std::thread::hardware_concurrency());
+    }
+    jobs = std::min(jobs, paths.size());
+
+    CodeCache cache(disk);
+    std::vector<Result> results(paths.size());
+    std::atomic<size_t> next{0};
+    std::mutex mutex;
+    std::condition_variable finished;
+
+    auto worker = [&]()
+    {
+        for (size_t i = next++; i < paths.size(); i = next++)
+        {
+            Result result;
+
+            try
+            {
+                Isolate isolate;
+                try
+                {
+                    SourceFile source(paths[i]);
+                    std::shared_ptr<const SharedProgram> shared = cache.get(source.text(), isolate.environment());
+                    result.diagnostics = shared->program->diagnostics;
+                    isolate.run(*shared, treeWalk);
+                }
+                catch (const std::runtime_error &error)
+                {
+                    result.error = error.what();
+                }
+                result.output = isolate.printed();
+            }
+            catch (const std::exception &error)
+            {
+                result.error = error.what();
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            results[i] = std::move(result);
+            results[i].done = true;
+            finished.notify_all();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < jobs; i++)
+    {
+        threads.emplace_back(worker);
+    }
+
+    size_t failures = 0;
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+        Result result;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            finished.wait(lock, [&]()
+                          { return results[i].done; });
+            result = std::move(results[i]);
+        }
+
+        for (const std::string &diagnostic : result.diagnostics)
+        {
+            std::cerr << paths[i] << ": " << diagnostic << "\n";
+        }
+        std::cout << result.output << std::flush;
+        if (!result.error.empty())
+        {
+            std::cerr << paths[i] << ": Error: " << result.error << "\n";
+            failures++;
+        }
+    }
+
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+
+    return failures;
+}
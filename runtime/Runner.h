@@ -0,0 +1,16 @@
+#ifndef RUNNER_H
+#define RUNNER_H
+
+#include "../frontend/AstCache.h"
+
+#include <string>
+#include <vector>
+
+// Runs every script in its own Isolate on a pool of `jobs` threads (all
+// cores when 0), sharing parsed programs between identical sources. Each
+// script's output is written in argument order as soon as it and every
+// script before it have finished; errors go to stderr prefixed with the
+// script's path. Returns the number of scripts that failed.
+size_t runScripts(const std::vector<std::string> &paths, size_t jobs, bool treeWalk, const AstCache *disk = nullptr);
+
+#endif // RUNNER_H
@@ -0,0 +1,71 @@
+#include "Shape.h"
+
+Shape::Shape()
+{
+}
+
+Shape::Shape(const Shape *parent, Symbol key) : parent(parent), key(key), count(parent->count + 1)
+{
+}
+
+Shape::~Shape()
+{
+    delete index.load(std::memory_order_relaxed);
+}
+
+// Threads that race to build the table keep whichever was published first.
+const Shape::Index &Shape::buildIndex() const
+{
+    Index *built = new Index();
+    built->reserve(count);
+    for (const Shape *shape = this; shape->count > 0; shape = shape->parent)
+    {
+        built->emplace(shape->key, shape->count - 1);
+    }
+
+    const Index *expected = nullptr;
+    if (!index.compare_exchange_strong(expected, built, std::memory_order_acq_rel))
+    {
+        delete built;
+        return *expected;
+    }
+    return *built;
+}
+
+Shape *Shape::withProperty(Symbol key)
+{
+    auto it = transitions.find(key);
+    if (it != transitions.end())
+    {
+        return it->second.get();
+    }
+
+    Shape *shape = new Shape(this, key);
+    transitions.emplace(key, std::unique_ptr<Shape>(shape));
+    return shape;
+}
+
+std::vector<Symbol> Shape::keys() const
+{
+    std::vector<Symbol> keys(count);
+    for (const Shape *shape = this; shape->count > 0; shape = shape->parent)
+    {
+        keys[shape->count - 1] = shape->key;
+    }
+    return keys;
+}
+
+PropertyTable::PropertyTable(std::vector<Symbol> keys) : keys(std::move(keys))
+{
+    index.reserve(this->keys.size());
+    for (size_t i = 0; i < this->keys.size(); i++)
+    {
+        index.emplace(this->keys[i], static_cast<uint32_t>(i));
+    }
+}
+
+void PropertyTable::add(Symbol key)
+{
+    index.emplace(key, static_cast<uint32_t>(keys.size()));
+    keys.push_back(key);
+}
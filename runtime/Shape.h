@@ -0,0 +1,128 @@
+#ifndef SHAPE_H
+#define SHAPE_H
+
+#include "../frontend/Symbol.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// Hidden class describing the layout of an ObjectVal: which keys it has
+// and the slot each one lives in. Shapes form a transition tree rooted at
+// the empty shape, so objects that gain the same keys in the same order
+// share one Shape and can be accessed through the same inline cache entry.
+// A shape stores only the key it adds to its parent; larger shapes build a
+// lookup table the first time they are searched. Shapes are owned by their
+// parent and live as long as the Heap.
+class Shape
+{
+private:
+    static constexpr uint32_t LinearLimit = 8;
+
+    using Index = std::unordered_map<Symbol, uint32_t>;
+
+    const Shape *parent = nullptr;
+    Symbol key; // in slot count - 1
+    uint32_t count = 0;
+    // Published once built, since workers search the owner's shapes too.
+    mutable std::atomic<const Index *> index{nullptr};
+    std::unordered_map<Symbol, std::unique_ptr<Shape>> transitions;
+
+    Shape(const Shape *parent, Symbol key);
+    const Index &buildIndex() const;
+
+public:
+    // Objects that would grow past this many keys keep their own
+    // PropertyTable instead: a shape that large is rarely shared.
+    static constexpr uint32_t DictionaryLimit = 64;
+
+    Shape();
+    Shape(const Shape &) = delete;
+    Shape &operator=(const Shape &) = delete;
+    ~Shape();
+
+    int lookup(Symbol key) const
+    {
+        if (count <= LinearLimit)
+        {
+            for (const Shape *shape = this; shape->count > 0; shape = shape->parent)
+            {
+                if (shape->key == key)
+                {
+                    return static_cast<int>(shape->count - 1);
+                }
+            }
+            return -1;
+        }
+
+        const Index *table = index.load(std::memory_order_acquire);
+        if (!table)
+        {
+            table = &buildIndex();
+        }
+        auto it = table->find(key);
+        return it == table->end() ? -1 : static_cast<int>(it->second);
+    }
+
+    Shape *withProperty(Symbol key);
+
+    uint32_t slotCount() const { return count; }
+    // In slot order.
+    std::vector<Symbol> keys() const;
+};
+
+// The keys of an object that has outgrown shapes, in slot order. Property
+// caches never match such an object, since it has no shape.
+struct PropertyTable
+{
+    std::vector<Symbol> keys;
+    std::unordered_map<Symbol, uint32_t> index;
+
+    explicit PropertyTable(std::vector<Symbol> keys);
+
+    int lookup(Symbol key) const
+    {
+        auto it = index.find(key);
+        return it == index.end() ? -1 : static_cast<int>(it->second);
+    }
+
+    void add(Symbol key);
+};
+
+// Monomorphic/polymorphic cache for one property access site. Once more
+// shapes than Ways have been seen the site is megamorphic and stops
+// recording new ones.
+struct PropertyCache
+{
+    static constexpr int Ways = 4;
+
+    const Shape *shapes[Ways] = {};
+    uint32_t slots[Ways] = {};
+    uint8_t count = 0;
+
+    int find(const Shape *shape) const
+    {
+        for (int i = 0; i < count; i++)
+        {
+            if (shapes[i] == shape)
+            {
+                return static_cast<int>(slots[i]);
+            }
+        }
+        return -1;
+    }
+
+    void record(const Shape *shape, uint32_t slot)
+    {
+        if (count < Ways)
+        {
+            shapes[count] = shape;
+            slots[count] = slot;
+            count++;
+        }
+    }
+};
+
+#endif // SHAPE_H
@@ -0,0 +1,160 @@
+#include "Stats.h"
+
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+thread_local ExecutionStats executionStats;
+
+size_t peakRssKb()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return static_cast<size_t>(usage.ru_maxrss);
+}
+
+void writeStats(std::ostream &out, Heap &heap, double elapsedMs, bool countsNodes)
+{
+    const GcStats &stats = heap.getStats();
+
+    out << "{\"elapsedMs\": " << elapsedMs
+        << ", \"peakRssKb\": " << peakRssKb()
+        << ", \"calls\": " << executionStats.calls
+        << ", \"nodesEvaluated\": ";
+    if (countsNodes)
+    {
+        out << executionStats.nodesEvaluated;
+    }
+    else
+    {
+        out << "null";
+    }
+    out << ", \"minorCollections\": " << stats.minorCollections
+        << ", \"majorCollections\": " << stats.majorCollections
+        << ", \"totalPauseMs\": " << stats.totalPauseMs
+        << ", \"maxPauseMs\": " << stats.maxPauseMs
+        << ", \"liveObjects\": " << stats.liveObjects
+        << ", \"liveBytes\": " << stats.liveBytes
+        << ", \"bytesAllocated\": " << stats.bytesAllocated
+        << ", \"types\": {";
+
+    const char *separator = "";
+    for (size_t kind = 0; kind < HeapKinds; kind++)
+    {
+        const char *name = heapKindName(kind);
+        if (!name)
+        {
+            continue;
+        }
+
+        const KindStats &counts = stats.kinds[kind];
+        out << separator << "\"" << name << "\": {\"allocations\": " << counts.allocations
+            << ", \"bytesAllocated\": " << counts.bytesAllocated
+            << ", \"liveObjects\": " << counts.liveObjects
+            << ", \"liveBytes\": " << counts.liveBytes << "}";
+        separator = ", ";
+    }
+
+    out << "}}\n";
+}
+
+static int connectUnix(const std::string &path)
+{
+    sockaddr_un address{};
+    if (path.size() >= sizeof(address.sun_path))
+    {
+        return -1;
+    }
+    address.sun_family = AF_UNIX;
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+StatsReporter::StatsReporter(Heap &heap, const std::string &destination, unsigned intervalMs, bool countsNodes)
+    : heap(heap), countsNodes(countsNodes), start(std::chrono::steady_clock::now())
+{
+    if (!destination.empty())
+    {
+        socket = destination.compare(0, 5, "unix:") == 0;
+        fd = socket ? connectUnix(destination.substr(5)) : open(destination.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+        {
+            throw std::runtime_error("Could not open stats destination " + destination);
+        }
+    }
+
+    if (intervalMs > 0)
+    {
+        heap.onSafePoint = [this]()
+        { snapshot(); };
+
+        timer = std::thread([this, intervalMs]()
+                            {
+                                auto period = std::chrono::milliseconds(intervalMs);
+                                auto next = std::chrono::steady_clock::now() + period;
+                                std::unique_lock<std::mutex> lock(mutex);
+                                while (!wake.wait_until(lock, next, [this]()
+                                                        { return stopping; }))
+                                {
+                                    next += period;
+                                    this->heap.requestSafePoint();
+                                } });
+    }
+}
+
+StatsReporter::~StatsReporter()
+{
+    if (timer.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        timer.join();
+    }
+    heap.onSafePoint = nullptr;
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+// A reader that goes away only loses the snapshots, never the script:
+// write errors are ignored, and a closed socket raises no SIGPIPE.
+void StatsReporter::snapshot()
+{
+    std::ostringstream out;
+    writeStats(out, heap, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count(), countsNodes);
+    const std::string line = out.str();
+
+    if (fd < 0)
+    {
+        std::cerr << line << std::flush;
+        return;
+    }
+
+    for (size_t written = 0; written < line.size();)
+    {
+        ssize_t n = socket ? send(fd, line.data() + written, line.size() - written, MSG_NOSIGNAL)
+                           : write(fd, line.data() + written, line.size() - written);
+        if (n <= 0)
+        {
+            return;
+        }
+        written += static_cast<size_t>(n);
+    }
+}
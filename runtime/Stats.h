@@ -0,0 +1,58 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "Heap.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+
+// Work done by the interpreters on this thread. Only a single script run
+// reports it, so it is not kept per isolate. Left trivial, and so zeroed
+// statically, so other files reach it without a thread_local init check.
+struct ExecutionStats
+{
+    uint64_t calls;          // of script functions and natives, tail calls included
+    uint64_t nodesEvaluated; // by the tree-walker only
+};
+
+extern thread_local ExecutionStats executionStats;
+
+size_t peakRssKb();
+
+// One snapshot of the heap's allocation counters, executionStats and the
+// peak RSS, as a single line of JSON. nodesEvaluated is null unless the
+// tree-walker ran the script, since nothing else counts it.
+void writeStats(std::ostream &out, Heap &heap, double elapsedMs, bool countsNodes);
+
+// Writes snapshots for --stats to stderr, a file, or a Unix socket given
+// as unix:PATH. With an interval, a timer thread also asks the heap for a
+// snapshot that often, which is written at the heap's next safe point.
+class StatsReporter
+{
+private:
+    Heap &heap;
+    bool countsNodes;
+    std::chrono::steady_clock::time_point start;
+    int fd = -1; // -1 writes to stderr
+    bool socket = false;
+
+    std::thread timer;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+
+public:
+    StatsReporter(Heap &heap, const std::string &destination, unsigned intervalMs, bool countsNodes);
+    StatsReporter(const StatsReporter &) = delete;
+    StatsReporter &operator=(const StatsReporter &) = delete;
+    ~StatsReporter();
+
+    void snapshot();
+};
+
+#endif // STATS_H
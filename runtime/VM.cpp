@@ -0,0 +1,802 @@
+#include "VM.h"
+
+#include "Interpreter.h"
+#include "Profiler.h"
+#include "Stats.h"
+
+#include <algorithm>
+#include <cmath>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+
+// Slots are always written before they are read, so the stack is left
+// uninitialised: a VM costs nothing up front beyond the mapping, which
+// matters when every isolate creates one.
+VM::VM(Heap &heap) : heap(heap)
+{
+    void *memory = mmap(nullptr, StackSize * sizeof(Value), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        throw std::bad_alloc();
+    }
+
+    stack = static_cast<Value *>(memory);
+    sp = stack;
+    heap.addRootSource(this);
+}
+
+VM::VM(Heap &heap, const VM &owner, SharedAccesses &shared) : VM(heap)
+{
+    globals = owner.globals;
+    useJit = owner.useJit;
+    worker = true;
+    this->shared = &shared;
+}
+
+VM::~VM()
+{
+    heap.removeRootSource(this);
+    munmap(stack, StackSize * sizeof(Value));
+}
+
+void VM::traceRoots(Heap &heap)
+{
+    for (Value *slot = stack; slot < sp; slot++)
+    {
+        heap.mark(*slot);
+    }
+    for (const CallFrame &frame : frames)
+    {
+        heap.mark(frame.env);
+    }
+}
+
+static thread_local VM *active = nullptr;
+
+VM *VM::current()
+{
+    return active;
+}
+
+Value VM::run(const FunctionProto *script, Environment *env)
+{
+    size_t entryDepth = frames.size();
+    Value *entrySp = sp;
+    Environment *entryGlobals = globals;
+    VM *entryActive = active;
+
+    bool entryUseJit = useJit;
+
+    globals = env;
+    useJit = jitEnabled && !Profiler::active();
+    active = this;
+
+    frames.push_back({script, script->chunk.code.data(), env, sp});
+
+    try
+    {
+        Value result = Profiler::active() ? execute<true>(entryDepth) : execute<false>(entryDepth);
+        globals = entryGlobals;
+        useJit = entryUseJit;
+        active = entryActive;
+        return result;
+    }
+    catch (...)
+    {
+        frames.resize(entryDepth);
+        sp = entrySp;
+        globals = entryGlobals;
+        useJit = entryUseJit;
+        active = entryActive;
+        throw;
+    }
+}
+
+// Pushes the call as the Call instruction would and runs it to completion.
+// Workers never sample for the profiler, which belongs to the owner's
+// thread.
+Value VM::call(Value callee, NativeArgs args)
+{
+    size_t entryDepth = frames.size();
+    Value *entrySp = sp;
+    VM *entryActive = active;
+    active = this;
+
+    uint8_t argc = static_cast<uint8_t>(std::min<size_t>(args.size(), UINT8_MAX));
+    sp = std::copy(args.begin(), args.begin() + argc, sp);
+    *sp++ = callee;
+
+    try
+    {
+        callValue(callee, argc);
+        Value result = frames.size() == entryDepth ? sp[-1]
+                       : worker || !Profiler::active() ? execute<false>(entryDepth)
+                                                       : execute<true>(entryDepth);
+        sp = entrySp;
+        active = entryActive;
+        return result;
+    }
+    catch (...)
+    {
+        frames.resize(entryDepth);
+        sp = entrySp;
+        active = entryActive;
+        throw;
+    }
+}
+
+void VM::warmUp(const FunctionProto *proto)
+{
+    if (useJit && !proto->jit && proto->calls < JitCode::Threshold)
+    {
+        proto->calls = JitCode::Threshold;
+        proto->jit = JitCode::compile(*proto);
+    }
+}
+
+// The environment depth levels up from env, which a worker may only write
+// when it allocated it.
+Environment *VM::writableEnv(Environment *env, int depth) const
+{
+    Environment *target = env->ancestor(depth);
+    if (worker && target->old)
+    {
+        throw SharedWrite();
+    }
+    return target;
+}
+
+// An element read by a worker from an array it does not own, which sees
+// the call's own stores.
+Value VM::loadShared(ArrayVal *array, Value key)
+{
+    if (key.isNumber() && key.asNumber() == static_cast<double>(shared->index))
+    {
+        // The stores of the current call come last.
+        for (auto it = shared->stores.rbegin(); it != shared->stores.rend() && it->index == shared->index; ++it)
+        {
+            if (it->array == array)
+            {
+                return Value::number(it->value);
+            }
+        }
+    }
+    else
+    {
+        shared->read(array);
+    }
+    return get_index(Value::object(array), key);
+}
+
+// An element store by a worker into an array it does not own: only a
+// number replacing the element of a packed array at the current call's
+// index, which changes nothing else about the array.
+void VM::storeShared(Value object, Value key, Value value)
+{
+    if (object.type() != ValueType::Array || !key.isNumber() || !value.isNumber())
+    {
+        throw SharedWrite();
+    }
+
+    ArrayVal *array = object.as<ArrayVal>();
+    double index = key.asNumber();
+    if (!array->packed || index != static_cast<double>(shared->index) || !(index >= 0 && index < static_cast<double>(array->size())))
+    {
+        throw SharedWrite();
+    }
+    shared->stores.push_back({array, shared->index, value.asNumber()});
+}
+
+// Moves the arguments of a call into the locals of a frame starting at
+// base, which is args itself for a new frame and lies below it when a tail
+// call reuses the current one. Returns the environment for the frame.
+Environment *VM::enterFunction(FunctionVal *function, Value *args, uint8_t argc, Value *base)
+{
+    const FunctionProto *proto = function->proto;
+
+    if (!proto)
+    {
+        throw std::runtime_error("Function was not compiled for the VM: " + function->name.str());
+    }
+    if (std::max(sp, base + proto->localCount) + 1024 > stack + StackSize)
+    {
+        throw std::runtime_error("Stack overflow");
+    }
+
+    executionStats.calls++;
+    heap.poll();
+    size_t params = std::min(static_cast<size_t>(argc), proto->parameters.size());
+
+    if (proto->captured)
+    {
+        // The arguments stay rooted on the stack until the allocation is done.
+        Environment *scope = heap.allocate<Environment>(function->declarationEnv, proto->localCount);
+        for (size_t i = 0; i < params; i++)
+        {
+            scope->set(static_cast<int>(i), args[i]);
+        }
+        sp = base;
+        return scope;
+    }
+
+    std::copy(args, args + params, base);
+    std::fill(base + params, base + proto->localCount, Value::null());
+    sp = base + proto->localCount;
+    return function->declarationEnv;
+}
+
+// Leaves the callee's result in place of the callee and its arguments for
+// natives; for script functions, replaces them with a fresh frame.
+void VM::callValue(Value callee, uint8_t argc)
+{
+    Value *args = sp - 1 - argc;
+
+    if (callee.type() == ValueType::NativeFn)
+    {
+        // Natives with effects outside the heap stay on the owner's thread.
+        if (worker && !callee.as<NativeFunctionVal>()->parallel)
+        {
+            throw SharedWrite();
+        }
+        // Natives read any element of the arrays they are given.
+        for (Value *arg = args; worker && arg < args + argc; arg++)
+        {
+            if (arg->type() == ValueType::Array && arg->asHeap()->old)
+            {
+                shared->read(arg->as<ArrayVal>());
+            }
+        }
+        executionStats.calls++;
+        heap.poll();
+        Value result = callee.as<NativeFunctionVal>()->call(NativeArgs{args, argc});
+        sp = args;
+        *sp++ = result;
+        return;
+    }
+
+    if (callee.type() == ValueType::Function)
+    {
+        if (frames.size() > maxCallDepth)
+        {
+            throw std::runtime_error("Maximum call depth exceeded (" + std::to_string(maxCallDepth) + ")");
+        }
+        FunctionVal *function = callee.as<FunctionVal>();
+        Environment *scope = enterFunction(function, args, argc, args);
+        const uint8_t *ip = function->proto->chunk.code.data();
+        if (useJit && runCompiled(function->proto, args, ip))
+        {
+            sp = args + 1;
+            return;
+        }
+        frames.push_back({function->proto, ip, scope, args});
+        return;
+    }
+
+    throw std::runtime_error("Attempted to call a non-function");
+}
+
+// Replaces the current frame with a call to callee, so tail recursion needs
+// no extra frames. Returns false for natives, whose result is left on the
+// stack for the caller to return.
+bool VM::tailCall(Value callee, uint8_t argc)
+{
+    if (callee.type() != ValueType::Function)
+    {
+        callValue(callee, argc);
+        return false;
+    }
+
+    FunctionVal *function = callee.as<FunctionVal>();
+    CallFrame &frame = frames.back();
+
+    frame.env = enterFunction(function, sp - 1 - argc, argc, frame.base);
+    const uint8_t *ip = function->proto->chunk.code.data();
+    if (useJit && runCompiled(function->proto, frame.base, ip))
+    {
+        sp = frame.base + 1;
+        return false;
+    }
+    frame.proto = function->proto;
+    frame.ip = ip;
+    return true;
+}
+
+// Runs the machine code for proto on a frame just entered at base,
+// compiling it first once the function has become hot. Returns true when
+// the call finished, with its result in base[0]; otherwise the frame must
+// be interpreted from ip, which a deoptimization moves past the code that
+// already ran.
+bool VM::runCompiled(const FunctionProto *proto, Value *base, const uint8_t *&ip)
+{
+    if (!proto->jit)
+    {
+        // Counts on past the threshold, so a function that cannot be
+        // compiled is only tried once.
+        if (worker || ++proto->calls != JitCode::Threshold)
+        {
+            return false;
+        }
+        proto->jit = JitCode::compile(*proto);
+        if (!proto->jit)
+        {
+            return false;
+        }
+    }
+
+    const JitCode::Exit *exit = proto->jit->run(base);
+    if (!exit)
+    {
+        return true;
+    }
+
+    ip += exit->offset;
+    sp = base + exit->stackSize;
+    if (!worker && ++proto->jit->deopts == JitCode::MaxDeopts)
+    {
+        proto->jit.reset();
+    }
+    return false;
+}
+
+// Instantiated twice so that a run without the profiler pays nothing for
+// it: only execute<true> checks for a due sample before each instruction.
+template <bool Profiling>
+Value VM::execute(size_t entryDepth)
+{
+    CallFrame *frame = &frames.back();
+    const uint8_t *ip = frame->ip;
+    const Chunk *chunk = &frame->proto->chunk;
+    Value *locals = frame->base;
+    [[maybe_unused]] Profiler *profiler = Profiler::active();
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, static_cast<uint16_t>(ip[-2] | (ip[-1] << 8)))
+#define READ_INT() (ip += 4, static_cast<uint32_t>(ip[-4] | (ip[-3] << 8) | (ip[-2] << 16) | (static_cast<uint32_t>(ip[-1]) << 24)))
+#define PUSH(value) (*sp++ = (value))
+#define POP() (*--sp)
+#define PEEK(distance) (sp[-1 - (distance)])
+#define LOAD_FRAME()                  \
+    do                                \
+    {                                 \
+        frame = &frames.back();       \
+        ip = frame->ip;               \
+        chunk = &frame->proto->chunk; \
+        locals = frame->base;         \
+    } while (0)
+#define POLL_PROFILER()               \
+    if constexpr (Profiling)          \
+    {                                 \
+        if (profiler->due())          \
+        {                             \
+            frame->ip = ip;           \
+            profiler->sample(frames); \
+        }                             \
+    }
+
+    // Not wrapped in do/while: DISPATCH may be `continue` in the switch
+    // fallback, which must reach the dispatch loop.
+#define RETURN_FROM_FRAME()              \
+    {                                    \
+        Value result = POP();            \
+        sp = frame->base;                \
+        frames.pop_back();               \
+        if (frames.size() == entryDepth) \
+        {                                \
+            return result;               \
+        }                                \
+        PUSH(result);                    \
+        LOAD_FRAME();                    \
+        DISPATCH();                      \
+    }
+
+#define NUMERIC_OP(op)                                        \
+    do                                                        \
+    {                                                         \
+        Value rhs = POP();                                    \
+        PEEK(0) = eval_numeric_binary_expr(PEEK(0), rhs, op); \
+    } while (0)
+
+#define COMPARE(op)                                                      \
+    do                                                                   \
+    {                                                                    \
+        Value rhs = POP();                                               \
+        PEEK(0) = Value::boolean(eval_comparison(PEEK(0), rhs, op));     \
+    } while (0)
+
+    // The fused form of a comparison followed by JumpIfFalse.
+#define COMPARE_AND_BRANCH(op)                        \
+    do                                                \
+    {                                                 \
+        uint32_t target = READ_INT();                 \
+        Value rhs = POP();                            \
+        Value lhs = POP();                            \
+        if (!eval_comparison(lhs, rhs, op))           \
+        {                                             \
+            ip = chunk->code.data() + target;         \
+        }                                             \
+    } while (0)
+
+    // GCC and Clang support taking label addresses, which lets every
+    // handler jump straight to the next one instead of through a switch.
+#if defined(__GNUC__)
+#define OPCODE_LABEL(name) &&L_##name,
+    static void *dispatchTable[] = {OPCODES(OPCODE_LABEL)};
+#undef OPCODE_LABEL
+#define DISPATCH()                          \
+    {                                       \
+        POLL_PROFILER()                     \
+        goto *dispatchTable[READ_BYTE()];   \
+    }
+#define TARGET(name) L_##name:
+    DISPATCH();
+#else
+#define DISPATCH() continue
+#define TARGET(name) case OpCode::name:
+    for (;;)
+    {
+        POLL_PROFILER()
+        switch (static_cast<OpCode>(READ_BYTE()))
+        {
+#endif
+
+    TARGET(Constant)
+    {
+        PUSH(chunk->constants[READ_SHORT()]);
+        DISPATCH();
+    }
+    TARGET(ConstantWide)
+    {
+        PUSH(chunk->constants[READ_INT()]);
+        DISPATCH();
+    }
+    TARGET(String)
+    {
+        PUSH(Value::object(StringVal::literal(heap, chunk->strings[READ_INT()])));
+        DISPATCH();
+    }
+    TARGET(Null)
+    {
+        PUSH(Value::null());
+        DISPATCH();
+    }
+    TARGET(Pop)
+    {
+        sp--;
+        DISPATCH();
+    }
+    TARGET(GetLocal)
+    {
+        PUSH(locals[READ_SHORT()]);
+        DISPATCH();
+    }
+    TARGET(SetLocal)
+    {
+        locals[READ_SHORT()] = PEEK(0);
+        DISPATCH();
+    }
+    TARGET(GetGlobal)
+    {
+        PUSH(globals->get(READ_INT()));
+        DISPATCH();
+    }
+    TARGET(SetGlobal)
+    {
+        if (worker)
+        {
+            throw SharedWrite();
+        }
+        globals->set(READ_INT(), PEEK(0));
+        DISPATCH();
+    }
+    TARGET(GetEnv)
+    {
+        int depth = READ_BYTE();
+        PUSH(frame->env->lookup(depth, READ_SHORT()));
+        DISPATCH();
+    }
+    TARGET(SetEnv)
+    {
+        int depth = READ_BYTE();
+        writableEnv(frame->env, depth)->set(READ_SHORT(), PEEK(0));
+        DISPATCH();
+    }
+    TARGET(Closure)
+    {
+        const FunctionProto *proto = chunk->functions[READ_SHORT()].get();
+        FunctionVal *function = heap.allocate<FunctionVal>(std::vector<Stmt *>(), proto->name, std::vector<Symbol>(), frame->env);
+        function->localCount = proto->localCount;
+        function->line = proto->line;
+        function->proto = proto;
+        PUSH(Value::object(function));
+        DISPATCH();
+    }
+    TARGET(NewObject)
+    {
+        ObjectTemplate &literal = chunk->objectTemplates[READ_SHORT()];
+        if (literal.keys.size() > Shape::DictionaryLimit)
+        {
+            PUSH(Value::object(ObjectVal::create(heap, literal.keys)));
+            DISPATCH();
+        }
+        // Shapes belong to a heap, so a worker resolves its own.
+        Shape *&shape = worker ? workerShapes[&literal] : literal.shape;
+        if (!shape)
+        {
+            shape = heap.emptyShape();
+            for (Symbol key : literal.keys)
+            {
+                shape = shape->withProperty(key);
+            }
+        }
+        PUSH(Value::object(ObjectVal::create(heap, shape, shape->slotCount())));
+        DISPATCH();
+    }
+    TARGET(InitProp)
+    {
+        uint16_t slot = READ_SHORT();
+        Value value = POP();
+        ObjectVal *object = PEEK(0).as<ObjectVal>();
+        object->slot(slot) = value;
+        heap.writeBarrier(object, value);
+        DISPATCH();
+    }
+    TARGET(InitPropWide)
+    {
+        uint32_t slot = READ_INT();
+        Value value = POP();
+        ObjectVal *object = PEEK(0).as<ObjectVal>();
+        object->slot(slot) = value;
+        heap.writeBarrier(object, value);
+        DISPATCH();
+    }
+    TARGET(GetProp)
+    {
+        Symbol key = chunk->names[READ_SHORT()];
+        PropertyCache &cache = chunk->caches[READ_SHORT()];
+        ObjectVal *object = to_object(PEEK(0), key);
+
+        int slot = cache.find(object->shape);
+        if (slot < 0)
+        {
+            slot = object->lookup(key);
+            if (slot >= 0 && !worker && object->shape)
+            {
+                cache.record(object->shape, static_cast<uint32_t>(slot));
+            }
+        }
+        PEEK(0) = slot < 0 ? Value::null() : object->slot(slot);
+        DISPATCH();
+    }
+    TARGET(SetProp)
+    {
+        Symbol key = chunk->names[READ_SHORT()];
+        PropertyCache &cache = chunk->caches[READ_SHORT()];
+        Value value = POP();
+        ObjectVal *object = to_object(PEEK(0), key);
+        if (worker && object->old)
+        {
+            throw SharedWrite();
+        }
+
+        int slot = cache.find(object->shape);
+        if (slot < 0)
+        {
+            // Adding a key changes the shape; only stores into an existing
+            // slot are worth caching.
+            slot = object->lookup(key);
+            if (slot >= 0 && !worker && object->shape)
+            {
+                cache.record(object->shape, static_cast<uint32_t>(slot));
+            }
+        }
+        if (slot >= 0)
+        {
+            object->slot(slot) = value;
+            heap.writeBarrier(object, value);
+        }
+        else
+        {
+            object->set(key, value);
+        }
+        PEEK(0) = value;
+        DISPATCH();
+    }
+    TARGET(NewArray)
+    {
+        uint16_t count = READ_SHORT();
+        ArrayVal *array = ArrayVal::create(heap, sp - count, count);
+        sp -= count;
+        PUSH(Value::object(array));
+        DISPATCH();
+    }
+    TARGET(AppendArray)
+    {
+        // The elements stay on the stack, and so rooted, until all are in.
+        uint16_t count = READ_SHORT();
+        ArrayVal *array = sp[-count - 1].as<ArrayVal>();
+        for (Value *element = sp - count; element < sp; element++)
+        {
+            array->set(array->size(), *element);
+        }
+        sp -= count;
+        DISPATCH();
+    }
+    TARGET(GetIndex)
+    {
+        Value key = POP();
+        if (worker && PEEK(0).type() == ValueType::Array && PEEK(0).asHeap()->old)
+        {
+            PEEK(0) = loadShared(PEEK(0).as<ArrayVal>(), key);
+        }
+        else
+        {
+            PEEK(0) = get_index(PEEK(0), key);
+        }
+        DISPATCH();
+    }
+    TARGET(SetIndex)
+    {
+        Value value = POP();
+        Value key = POP();
+        if (worker && PEEK(0).isHeap() && PEEK(0).asHeap()->old)
+        {
+            storeShared(PEEK(0), key, value);
+        }
+        else
+        {
+            set_index(PEEK(0), key, value);
+        }
+        PEEK(0) = value;
+        DISPATCH();
+    }
+    TARGET(Add)
+    {
+        NUMERIC_OP(Operator::Add);
+        DISPATCH();
+    }
+    TARGET(Sub)
+    {
+        NUMERIC_OP(Operator::Subtract);
+        DISPATCH();
+    }
+    TARGET(Mul)
+    {
+        NUMERIC_OP(Operator::Multiply);
+        DISPATCH();
+    }
+    TARGET(Div)
+    {
+        NUMERIC_OP(Operator::Divide);
+        DISPATCH();
+    }
+    TARGET(Mod)
+    {
+        NUMERIC_OP(Operator::Modulo);
+        DISPATCH();
+    }
+    TARGET(Less)
+    {
+        COMPARE(Operator::Less);
+        DISPATCH();
+    }
+    TARGET(LessEqual)
+    {
+        COMPARE(Operator::LessEqual);
+        DISPATCH();
+    }
+    TARGET(Greater)
+    {
+        COMPARE(Operator::Greater);
+        DISPATCH();
+    }
+    TARGET(GreaterEqual)
+    {
+        COMPARE(Operator::GreaterEqual);
+        DISPATCH();
+    }
+    TARGET(Equal)
+    {
+        COMPARE(Operator::Equal);
+        DISPATCH();
+    }
+    TARGET(NotEqual)
+    {
+        COMPARE(Operator::NotEqual);
+        DISPATCH();
+    }
+    TARGET(Jump)
+    {
+        // Every loop goes round through a Jump back to its condition.
+        heap.poll();
+        uint32_t target = READ_INT();
+        ip = chunk->code.data() + target;
+        DISPATCH();
+    }
+    TARGET(JumpIfFalse)
+    {
+        uint32_t target = READ_INT();
+        Value condition = POP();
+        if (condition.isBoolean() ? !condition.asBoolean() : !isTruthy(condition))
+        {
+            ip = chunk->code.data() + target;
+        }
+        DISPATCH();
+    }
+    TARGET(JumpUnlessLess)
+    {
+        COMPARE_AND_BRANCH(Operator::Less);
+        DISPATCH();
+    }
+    TARGET(JumpUnlessLessEqual)
+    {
+        COMPARE_AND_BRANCH(Operator::LessEqual);
+        DISPATCH();
+    }
+    TARGET(JumpUnlessGreater)
+    {
+        COMPARE_AND_BRANCH(Operator::Greater);
+        DISPATCH();
+    }
+    TARGET(JumpUnlessGreaterEqual)
+    {
+        COMPARE_AND_BRANCH(Operator::GreaterEqual);
+        DISPATCH();
+    }
+    TARGET(JumpUnlessEqual)
+    {
+        COMPARE_AND_BRANCH(Operator::Equal);
+        DISPATCH();
+    }
+    TARGET(JumpUnlessNotEqual)
+    {
+        COMPARE_AND_BRANCH(Operator::NotEqual);
+        DISPATCH();
+    }
+    TARGET(Call)
+    {
+        uint8_t argc = READ_BYTE();
+        frame->ip = ip;
+        callValue(PEEK(0), argc);
+        LOAD_FRAME();
+        DISPATCH();
+    }
+    TARGET(TailCall)
+    {
+        uint8_t argc = READ_BYTE();
+        frame->ip = ip;
+        if (tailCall(PEEK(0), argc))
+        {
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        // A native may have called back into the VM and moved the frames.
+        frame = &frames.back();
+        RETURN_FROM_FRAME()
+    }
+    TARGET(Return)
+    {
+        RETURN_FROM_FRAME()
+    }
+
+#if !defined(__GNUC__)
+        }
+    }
+#endif
+
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_INT
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef LOAD_FRAME
+#undef POLL_PROFILER
+#undef RETURN_FROM_FRAME
+#undef NUMERIC_OP
+#undef COMPARE
+#undef COMPARE_AND_BRANCH
+#undef DISPATCH
+#undef TARGET
+}
@@ -0,0 +1,119 @@
+#ifndef VM_H
+#define VM_H
+
+#include "Bytecode.h"
+#include "Environment.h"
+#include "Heap.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+struct CallFrame
+{
+    const FunctionProto *proto;
+    const uint8_t *ip;
+    Environment *env; // the function's own if captured, else the nearest enclosing one
+    Value *base;      // first stack slot owned by this frame; locals start here
+};
+
+// Stack-based interpreter for compiled FunctionProtos. Values live on one
+// contiguous stack that the collector scans as a root, alongside the
+// environment of every active frame. A call of an uncaptured function only
+// claims localCount slots on that stack; it allocates nothing.
+//
+// Functions called often enough are compiled to machine code (see Jit.h)
+// unless the JIT is disabled or the profiler is running, which can only
+// sample the interpreter. A compiled call that finishes pushes no frame.
+//
+// The parallel builtins (see Parallel.h) give each worker thread a VM of
+// its own on a scratch heap. A worker runs the owner's functions against
+// the owner's globals but writes none of the state the threads share: it
+// runs machine code but compiles none, leaves property caches alone,
+// resolves object literals to shapes of its own heap, and throws
+// SharedWrite rather than store into an object or environment it did not
+// allocate. The one exception is a number stored into an existing element
+// of a packed array at the index of the current call, which it records in
+// its SharedAccesses for the loop to make once every worker is done.
+struct SharedAccesses;
+
+class VM : public RootSource
+{
+private:
+    static constexpr size_t StackSize = 1024 * 1024;
+
+    Heap &heap;
+    Value *stack; // StackSize slots, mapped but only committed as they are used
+    Value *sp;
+    std::vector<CallFrame> frames;
+    Environment *globals = nullptr;
+    bool useJit = false;
+    bool worker = false;
+    std::unordered_map<const ObjectTemplate *, Shape *> workerShapes;
+    SharedAccesses *shared = nullptr;
+
+    template <bool Profiling>
+    Value execute(size_t entryDepth);
+    Environment *enterFunction(FunctionVal *function, Value *args, uint8_t argc, Value *base);
+    void callValue(Value callee, uint8_t argc);
+    bool tailCall(Value callee, uint8_t argc);
+    bool runCompiled(const FunctionProto *proto, Value *base, const uint8_t *&ip);
+    Environment *writableEnv(Environment *env, int depth) const;
+    Value loadShared(ArrayVal *array, Value key);
+    void storeShared(Value object, Value key, Value value);
+
+public:
+    VM(Heap &heap = Heap::current());
+    // A worker for owner, allocating on heap and recording what it does to
+    // the owner's arrays in shared.
+    VM(Heap &heap, const VM &owner, SharedAccesses &shared);
+    VM(const VM &) = delete;
+    VM &operator=(const VM &) = delete;
+    ~VM();
+
+    // The VM running on this thread, if any.
+    static VM *current();
+
+    Value run(const FunctionProto *script, Environment *env);
+    // Calls a function or native from native code running under this VM.
+    Value call(Value callee, NativeArgs args);
+    // Compiles proto ahead of its calls reaching the threshold, for a
+    // caller about to hand it to workers, which never compile.
+    void warmUp(const FunctionProto *proto);
+    void traceRoots(Heap &heap) override;
+};
+
+// Thrown by a worker VM in place of a write it may not make.
+struct SharedWrite
+{
+};
+
+// What one worker did to arrays of the owner's in the course of a loop.
+// Its stores wait here, so every call sees the arrays as they were before
+// the loop, apart from its own stores; a call that reads another element
+// of an array the loop stores into would have seen a different value had
+// the loop run in order, which the loop checks for before it makes them.
+struct SharedAccesses
+{
+    struct Store
+    {
+        ArrayVal *array;
+        int64_t index;
+        double value;
+    };
+
+    int64_t index = -1; // of the current call, the only element it may store
+    std::vector<Store> stores;
+    std::vector<const ArrayVal *> reads; // away from index
+
+    void read(const ArrayVal *array)
+    {
+        if (std::find(reads.begin(), reads.end(), array) == reads.end())
+        {
+            reads.push_back(array);
+        }
+    }
+};
+
+#endif // VM_H
@@ -0,0 +1,265 @@
+#include "Values.h"
+#include "Heap.h"
+#include "Environment.h"
+
+#include <algorithm>
+#include <thread>
+
+ObjectVal *ObjectVal::create(Heap &heap, Shape *shape, uint32_t capacity)
+{
+    return heap.allocateWithTrailing<ObjectVal>(capacity * sizeof(Value), shape, capacity);
+}
+
+ObjectVal *ObjectVal::create(Heap &heap)
+{
+    return create(heap, heap.emptyShape(), 4);
+}
+
+ObjectVal *ObjectVal::create(Heap &heap, std::vector<Symbol> keys)
+{
+    ObjectVal *object = create(heap, nullptr, static_cast<uint32_t>(keys.size()));
+    object->table = std::make_unique<PropertyTable>(std::move(keys));
+    return object;
+}
+
+void ObjectVal::set(Symbol key, Value value)
+{
+    int index = lookup(key);
+
+    if (index < 0)
+    {
+        if (shape && shape->slotCount() >= Shape::DictionaryLimit)
+        {
+            table = std::make_unique<PropertyTable>(shape->keys());
+            shape = nullptr;
+        }
+        if (shape)
+        {
+            shape = shape->withProperty(key);
+        }
+        else
+        {
+            table->add(key);
+        }
+        index = static_cast<int>(slotCount() - 1);
+
+        if (static_cast<uint32_t>(index) >= capacity)
+        {
+            spill.push_back(Value::null());
+        }
+    }
+
+    slot(index) = value;
+    Heap::current().writeBarrier(this, value);
+}
+
+void ObjectVal::trace(Heap &heap)
+{
+    for (uint32_t i = 0; i < slotCount(); i++)
+    {
+        heap.mark(slot(i));
+    }
+}
+
+ArrayVal *ArrayVal::create(Heap &heap, size_t count)
+{
+    ArrayVal *array = heap.allocate<ArrayVal>();
+    array->numbers.resize(count);
+    heap.resized(array, 0, array->storageBytes());
+    return array;
+}
+
+ArrayVal *ArrayVal::create(Heap &heap, const Value *elements, size_t count)
+{
+    ArrayVal *array = heap.allocate<ArrayVal>();
+    array->packed = std::all_of(elements, elements + count, [](Value value)
+                                { return value.isNumber(); });
+    if (array->packed)
+    {
+        array->numbers.reserve(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            array->numbers.push_back(elements[i].asNumber());
+        }
+    }
+    else
+    {
+        array->values.assign(elements, elements + count);
+    }
+    heap.resized(array, 0, array->storageBytes());
+    return array;
+}
+
+void ArrayVal::set(size_t index, Value value)
+{
+    Heap &heap = Heap::current();
+    size_t before = storageBytes();
+
+    if (packed && !value.isNumber())
+    {
+        box();
+    }
+
+    if (packed)
+    {
+        if (index == numbers.size())
+        {
+            numbers.push_back(value.asNumber());
+        }
+        else
+        {
+            numbers[index] = value.asNumber();
+        }
+    }
+    else
+    {
+        if (index == values.size())
+        {
+            values.push_back(value);
+        }
+        else
+        {
+            values[index] = value;
+        }
+        heap.writeBarrier(this, value);
+    }
+
+    heap.resized(this, before, storageBytes());
+}
+
+void ArrayVal::box()
+{
+    values.reserve(numbers.size() + 1);
+    for (double number : numbers)
+    {
+        values.push_back(Value::number(number));
+    }
+    numbers = std::vector<double>();
+    packed = false;
+}
+
+void ArrayVal::trace(Heap &heap)
+{
+    for (Value value : values)
+    {
+        heap.mark(value);
+    }
+}
+
+void FunctionVal::trace(Heap &heap)
+{
+    heap.mark(declarationEnv);
+}
+
+StringVal *StringVal::create(Heap &heap, std::string_view text)
+{
+    StringVal *string = heap.allocateWithTrailing<StringVal>(text.size(), text.size(), nullptr);
+    std::memcpy(string->inlineChars(), text.data(), text.size());
+    string->chars.store(string->inlineChars(), std::memory_order_relaxed);
+    return string;
+}
+
+StringVal *StringVal::literal(Heap &heap, Symbol text)
+{
+    const std::string &interned = text.str();
+    return heap.allocate<StringVal>(interned.size(), interned.data());
+}
+
+StringVal *StringVal::concat(Heap &heap, StringVal *left, StringVal *right)
+{
+    if (left->length == 0)
+    {
+        return right;
+    }
+    if (right->length == 0)
+    {
+        return left;
+    }
+
+    size_t length = left->length + right->length;
+    if (length <= InlineLimit)
+    {
+        // Short enough that both halves are flat; the collector does not
+        // move them, so the views survive the allocation.
+        std::string_view a = left->view();
+        std::string_view b = right->view();
+        StringVal *string = heap.allocateWithTrailing<StringVal>(length, length, nullptr);
+        std::memcpy(string->inlineChars(), a.data(), a.size());
+        std::memcpy(string->inlineChars() + a.size(), b.data(), b.size());
+        string->chars.store(string->inlineChars(), std::memory_order_relaxed);
+        return string;
+    }
+
+    // A short piece appended to a rope that ends in a short flat piece is
+    // merged into it, so a string built from many small appends keeps
+    // leaves of up to InlineLimit bytes rather than a node per append. A
+    // rope a parallel worker borrowed may be flattened under it, so it is
+    // left whole.
+    RootScope roots(heap);
+    if (!(heap.scratch && left->old) && !left->chars.load(std::memory_order_relaxed) &&
+        left->right->chars.load(std::memory_order_relaxed) && left->right->length + right->length <= InlineLimit)
+    {
+        right = roots.push(concat(heap, left->right, right));
+        left = left->left;
+    }
+
+    StringVal *rope = heap.allocate<StringVal>(length, nullptr);
+    rope->left = left;
+    rope->right = right;
+    return rope;
+}
+
+// Walks the rope with an explicit stack, since repeated appends build one
+// as deep as the number of pieces. Halves that are already flat are copied
+// whole.
+void StringVal::copyTo(char *out) const
+{
+    std::vector<const StringVal *> pending{this};
+    while (!pending.empty())
+    {
+        const StringVal *node = pending.back();
+        pending.pop_back();
+
+        if (const char *text = node->chars.load(std::memory_order_acquire))
+        {
+            std::memcpy(out, text, node->length);
+            out += node->length;
+            continue;
+        }
+        pending.push_back(node->right);
+        pending.push_back(node->left);
+    }
+}
+
+// The halves are dropped afterwards so they can be collected. Any other
+// thread that reads the rope meanwhile waits for the text instead.
+const char *StringVal::flatten() const
+{
+    if (flattening.exchange(true, std::memory_order_acquire))
+    {
+        const char *text;
+        while (!(text = chars.load(std::memory_order_acquire)))
+        {
+            std::this_thread::yield();
+        }
+        return text;
+    }
+
+    std::unique_ptr<char[]> buffer(new char[length]);
+    copyTo(buffer.get());
+
+    const char *text = buffer.get();
+    flattened = std::move(buffer);
+    left = right = nullptr;
+    chars.store(text, std::memory_order_release);
+
+    StringVal *self = const_cast<StringVal *>(this);
+    Heap::current().resized(self, 0, length);
+    return text;
+}
+
+void StringVal::trace(Heap &heap)
+{
+    heap.mark(left);
+    heap.mark(right);
+}
@@ -2,13 +2,23 @@
 #define VALUES_H
 
 #include "../frontend/Ast.h"
+#include "../frontend/Symbol.h"
+#include "Shape.h"
 #include <unordered_map>
 #include <string>
 #include <vector>
-#include <functional>
 #include <sstream>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <memory>
+#include <new>
+#include <string_view>
+#include <atomic>
 
 class Environment;
+class Heap;
+struct FunctionProto;
 
 enum class ValueType
 {
@@ -18,59 +28,251 @@ enum class ValueType
     Object,
     NativeFn,
     Function,
-    String
+    String,
+    Array
 };
 
-struct RuntimeVal
+// Header shared by everything the collector manages: heap values and
+// environments. Objects start in the nursery and are promoted to the old
+// generation when they survive a minor collection.
+struct GcObject
+{
+    GcObject *next = nullptr;
+    uint32_t size = 0;
+    bool marked = false;
+    bool old = false;
+    bool remembered = false;
+    uint8_t kind = 0; // what the heap counts it under, see HeapKinds
+
+    virtual ~GcObject() = default;
+    virtual void trace(Heap &heap) { (void)heap; }
+};
+
+// Base of every heap-allocated value. Numbers, booleans and null never
+// reach the heap; they are stored inline in a Value.
+struct RuntimeVal : GcObject
 {
     ValueType type;
     virtual ~RuntimeVal() = default;
     virtual std::string toString() const = 0; // Add a virtual toString method
 };
 
-struct NullVal : RuntimeVal
+// A NaN-boxed 64-bit value. Doubles are stored as their raw bits; every
+// other kind lives in the payload of a quiet NaN that no arithmetic result
+// can produce. Heap values additionally set the sign bit and keep the
+// RuntimeVal pointer in the low 48 bits.
+//
+// Numbers come in two representations: doubles, and integers that fit in
+// 48 bits, which set IntTag and keep the value in the low 48 bits. Both are
+// ValueType::Number and asNumber() reads either; an int is only a faster
+// way to hold an integral number, never a different value from the
+// equivalent double.
+class Value
 {
-    NullVal()
+private:
+    static constexpr uint64_t SignBit = 0x8000000000000000ull;
+    static constexpr uint64_t QuietNaN = 0x7ffc000000000000ull;
+    static constexpr uint64_t CanonicalNaN = 0x7ff8000000000000ull;
+
+    static constexpr uint64_t TagNull = 1;
+    static constexpr uint64_t TagFalse = 2;
+    static constexpr uint64_t TagTrue = 3;
+
+    static constexpr uint64_t IntTag = 0x0002000000000000ull;
+    static constexpr uint64_t PayloadMask = 0x0000ffffffffffffull;
+
+    uint64_t bits;
+
+    explicit constexpr Value(uint64_t bits) : bits(bits) {}
+
+public:
+    constexpr Value() : bits(QuietNaN | TagNull) {}
+
+    static Value number(double value)
     {
-        type = ValueType::Null;
+        if (value != value)
+        {
+            return Value(CanonicalNaN);
+        }
+
+        uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        return Value(bits);
     }
-    std::string toString() const override { return "null"; }
-};
 
-struct NumberVal : RuntimeVal
-{
-    double value;
+    static constexpr int64_t MinInt = -(int64_t(1) << 47);
+    static constexpr int64_t MaxInt = (int64_t(1) << 47) - 1;
 
-    NumberVal(double val)
+    // An int when the value fits, otherwise the nearest double.
+    static Value integer(int64_t value)
     {
-        type = ValueType::Number;
-        value = val;
+        if (value < MinInt || value > MaxInt)
+        {
+            return number(static_cast<double>(value));
+        }
+        return Value(QuietNaN | IntTag | (static_cast<uint64_t>(value) & PayloadMask));
     }
 
-    std::string toString() const override
+    // Integral values that fit are stored as ints, so literals and folded
+    // constants start out on the integer fast paths.
+    static Value canonicalNumber(double value)
     {
-        std::ostringstream oss;
-        oss << value;
-        return oss.str();
+        if (value >= MinInt && value <= MaxInt && value == static_cast<double>(static_cast<int64_t>(value)) &&
+            !(value == 0 && std::signbit(value)))
+        {
+            return integer(static_cast<int64_t>(value));
+        }
+        return number(value);
+    }
+
+    static constexpr Value null() { return Value(QuietNaN | TagNull); }
+    static constexpr Value boolean(bool value) { return Value(QuietNaN | (value ? TagTrue : TagFalse)); }
+
+    static Value object(RuntimeVal *value)
+    {
+        return Value(SignBit | QuietNaN | reinterpret_cast<uintptr_t>(value));
+    }
+
+    bool isDouble() const { return (bits & QuietNaN) != QuietNaN; }
+    bool isInt() const { return (bits & (SignBit | QuietNaN | IntTag)) == (QuietNaN | IntTag); }
+    bool isNumber() const { return isDouble() || isInt(); }
+    bool isNull() const { return bits == (QuietNaN | TagNull); }
+    bool isBoolean() const { return (bits | 1) == (QuietNaN | TagTrue); }
+    bool isHeap() const { return (bits & (SignBit | QuietNaN)) == (SignBit | QuietNaN); }
+
+    // Sign-extends the 48-bit payload.
+    int64_t asInt() const { return static_cast<int64_t>(bits << 16) >> 16; }
+
+    double asNumber() const
+    {
+        if (isInt())
+        {
+            return static_cast<double>(asInt());
+        }
+
+        double value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    bool asBoolean() const { return bits == (QuietNaN | TagTrue); }
+
+    RuntimeVal *asHeap() const
+    {
+        return reinterpret_cast<RuntimeVal *>(static_cast<uintptr_t>(bits & ~(SignBit | QuietNaN)));
+    }
+
+    template <typename T>
+    T *as() const
+    {
+        return static_cast<T *>(asHeap());
+    }
+
+    ValueType type() const
+    {
+        if (isNumber())
+            return ValueType::Number;
+        if (isHeap())
+            return asHeap()->type;
+        if (isBoolean())
+            return ValueType::Boolean;
+        return ValueType::Null;
+    }
+
+    uint64_t raw() const { return bits; }
+
+    bool operator==(const Value &other) const { return bits == other.bits; }
+    bool operator!=(const Value &other) const { return bits != other.bits; }
+
+    std::string toString() const
+    {
+        if (isInt())
+        {
+            return std::to_string(asInt());
+        }
+        if (isDouble())
+        {
+            // Integral doubles print like the equal int would, up to 2^53,
+            // past which a double no longer holds every integer.
+            double value = asNumber();
+            if (std::fabs(value) <= 9007199254740992.0 && value == std::trunc(value) && !(value == 0 && std::signbit(value)))
+            {
+                return std::to_string(static_cast<int64_t>(value));
+            }
+
+            std::ostringstream oss;
+            oss << value;
+            return oss.str();
+        }
+        if (isHeap())
+            return asHeap()->toString();
+        if (isBoolean())
+            return asBoolean() ? "true" : "false";
+        return "null";
     }
 };
 
+static_assert(sizeof(Value) == 8, "Value must stay a single machine word");
+
+// Property values live in slots laid out by the object's Shape. The first
+// `capacity` slots are stored inline, directly after the object itself;
+// properties added beyond that spill into a side vector. Create objects
+// with ObjectVal::create so the inline slots are allocated with them.
+// An object with more than Shape::DictionaryLimit keys drops its shape and
+// keeps its own PropertyTable instead.
 struct ObjectVal : RuntimeVal
 {
-    std::unordered_map<std::string, RuntimeVal *> properties;
+    Shape *shape; // null in dictionary mode
+    std::unique_ptr<PropertyTable> table;
+    uint32_t capacity;
+    std::vector<Value> spill;
 
-    ObjectVal()
+    ObjectVal(Shape *shape, uint32_t capacity) : shape(shape), capacity(capacity)
     {
         type = ValueType::Object;
+        for (uint32_t i = 0; i < capacity; i++)
+        {
+            new (&inlineSlots()[i]) Value();
+        }
+    }
+
+    // Objects are allocated with trailing storage, so they must be freed
+    // without the size of the static type.
+    static void operator delete(void *memory) { ::operator delete(memory); }
+
+    static ObjectVal *create(Heap &heap, Shape *shape, uint32_t capacity);
+    static ObjectVal *create(Heap &heap);
+    // A dictionary-mode object with `keys` in slot order, all null.
+    static ObjectVal *create(Heap &heap, std::vector<Symbol> keys);
+
+    Value *inlineSlots() { return reinterpret_cast<Value *>(this + 1); }
+    const Value *inlineSlots() const { return reinterpret_cast<const Value *>(this + 1); }
+
+    Value &slot(uint32_t index) { return index < capacity ? inlineSlots()[index] : spill[index - capacity]; }
+    Value slot(uint32_t index) const { return index < capacity ? inlineSlots()[index] : spill[index - capacity]; }
+
+    int lookup(Symbol key) const { return shape ? shape->lookup(key) : table->lookup(key); }
+    uint32_t slotCount() const { return shape ? shape->slotCount() : static_cast<uint32_t>(table->keys.size()); }
+    std::vector<Symbol> keys() const { return shape ? shape->keys() : table->keys; }
+
+    Value get(Symbol key) const
+    {
+        int index = lookup(key);
+        return index < 0 ? Value::null() : slot(index);
     }
 
+    void set(Symbol key, Value value);
+
+    void trace(Heap &heap) override;
+
     std::string toString() const override
     {
         std::ostringstream oss;
         oss << "{";
-        for (const auto &pair : properties)
+        std::vector<Symbol> names = keys();
+        for (uint32_t i = 0; i < names.size(); i++)
         {
-            oss << pair.first << ": " << pair.second->toString() << ", ";
+            oss << names[i].str() << ": " << slot(i).toString() << ", ";
         }
         std::string result = oss.str();
         if (result.length() > 1)
@@ -82,44 +284,148 @@ struct ObjectVal : RuntimeVal
     }
 };
 
-struct StringVal : RuntimeVal
+// Elements indexed from 0. While every element is a number they are kept
+// unboxed in one contiguous block, which the bulk builtins in ArrayOps.h
+// work on directly; storing anything else boxes the array for good. The
+// element storage is charged to the heap, so large arrays count towards
+// collections like any other allocation.
+struct ArrayVal : RuntimeVal
 {
-    std::string value;
+    std::vector<double> numbers; // the elements while packed
+    std::vector<Value> values;   // the elements once boxed
+    bool packed = true;
 
-    StringVal(const std::string &val)
+    ArrayVal()
     {
-        type = ValueType::String;
-        value = val;
+        type = ValueType::Array;
     }
 
+    // A packed array of `count` zeros.
+    static ArrayVal *create(Heap &heap, size_t count);
+    static ArrayVal *create(Heap &heap, const Value *elements, size_t count);
+
+    size_t size() const { return packed ? numbers.size() : values.size(); }
+
+    Value get(size_t index) const
+    {
+        if (index >= size())
+        {
+            return Value::null();
+        }
+        return packed ? Value::number(numbers[index]) : values[index];
+    }
+
+    // index may be at most size(), which appends.
+    void set(size_t index, Value value);
+
+    void trace(Heap &heap) override;
+
     std::string toString() const override
     {
-        return value;
+        std::ostringstream oss;
+        oss << "[";
+        for (size_t i = 0; i < size(); i++)
+        {
+            oss << (i ? ", " : "") << get(i).toString();
+        }
+        oss << "]";
+        return oss.str();
     }
+
+private:
+    size_t storageBytes() const { return numbers.capacity() * sizeof(double) + values.capacity() * sizeof(Value); }
+    void box();
 };
 
-struct BooleanVal : RuntimeVal
+// Immutable text in one of three forms:
+// - flat: the bytes follow the object in its own allocation, as for every
+//   string built at runtime up to InlineLimit bytes;
+// - literal: a view of interned text, which lives as long as the process;
+// - rope: the concatenation of two strings, kept as its halves until its
+//   text is first read and then flattened into one buffer.
+// Concatenating past InlineLimit never copies either side, so building a
+// string piece by piece takes linear time overall. Create strings with the
+// static functions so they are laid out and charged to the heap properly.
+struct StringVal : RuntimeVal
 {
-    bool value;
-    BooleanVal(bool val = true)
+    static constexpr size_t InlineLimit = 64;
+
+    const size_t length;
+
+private:
+    // Null while a rope is unflattened. Ropes of the caller's heap may be
+    // read by parallel workers (see Parallel.h), so the first reader claims
+    // the rope through flattening and publishes the text here.
+    mutable std::atomic<const char *> chars;
+    mutable std::atomic<bool> flattening{false};
+    mutable StringVal *left = nullptr;
+    mutable StringVal *right = nullptr;
+    mutable std::unique_ptr<char[]> flattened;
+
+    char *inlineChars() { return reinterpret_cast<char *>(this + 1); }
+    const char *flatten() const;
+
+public:
+    StringVal(size_t length, const char *chars) : length(length), chars(chars)
+    {
+        type = ValueType::String;
+    }
+
+    // Flat strings are allocated with trailing storage, so they must be
+    // freed without the size of the static type.
+    static void operator delete(void *memory) { ::operator delete(memory); }
+
+    static StringVal *create(Heap &heap, std::string_view text);
+    static StringVal *literal(Heap &heap, Symbol text);
+    // Both halves must stay rooted until it returns.
+    static StringVal *concat(Heap &heap, StringVal *left, StringVal *right);
+
+    // Writes the text to out, which has room for length bytes, leaving a
+    // rope as it is.
+    void copyTo(char *out) const;
+
+    std::string_view view() const
     {
-        type = ValueType::Boolean;
-        value = val;
+        const char *text = chars.load(std::memory_order_acquire);
+        return std::string_view(text ? text : flatten(), length);
     }
 
+    void trace(Heap &heap) override;
+
     std::string toString() const override
     {
-        return value ? "true" : "false";
+        return std::string(view());
     }
 };
 
-using FunctionCall = std::function<RuntimeVal *(std::vector<RuntimeVal *>, Environment *)>;
+// Arguments of a native call: a view of the caller's values, which stay
+// rooted for the duration of the call. Missing arguments read as null.
+struct NativeArgs
+{
+    const Value *values;
+    size_t count;
+
+    size_t size() const { return count; }
+    Value operator[](size_t index) const { return index < count ? values[index] : Value::null(); }
+    const Value *begin() const { return values; }
+    const Value *end() const { return values + count; }
+
+    NativeArgs from(size_t index) const
+    {
+        return index < count ? NativeArgs{values + index, count - index} : NativeArgs{values + count, 0};
+    }
+};
+
+// Natives are plain function pointers; typed C++ functions are adapted to
+// this signature at compile time by native<F>() in Native.h.
+using NativeCall = Value (*)(NativeArgs args);
 
 struct NativeFunctionVal : RuntimeVal
 {
-    FunctionCall call;
+    NativeCall call;
+    bool parallel = true; // whether parallel workers may call it, see Parallel.h
 
-    NativeFunctionVal(FunctionCall call) : call(call)
+    NativeFunctionVal(NativeCall call) : call(call)
     {
         type = ValueType::NativeFn;
     }
@@ -133,19 +439,24 @@ struct NativeFunctionVal : RuntimeVal
 struct FunctionVal : RuntimeVal
 {
     std::vector<Stmt *> body;
-    std::string name;
-    std::vector<std::string> parameters;
+    Symbol name;
+    std::vector<Symbol> parameters;
     Environment *declarationEnv;
+    int localCount = 0;
+    uint32_t line = 0; // of the declaration
+    const FunctionProto *proto = nullptr; // set when created by the VM
 
-    FunctionVal(std::vector<Stmt *> body, const std::string &name, std::vector<std::string> parameters, Environment *env)
+    FunctionVal(std::vector<Stmt *> body, Symbol name, std::vector<Symbol> parameters, Environment *env)
         : body(body), name(name), parameters(parameters), declarationEnv(env)
     {
         type = ValueType::Function;
     }
 
+    void trace(Heap &heap) override;
+
     std::string toString() const override
     {
-        return "<function " + name + ">";
+        return "<function " + name.str() + ">";
     }
 };
 